@@ -157,13 +157,20 @@ namespace Essence { namespace Graphics
   {
     AbpContext ctx(mod_fs);
     ctx.import(path);
-    vector<unique_ptr<const ChunkyFile>> files;
+    vector<string> paths;
     for(string path : ctx)
+      paths.push_back(move(path));
+
+    // Read as one batch, so that the files are read in archive order rather than list order.
+    auto mapped_files = mod_fs->readFiles(paths);
+    vector<unique_ptr<const ChunkyFile>> files;
+    for(size_t i = 0; i < paths.size(); ++i)
     {
-      auto file = mod_fs->readFile(path);
+      auto& path = paths[i];
+      auto file = move(mapped_files[i]);
       if(file->getSize() == 0)
         throw runtime_error(path + " is empty.");
-      if(auto chunky = ChunkyFile::Open(move(file)))
+      if(auto chunky = ChunkyFile::OpenIndexed(move(file)))
         files.push_back(move(chunky));
       else
         throw runtime_error(path + " is not a chunky file.");
@@ -2,6 +2,7 @@
 #include "c6ui/app.h"
 #include "main_window.h"
 #include "containers.h"
+#include "arena.h"
 using namespace std;
 
 namespace C6 { namespace UI
@@ -32,6 +33,11 @@ namespace C6 { namespace UI
     if(args.size() < 2)
       throw std::runtime_error("Usage: " + args.at(0) + " <.module file path> [.rgm file path]");
 
+    char stats_path[MAX_PATH];
+    auto stats_path_length = GetEnvironmentVariableA("COH2EXPLORER_ARENA_STATS", stats_path, MAX_PATH);
+    if(stats_path_length != 0 && stats_path_length < MAX_PATH)
+      ArenaTelemetry::DumpOnExit(stats_path);
+
     auto window = new MainWindow(factories, args[1].c_str(), args.size() >= 2 ? args[2].c_str() : nullptr);
   }
 
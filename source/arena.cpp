@@ -1,42 +1,399 @@
 #include "stdafx.h"
 #include "arena.h"
+#include <map>
+#include <mutex>
+#include <stdio.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#define MEMORY_ALLOCATION_ALIGNMENT 16
+#endif
+
+static void* AllocateFromOS(size_t size)
+{
+#ifdef _WIN32
+  return VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+  auto mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  return mem == MAP_FAILED ? nullptr : mem;
+#endif
+}
+
+static void ReleaseToOS(void* mem, size_t size)
+{
+#ifdef _WIN32
+  VirtualFree(mem, 0, MEM_RELEASE);
+#else
+  munmap(mem, size);
+#endif
+}
+
+namespace
+{
+  //! Blocks which arenas have finished with, kept zero-filled for reuse by later arenas.
+  /*!
+    Arena blocks are always power-of-two sized, so there is one free list per size, threaded
+    through the first word of each block.
+  */
+  class BlockPool
+  {
+  public:
+    BlockPool()
+      : m_num_blocks(0)
+      , m_num_bytes(0)
+      , m_budget(64 * 1024 * 1024)
+      , m_hits(0)
+      , m_misses(0)
+    {
+      memset(m_free, 0, sizeof(m_free));
+    }
+
+    void* take(size_t size)
+    {
+      {
+        std::lock_guard<std::mutex> lock(m_lock);
+        auto& head = m_free[sizeClass(size)];
+        if(head)
+        {
+          auto block = head;
+          head = *static_cast<void**>(block);
+          *static_cast<void**>(block) = nullptr;
+          --m_num_blocks;
+          m_num_bytes -= size;
+          ++m_hits;
+          return block;
+        }
+        ++m_misses;
+      }
+      return AllocateFromOS(size);
+    }
+
+    //! Keep a zero-filled block, or release it to the OS if the pool is full.
+    void give(void* block, size_t size)
+    {
+      {
+        std::lock_guard<std::mutex> lock(m_lock);
+        if(m_num_bytes + size <= m_budget)
+        {
+          auto& head = m_free[sizeClass(size)];
+          *static_cast<void**>(block) = head;
+          head = block;
+          ++m_num_blocks;
+          m_num_bytes += size;
+          return;
+        }
+      }
+      ReleaseToOS(block, size);
+    }
+
+    void setBudget(uint64_t budget)
+    {
+      std::vector<std::pair<void*, size_t>> evicted;
+      {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_budget = budget;
+        for(size_t size_class = 0; m_num_bytes > m_budget && size_class < num_size_classes; ++size_class)
+        {
+          auto size = static_cast<size_t>(1) << size_class;
+          auto& head = m_free[size_class];
+          while(head && m_num_bytes > m_budget)
+          {
+            evicted.push_back(std::make_pair(head, size));
+            head = *static_cast<void**>(head);
+            --m_num_blocks;
+            m_num_bytes -= size;
+          }
+        }
+      }
+      for(auto& block : evicted)
+        ReleaseToOS(block.first, block.second);
+    }
+
+    Arena::BlockPoolStats getStats()
+    {
+      std::lock_guard<std::mutex> lock(m_lock);
+      Arena::BlockPoolStats stats = {m_num_blocks, m_num_bytes, m_budget, m_hits, m_misses};
+      return stats;
+    }
+
+  private:
+    static const size_t num_size_classes = sizeof(size_t) * 8;
+
+    static size_t sizeClass(size_t size)
+    {
+      size_t size_class = 0;
+      while((static_cast<size_t>(1) << size_class) < size)
+        ++size_class;
+      return size_class;
+    }
+
+    std::mutex m_lock;
+    void* m_free[num_size_classes];
+    uint64_t m_num_blocks;
+    uint64_t m_num_bytes;
+    uint64_t m_budget;
+    uint64_t m_hits;
+    uint64_t m_misses;
+  } g_block_pool;
+}
+
+namespace
+{
+  class ArenaRegistry
+  {
+  public:
+    struct retired_t
+    {
+      retired_t()
+        : num_arenas(0)
+      {
+        memset(&totals, 0, sizeof(totals));
+      }
+
+      uint64_t num_arenas;
+      ArenaStats totals; //!< Sums, except for peak_bytes_reserved, which is the largest peak.
+    };
+
+    ArenaRegistry()
+      : m_live(nullptr)
+    {
+    }
+
+    //! Link an arena in at the head of the live list; the lock is only held for a few stores.
+    void add(ArenaTelemetry::Registration& registration, const char* name, const ArenaStats* stats)
+    {
+      registration.name = name;
+      registration.stats = stats;
+      registration.prev = nullptr;
+      std::lock_guard<std::mutex> lock(m_lock);
+      registration.next = m_live;
+      if(m_live)
+        m_live->prev = &registration;
+      m_live = &registration;
+    }
+
+    //! Unlink an arena, and fold its counters into the totals for its name. Only the first arena
+    //! to be destroyed with a given name allocates anything (the map node for the name).
+    void remove(ArenaTelemetry::Registration& registration)
+    {
+      std::lock_guard<std::mutex> lock(m_lock);
+      if(registration.prev)
+        registration.prev->next = registration.next;
+      else
+        m_live = registration.next;
+      if(registration.next)
+        registration.next->prev = registration.prev;
+
+      auto stats = registration.stats;
+      auto& retired = m_retired[registration.name];
+      retired.num_arenas += 1;
+      retired.totals.num_allocations += stats->num_allocations;
+      retired.totals.bytes_requested += stats->bytes_requested;
+      retired.totals.bytes_wasted += stats->bytes_wasted;
+      retired.totals.num_blocks += stats->num_blocks;
+      retired.totals.bytes_reserved += stats->bytes_reserved;
+      if(stats->peak_bytes_reserved > retired.totals.peak_bytes_reserved)
+        retired.totals.peak_bytes_reserved = stats->peak_bytes_reserved;
+    }
+
+    std::string toJSON()
+    {
+      std::string json = "{\n  \"live\": [";
+      std::lock_guard<std::mutex> lock(m_lock);
+      const char* separator = "\n";
+      for(auto live = m_live; live; live = live->next)
+      {
+        json += separator;
+        json += "    {\"name\": " + quote(live->name) + ", " + fields(*live->stats) + "}";
+        separator = ",\n";
+      }
+      json += "\n  ],\n  \"destroyed\": [";
+      separator = "\n";
+      for(auto itr = m_retired.begin(); itr != m_retired.end(); ++itr)
+      {
+        json += separator;
+        json += "    {\"name\": " + quote(itr->first) + ", \"count\": " + std::to_string(itr->second.num_arenas) + ", " + fields(itr->second.totals) + "}";
+        separator = ",\n";
+      }
+      auto pool = g_block_pool.getStats();
+      json += "\n  ],\n  \"block_pool\": {\"blocks\": " + std::to_string(pool.num_blocks) + ", \"bytes\": " + std::to_string(pool.num_bytes)
+            + ", \"budget\": " + std::to_string(pool.budget) + ", \"hits\": " + std::to_string(pool.hits) + ", \"misses\": " + std::to_string(pool.misses) + "}\n}\n";
+      return json;
+    }
+
+  private:
+    static std::string quote(const std::string& s)
+    {
+      std::string quoted = "\"";
+      for(auto c : s)
+      {
+        if(c == '"' || c == '\\')
+          quoted += '\\';
+        quoted += c;
+      }
+      return quoted + "\"";
+    }
+
+    static std::string fields(const ArenaStats& stats)
+    {
+      return "\"allocations\": " + std::to_string(stats.num_allocations)
+        + ", \"bytes_requested\": " + std::to_string(stats.bytes_requested)
+        + ", \"bytes_wasted\": " + std::to_string(stats.bytes_wasted)
+        + ", \"blocks\": " + std::to_string(stats.num_blocks)
+        + ", \"bytes_reserved\": " + std::to_string(stats.bytes_reserved)
+        + ", \"peak_bytes_reserved\": " + std::to_string(stats.peak_bytes_reserved);
+    }
+
+    //! Names are compared by content, as the same literal may have different addresses in different modules.
+    struct name_less
+    {
+      bool operator() (const char* lhs, const char* rhs) const { return strcmp(lhs, rhs) < 0; }
+    };
+
+    std::mutex m_lock;
+    ArenaTelemetry::Registration* m_live;
+    std::map<const char*, retired_t, name_less> m_retired;
+  } g_arena_registry;
+
+  std::string g_dump_on_exit_path;
+
+  void DumpArenaStats()
+  {
+    if(auto f = fopen(g_dump_on_exit_path.c_str(), "wb"))
+    {
+      auto json = g_arena_registry.toJSON();
+      fwrite(json.data(), 1, json.size(), f);
+      fclose(f);
+    }
+  }
+}
+
+namespace ArenaTelemetry
+{
+  void Register(Registration& registration, const char* name, const ArenaStats* stats)
+  {
+    g_arena_registry.add(registration, name, stats);
+  }
 
-Arena::Arena()
+  void Unregister(Registration& registration)
+  {
+    g_arena_registry.remove(registration);
+  }
+
+  std::string ToJSON()
+  {
+    return g_arena_registry.toJSON();
+  }
+
+  void DumpOnExit(const std::string& path)
+  {
+    if(g_dump_on_exit_path.empty())
+      atexit(DumpArenaStats);
+    g_dump_on_exit_path = path;
+  }
+}
+
+static bool end_of_objects(char*&)
+{
+  return false;
+}
+
+void Arena::setBlockPoolBudget(uint64_t budget)
+{
+  g_block_pool.setBudget(budget);
+}
+
+Arena::BlockPoolStats Arena::getBlockPoolStats()
+{
+  return g_block_pool.getStats();
+}
+
+Arena::Arena(const char* name)
   : m_cur_block(nullptr)
   , m_bump(nullptr)
   , m_end(nullptr)
-#ifdef _DEBUG
-  , m_amount_from_os(0)
-  , m_amount_trivial(0)
-  , m_amount_nontrivial(0)
-  , m_num_trivial(0)
-  , m_num_nontrivial(0)
-#endif
+  , m_pinned(nullptr)
+  , m_name(name)
 {
+  memset(&m_stats, 0, sizeof(m_stats));
+  ArenaTelemetry::Register(m_registration, name, &m_stats);
 }
 
 Arena::~Arena()
 {
+  ArenaTelemetry::Unregister(m_registration);
   auto block = m_cur_block;
+  auto bump = m_bump, end = m_end;
   while(block)
   {
-    auto mem = reinterpret_cast<char*>(block + 1);
-    for(;;)
-    {
-      auto deleter = reinterpret_cast<bool(**)(char*&)>(mem);
-      mem = reinterpret_cast<char*>(deleter + 1);
-      if(!(*deleter)(mem))
-        break;
-    }
+    runDeleters(reinterpret_cast<char*>(block + 1));
     auto prev = block->prev;
-    VirtualFree(block, 0, MEM_RELEASE);
+    releaseBlock(block, bump, end);
     block = prev;
+    if(block)
+    {
+      bump = block->bump;
+      end = block->end;
+    }
   }
 }
 
-static bool end_of_objects(char*&)
+void Arena::runDeleters(char* mem)
 {
-  return false;
+  for(;;)
+  {
+    auto deleter = reinterpret_cast<bool(**)(char*&)>(mem);
+    mem = reinterpret_cast<char*>(deleter + 1);
+    if(!(*deleter)(mem))
+      break;
+  }
+}
+
+void Arena::releaseBlock(Block* block, char* bump, char* end)
+{
+  // Only the parts of the block which were handed out (plus the end-of-objects marker at bump)
+  // can be dirty, so zero-filling those is all that is needed before the block can be reused.
+  auto size = block->size;
+  memset(end, 0, reinterpret_cast<char*>(block) + size - end);
+  memset(block, 0, bump + sizeof(void*) - reinterpret_cast<char*>(block));
+  g_block_pool.give(block, size);
+}
+
+Arena::Checkpoint Arena::checkpoint() const
+{
+  // Rewinding runs deleters from mark.bump onwards, so a growable block ending there must stay put.
+  m_pinned = m_bump;
+  Checkpoint mark;
+  mark.block = m_cur_block;
+  mark.bump = m_bump;
+  mark.end = m_end;
+  return mark;
+}
+
+void Arena::rewind(const Checkpoint& mark)
+{
+  while(m_cur_block != mark.block)
+  {
+    runtime_assert(m_cur_block != nullptr, "Cannot rewind an arena to a checkpoint which it has already passed.");
+    auto block = m_cur_block;
+    runDeleters(reinterpret_cast<char*>(block + 1));
+    m_cur_block = block->prev;
+    m_stats.num_blocks -= 1;
+    m_stats.bytes_reserved -= block->size;
+    releaseBlock(block, m_bump, m_end);
+    m_bump = m_cur_block ? m_cur_block->bump : nullptr;
+    m_end = m_cur_block ? m_cur_block->end : nullptr;
+  }
+  if(m_cur_block)
+  {
+    // Objects allocated after the checkpoint begin at the checkpoint's end-of-objects marker.
+    runDeleters(mark.bump);
+    memset(mark.bump, 0, m_bump + sizeof(void*) - mark.bump);
+    memset(m_end, 0, mark.end - m_end);
+    m_bump = mark.bump;
+    m_end = mark.end;
+    *reinterpret_cast<bool(**)(char*&)>(m_bump) = end_of_objects;
+  }
+  m_pinned = mark.bump;
 }
 
 void Arena::ensureSpace(size_t full_size)
@@ -49,13 +406,22 @@ void Arena::ensureSpace(size_t full_size)
       block_size <<= 1;
     block_size <<= 1;
 
-    auto new_block = static_cast<Block*>(VirtualAlloc(nullptr, block_size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));
+    auto new_block = static_cast<Block*>(g_block_pool.take(block_size));
     if(!new_block)
       throw std::bad_alloc();
-#ifdef _DEBUG
-    m_amount_from_os += block_size;
-#endif
+    m_stats.num_blocks += 1;
+    m_stats.bytes_reserved += block_size;
+    if(m_stats.bytes_reserved > m_stats.peak_bytes_reserved)
+      m_stats.peak_bytes_reserved = m_stats.bytes_reserved;
+    m_stats.bytes_wasted += sizeof(Block);
+    if(m_cur_block)
+    {
+      m_stats.bytes_wasted += m_end - m_bump;
+      m_cur_block->bump = m_bump;
+      m_cur_block->end = m_end;
+    }
     new_block->prev = m_cur_block;
+    new_block->size = block_size;
     m_cur_block = new_block;
     m_bump = reinterpret_cast<char*>(new_block + 1);
     m_end = reinterpret_cast<char*>(new_block) + block_size;
@@ -69,27 +435,86 @@ void Arena::align(size_t& size)
 
 void* Arena::malloc(size_t size)
 {
+  auto requested_size = size;
   align(size);
   ensureSpace(size + sizeof(bool(*)(char*&)));
 
-#ifdef _DEBUG
-  m_num_trivial += 1;
-  m_amount_trivial += size;
-#endif
+  m_stats.num_allocations += 1;
+  m_stats.bytes_requested += requested_size;
+  m_stats.bytes_wasted += size - requested_size;
 
   m_end -= size;
   *reinterpret_cast<bool(**)(char*&)>(m_bump) = end_of_objects;
   return static_cast<void*>(m_end);
 }
 
+// Growable blocks sit amongst the objects as [skip_growable][padding][size][contents], with size
+// (a multiple of the pointer size, so that whatever follows stays aligned) directly before the
+// aligned contents.
+static char* growable_contents(char* after_deleter)
+{
+  auto addr = reinterpret_cast<uintptr_t>(after_deleter + sizeof(size_t));
+  addr = (addr + MEMORY_ALLOCATION_ALIGNMENT - 1) &~ static_cast<uintptr_t>(MEMORY_ALLOCATION_ALIGNMENT - 1);
+  return reinterpret_cast<char*>(addr);
+}
+
+static size_t& growable_size(char* contents)
+{
+  return reinterpret_cast<size_t*>(contents)[-1];
+}
+
+static bool skip_growable(char*& mem)
+{
+  auto contents = growable_contents(mem);
+  mem = contents + growable_size(contents);
+  return true;
+}
+
+void* Arena::mallocGrowable(size_t size)
+{
+  auto requested_size = size;
+  size = (size + sizeof(void*) - 1) &~ (sizeof(void*) - 1);
+  ensureSpace(sizeof(void*) + sizeof(size_t) + MEMORY_ALLOCATION_ALIGNMENT - 1 + size + sizeof(void*));
+
+  *reinterpret_cast<bool(**)(char*&)>(m_bump) = skip_growable;
+  auto contents = growable_contents(m_bump + sizeof(void*));
+  growable_size(contents) = size;
+
+  m_stats.num_allocations += 1;
+  m_stats.bytes_requested += requested_size;
+  m_stats.bytes_wasted += contents - m_bump + size - requested_size;
+
+  m_bump = contents + size;
+  *reinterpret_cast<bool(**)(char*&)>(m_bump) = end_of_objects;
+  return static_cast<void*>(contents);
+}
+
+bool Arena::growInPlace(void* mem, size_t new_size)
+{
+  auto contents = static_cast<char*>(mem);
+  auto& size = growable_size(contents);
+  if(contents + size != m_bump || m_bump == m_pinned)
+    return false;
+  new_size = (new_size + sizeof(void*) - 1) &~ (sizeof(void*) - 1);
+  if(new_size <= size)
+    return true;
+  if(static_cast<size_t>(m_end - contents) < new_size + sizeof(void*))
+    return false;
+
+  m_stats.bytes_requested += new_size - size;
+  size = new_size;
+  m_bump = contents + new_size;
+  *reinterpret_cast<bool(**)(char*&)>(m_bump) = end_of_objects;
+  return true;
+}
+
 void* Arena::malloc(size_t size, bool(*deleter)(char*&))
 {
   ensureSpace(size + sizeof(deleter) * 2);
 
-#ifdef _DEBUG
-  m_num_nontrivial += 1;
-  m_amount_nontrivial += size;
-#endif
+  m_stats.num_allocations += 1;
+  m_stats.bytes_requested += size;
+  m_stats.bytes_wasted += sizeof(deleter);
 
   *reinterpret_cast<bool(**)(char*&)>(m_bump) = deleter;
   m_bump += sizeof(deleter);
@@ -1,21 +1,122 @@
 #pragma once
 #include <new>
 #include <stdexcept>
+#include <string.h>
+#include <string>
 #include <stdint.h>
 
+//! Allocation counters which every Arena and PresizedArena keeps about itself, in every build.
+struct ArenaStats
+{
+  uint64_t num_allocations;
+  uint64_t bytes_requested;     //!< The sizes which were asked for, in total.
+  uint64_t bytes_wasted;        //!< Alignment padding, destructor records, block headers and abandoned block tails.
+  uint64_t num_blocks;          //!< Blocks currently held.
+  uint64_t bytes_reserved;      //!< Memory currently held, whether or not any of it has been handed out.
+  uint64_t peak_bytes_reserved;
+};
+
+//! A process-wide registry of arenas and their ArenaStats, so that memory use can be reported by name.
+namespace ArenaTelemetry
+{
+  //! Links an arena into the registry. It lives within the arena, so registering allocates nothing.
+  struct Registration
+  {
+    const char* name;
+    const ArenaStats* stats;
+    Registration* prev;
+    Registration* next;
+  };
+
+  //! Called by arenas as they are created; name must be a string literal (or otherwise outlive the arena).
+  void Register(Registration& registration, const char* name, const ArenaStats* stats);
+
+  //! Called by arenas as they are destroyed; their counters are folded into per-name totals.
+  void Unregister(Registration& registration);
+
+  //! Describe every live arena, destroyed arenas (totalled by name), and the block pool, as JSON.
+  /*!
+    The counters of live arenas are plain integers which their owners update without any
+    synchronisation, so this must only be called while the process is quiescent: no other thread
+    may be allocating from (or creating or destroying) an arena at the same time.
+  */
+  std::string ToJSON();
+
+  //! Write ToJSON() to a file when the process exits (by which point other threads must have
+  //! stopped using arenas).
+  void DumpOnExit(const std::string& path);
+}
+
 //! An arena-based memory allocator.
 /*!
   All the memory allocated from an arena will be freed when said arena is destroyed.
   This results in much faster allocation than operator new, and can also be a nice
   solution to object lifetime issues. The potential downside is that some memory
   may be wasted.
+
+  Memory from an arena is always zero-filled. Freed blocks go into a process-wide pool (up to a
+  budget) rather than straight back to the OS, so that an application which repeatedly creates and
+  destroys arenas (e.g. one per asset viewed) stops allocating from the OS once it warms up.
 */
 class Arena
 {
+  struct Block;
+
 public:
-  Arena();
+  //! \param name Identifies the arena in ArenaTelemetry; must be a string literal.
+  explicit Arena(const char* name = "unnamed");
   ~Arena();
 
+  const char* getName() const { return m_name; }
+  const ArenaStats& getStats() const { return m_stats; }
+
+  //! A point in an arena's allocation history, which the arena can later be rewound to.
+  class Checkpoint
+  {
+  private:
+    friend class Arena;
+    Block* block;
+    char* bump;
+    char* end;
+  };
+
+  //! Rewinds an arena to the point at which the scope was entered, when the scope is left.
+  class Scope
+  {
+  public:
+    Scope(Arena& arena) : m_arena(arena), m_mark(arena.checkpoint()) {}
+    ~Scope() { m_arena.rewind(m_mark); }
+
+  private:
+    Scope(const Scope& cannot_copy);
+    Scope& operator= (const Scope& cannot_copy);
+
+    Arena& m_arena;
+    const Checkpoint m_mark;
+  };
+
+  struct BlockPoolStats
+  {
+    uint64_t num_blocks;  //!< Blocks currently held in the pool.
+    uint64_t num_bytes;
+    uint64_t budget;
+    uint64_t hits;        //!< Blocks which were handed out from the pool.
+    uint64_t misses;      //!< Blocks which had to come from the OS.
+  };
+
+  Checkpoint checkpoint() const;
+
+  //! Destruct everything allocated since a checkpoint (in allocation order), and free its memory.
+  /*!
+    Checkpoints must be rewound to in the reverse of the order in which they were taken; rewinding
+    to a checkpoint invalidates any checkpoints taken after it.
+  */
+  void rewind(const Checkpoint& mark);
+
+  //! Change how many bytes of freed blocks the process-wide pool may hold on to.
+  static void setBlockPoolBudget(uint64_t budget);
+  static BlockPoolStats getBlockPoolStats();
+
   //! Allocate a single object in the arena which will be destructed with the arena.
   /*!
     \param T The type of object to allocate.
@@ -51,10 +152,29 @@ public:
     return static_cast<T*>(malloc(sizeof(T) * extent));
   }
 
+  //! Allocate a block of memory in the arena which growInPlace may later be able to extend.
+  /*!
+    \param size The number of bytes to allocate.
+    \throws std::bad_alloc
+  */
+  void* mallocGrowable(size_t size);
+
+  //! Try to extend a block from mallocGrowable to (at least) new_size bytes without moving it.
+  /*!
+    This succeeds while the block is the most recent allocation in the arena, ignoring those made
+    by allocTrivial and malloc (which come from the other end of the arena's current block), and
+    no checkpoint has been taken since it was allocated.
+  */
+  bool growInPlace(void* mem, size_t new_size);
+
 private:
+  friend class ConcurrentArena;
+
   static void align(size_t& size);
   void* malloc(size_t size, bool(*deleter)(char*&));
   void ensureSpace(size_t full_size);
+  static void runDeleters(char* mem);
+  static void releaseBlock(Block* block, char* bump, char* end);
 
   template <typename T>
   static bool deleter(char*& mem)
@@ -67,17 +187,15 @@ private:
   struct Block
   {
     Block* prev;
-    Block* dummy_for_alignment;
+    size_t size;
+    char* bump; //!< m_bump and m_end as they were when the arena moved on to a newer block.
+    char* end;
   } *m_cur_block;
   char *m_bump, *m_end;
-
-#ifdef _DEBUG
-  size_t m_amount_from_os;
-  size_t m_amount_trivial;
-  size_t m_amount_nontrivial;
-  size_t m_num_trivial;
-  size_t m_num_nontrivial;
-#endif
+  mutable const char* m_pinned; //!< m_bump as of the latest checkpoint, which growInPlace must not move.
+  const char* m_name;
+  ArenaStats m_stats;
+  ArenaTelemetry::Registration m_registration;
 };
 
 inline void runtime_assert(bool condition, const char* msg)
@@ -141,3 +259,91 @@ private:
   uint32_t m_size;
   T* m_elements;
 };
+
+//! A growable counterpart to ArenaArray, for types which need no destructor and can be moved with memcpy.
+/*!
+  Capacity doubles as elements are added. When it is possible, storage is grown in place (see
+  Arena::growInPlace); otherwise the elements are copied to new storage and the old storage is
+  left for the arena to free.
+*/
+template <typename T>
+class ArenaVector
+{
+public:
+  explicit ArenaVector(Arena* arena, uint32_t capacity = 0)
+    : m_arena(arena)
+    , m_size(0)
+    , m_capacity(capacity)
+    , m_elements(capacity ? static_cast<T*>(arena->mallocGrowable(sizeof(T) * capacity)) : nullptr)
+  {
+  }
+
+  ArenaVector(ArenaVector&& other)
+    : m_arena(other.m_arena)
+    , m_size(other.m_size)
+    , m_capacity(other.m_capacity)
+    , m_elements(other.m_elements)
+  {
+    other.m_size = 0;
+    other.m_capacity = 0;
+    other.m_elements = nullptr;
+  }
+
+  void push_back(const T& value)
+  {
+    if(m_size == m_capacity)
+      grow(m_size + 1);
+    m_elements[m_size++] = value;
+  }
+
+  void reserve(uint32_t capacity)
+  {
+    if(capacity > m_capacity)
+      grow(capacity);
+  }
+
+  void clear() { m_size = 0; }
+
+  uint32_t size()     const { return m_size; }
+  uint32_t capacity() const { return m_capacity; }
+  bool     empty()    const { return m_size == 0; }
+        T* data()           { return m_elements; }
+  const T* data()     const { return m_elements; }
+        T* begin()          { return m_elements; }
+  const T* begin()    const { return m_elements; }
+        T* end()            { return m_elements + m_size; }
+  const T* end()      const { return m_elements + m_size; }
+
+        T& operator[] (uint32_t index)       { return m_elements[index]; }
+  const T& operator[] (uint32_t index) const { return m_elements[index]; }
+
+  T& at(uint32_t index)
+  {
+    runtime_assert(index < m_size, "Array index out of bounds.");
+    return m_elements[index];
+  }
+
+private:
+  ArenaVector(const ArenaVector& cannot_copy);
+  ArenaVector& operator= (const ArenaVector& cannot_copy);
+
+  void grow(uint32_t min_capacity)
+  {
+    auto new_capacity = m_capacity < 4 ? 4 : m_capacity * 2;
+    if(new_capacity < min_capacity)
+      new_capacity = min_capacity;
+    if(!m_elements || !m_arena->growInPlace(m_elements, sizeof(T) * new_capacity))
+    {
+      auto elements = static_cast<T*>(m_arena->mallocGrowable(sizeof(T) * new_capacity));
+      if(m_size)
+        memcpy(elements, m_elements, sizeof(T) * m_size);
+      m_elements = elements;
+    }
+    m_capacity = new_capacity;
+  }
+
+  Arena* m_arena;
+  uint32_t m_size;
+  uint32_t m_capacity;
+  T* m_elements;
+};
@@ -35,97 +35,37 @@ namespace Essence
     return begin <= self && (self + sizeof(*this)) <= end && (getContents() + getSize()) <= end;
   }
 
-  namespace
+  ChunkQuery ChunkQuery::Parse(const char* query)
   {
-    class ChunkPredicate
-    {
-    public:
-      ChunkPredicate(const char* query)
-        : kind_mask(0)
-        , kind(0)
-        , type_mask(0)
-        , type(0)
-        , version_mask(0)
-        , version(0)
-      {
-        if(query == nullptr || *query == 0)
-          return;
-
-        auto end = query + strlen(query);
-        auto kindtype_end = std::find(query, end, ' ');
-        if((kindtype_end - query) > 4)
-        {
-          kind_mask = ~kind_mask;
-          memcpy(&kind, query, 4);
-          query += 4;
-        }
-        
-        auto type_len = static_cast<size_t>(kindtype_end - query);
-        if(type_len > 4)
-          type_len = 4;
-        memcpy(reinterpret_cast<uint8_t*>(&type_mask) + 4 - type_len, "\xFF\xFF\xFF\xFF", type_len);
-        memcpy(reinterpret_cast<uint8_t*>(&type) + 4 - type_len, query, type_len);
-        for(int i = 0; i < 4; ++i)
-        {
-          if(reinterpret_cast<uint8_t*>(&type)[i] == '?')
-          {
-            reinterpret_cast<uint8_t*>(&type)[i] = 0;
-            reinterpret_cast<uint8_t*>(&type_mask)[i] = 0;
-          }
-        }
-        query += type_len;
-
-        while(*query == ' ')
-          ++query;
-
-        if(*query == 'v')
-        {
-          version_mask = ~version_mask;
-          version = static_cast<uint32_t>(atoi(query + 1));
-        }
-      }
+    return ChunkQuery(ChunkQueryDetail::Parse(query, query ? static_cast<uint32_t>(strlen(query)) : 0));
+  }
 
-      bool operator()(const Chunk* chunk)
-      {
-        return 0 ==
-        ( ((chunk->getKind()    & kind_mask   ) ^ kind   )
-        | ((chunk->getType()    & type_mask   ) ^ type   )
-        | ((chunk->getVersion() & version_mask) ^ version)
-        );
-      }
+#ifdef ESSENCE_CONSTEXPR_HASH
+  static_assert(!ChunkQuery("").isExactType() && !ChunkQuery("").hasKind() && !ChunkQuery("").hasVersion(), "ChunkQuery mis-parsed");
+  static_assert(ChunkQuery("FOLDDXTCv3").hasKind() && ChunkQuery("FOLDDXTCv3").getType() == 'CTXD' && ChunkQuery("FOLDDXTCv3").getVersion() == 3, "ChunkQuery mis-parsed");
+  static_assert(!ChunkQuery("DATAVAR v1").isExactType() && ChunkQuery("DATAVAR v1").getType() == ('RAV' << 8) && ChunkQuery("DATAVAR v1").getVersion() == 1, "ChunkQuery mis-parsed");
+  static_assert(!ChunkQuery("DATAMSD? v2").isExactType() && ChunkQuery("DATAMSD? v2").getType() == 'DSM' && ChunkQuery("DATAMSD? v2").hasVersion(), "ChunkQuery mis-parsed");
+  static_assert(!ChunkQuery("SPFI").hasKind() && ChunkQuery("SPFI").getType() == 'IFPS' && !ChunkQuery("SPFI").hasVersion(), "ChunkQuery mis-parsed");
+#endif
 
-    private:
-      uint32_t kind_mask;
-      uint32_t kind;
-      uint32_t type_mask;
-      uint32_t type;
-      uint32_t version_mask;
-      uint32_t version;
-    };
+  const Chunk* Chunk::findFirst(const ChunkQuery& query) const
+  {
+    auto range = children(query);
+    auto first = range.begin();
+    return first == range.end() ? nullptr : *first;
   }
 
-#define FOREACH_CHILD(child, query) \
-  auto predicate = ChunkPredicate(query); \
-  if(this != nullptr && m_kind != 'ATAD') \
-    for(auto child = reinterpret_cast<const Chunk*>(getContents()); child->_isChildOf(this); child = reinterpret_cast<const Chunk*>(child->getContents() + child->getSize())) \
-      if(predicate(child))
-
-  const Chunk* Chunk::findFirst(const char* query) const
+  std::vector<const Chunk*> Chunk::findAll(const ChunkQuery& query) const
   {
-    FOREACH_CHILD(child, query)
-    {
-      return child;
-    }
-    return nullptr;
+    auto range = children(query);
+    return std::vector<const Chunk*>(range.begin(), range.end());
   }
 
-  std::vector<const Chunk*> Chunk::findAll(const char* query) const
+  ArenaVector<const Chunk*> Chunk::findAll(const ChunkQuery& query, Arena& arena) const
   {
-    std::vector<const Chunk*> results;
-    FOREACH_CHILD(child, query)
-    {
+    ArenaVector<const Chunk*> results(&arena);
+    for(auto child : children(query))
       results.push_back(child);
-    }
     return results;
   }
 
@@ -170,6 +110,342 @@ namespace Essence
     return move(c);
   }
 
+  std::unique_ptr<const ChunkyFile> ChunkyFile::OpenIndexed(std::unique_ptr<MappableFile> file, const uint8_t* index_data, size_t index_size)
+  {
+    auto c = Open(move(file));
+    if(c)
+    {
+      std::unique_ptr<const ChunkIndex> index;
+      if(index_data)
+        index = ChunkIndex::Load(c.get(), index_data, index_size);
+      if(!index)
+        index = ChunkIndex::Build(c.get());
+      const_cast<ChunkyFile*>(c.get())->m_index = move(index);
+    }
+    return c;
+  }
+
+  namespace
+  {
+    const uint32_t no_node = 0xFFFFFFFF;
+
+    struct SavedChunkIndexHeader
+    {
+      char signature[8];
+      uint32_t version;
+      uint32_t data_size;
+      uint32_t num_nodes;
+      uint32_t table_shift;
+    };
+
+    const char saved_chunk_index_signature[8] = {'C', 'h', 'u', 'n', 'k', 'I', 'd', 'x'};
+
+    inline uint32_t HashKey(uint32_t key)
+    {
+      return key * 0x9E3779B1;
+    }
+
+    inline uint32_t HashKey(uint32_t parent, uint32_t type)
+    {
+      return HashKey(parent * 0x85EBCA77 ^ type);
+    }
+
+    inline bool IsForwardLink(uint32_t from, uint32_t to, uint32_t num_nodes)
+    {
+      return to == 0 || (to > from && to < num_nodes);
+    }
+  }
+
+  ChunkIndex::ChunkIndex(const ChunkyFile* file)
+    : m_file(file)
+    , m_table_shift(28)
+  {
+  }
+
+  std::unique_ptr<const ChunkIndex> ChunkIndex::Build(const ChunkyFile* file)
+  {
+    std::unique_ptr<ChunkIndex> index(new ChunkIndex(file));
+    node_t root = {0, file->getType(), 0, 0, 0, 0};
+    index->m_nodes.push_back(root);
+    index->addChildren(file, 0);
+    index->buildTables();
+    return move(index);
+  }
+
+  void ChunkIndex::addChildren(const Chunk* root, uint32_t root_node)
+  {
+    // Nesting only costs a file 28 bytes per level, so a crafted file could nest deeply enough to
+    // overflow the call stack if this recursed. An explicit stack numbers nodes in the same order
+    // (depth first, parents before children) as recursion would.
+    struct frame_t
+    {
+      const Chunk* parent;
+      uint32_t parent_node;
+      const Chunk* child; //!< The next child of parent to visit.
+      uint32_t prev;      //!< The node of the previous child of parent, if any.
+    };
+    std::vector<frame_t> stack;
+    auto push = [&](const Chunk* parent, uint32_t parent_node)
+    {
+      // The same walk as FOREACH_CHILD, so that the index agrees with Chunk's own lookups.
+      if(parent->getKind() == 'ATAD')
+        return;
+      frame_t frame = {parent, parent_node, reinterpret_cast<const Chunk*>(parent->getContents()), 0};
+      stack.push_back(frame);
+    };
+
+    auto root_data = m_file->getContents();
+    push(root, root_node);
+    while(!stack.empty())
+    {
+      auto& frame = stack.back();
+      auto child = frame.child;
+      if(!child->_isChildOf(frame.parent))
+      {
+        stack.pop_back();
+        continue;
+      }
+      frame.child = reinterpret_cast<const Chunk*>(child->getContents() + child->getSize());
+
+      auto node = static_cast<uint32_t>(m_nodes.size());
+      node_t n = {static_cast<uint32_t>(reinterpret_cast<const uint8_t*>(child) - root_data), child->getType(), frame.parent_node, 0, 0, 0};
+      m_nodes.push_back(n);
+      if(frame.prev)
+        m_nodes[frame.prev].next_sibling = node;
+      else
+        m_nodes[frame.parent_node].first_child = node;
+      frame.prev = node;
+      push(child, node); // Invalidates frame.
+    }
+  }
+
+  void ChunkIndex::buildTables()
+  {
+    // Keep the tables at most half full.
+    m_table_shift = 28;
+    while(m_table_shift > 0 && (static_cast<size_t>(1) << (32 - m_table_shift)) < m_nodes.size() * 2)
+      --m_table_shift;
+    const uint32_t mask = (1U << (32 - m_table_shift)) - 1;
+    m_chunk_table.assign(mask + 1, 0);
+    m_type_table.assign(mask + 1, 0);
+
+    // Going backwards leaves the first child of each type in the table, with the rest chained behind it.
+    for(auto node = static_cast<uint32_t>(m_nodes.size()) - 1; node != 0; --node)
+    {
+      auto& n = m_nodes[node];
+      n.next_same_type = 0;
+
+      auto slot = HashKey(n.offset) >> m_table_shift;
+      while(m_chunk_table[slot])
+        slot = (slot + 1) & mask;
+      m_chunk_table[slot] = node;
+
+      slot = HashKey(n.parent, n.type) >> m_table_shift;
+      for(;;)
+      {
+        auto& entry = m_type_table[slot];
+        if(entry == 0 || (m_nodes[entry].parent == n.parent && m_nodes[entry].type == n.type))
+        {
+          n.next_same_type = entry;
+          entry = node;
+          break;
+        }
+        slot = (slot + 1) & mask;
+      }
+    }
+  }
+
+  std::unique_ptr<const ChunkIndex> ChunkIndex::Load(const ChunkyFile* file, const uint8_t* data, size_t size)
+  {
+    SavedChunkIndexHeader header;
+    if(size < sizeof(header))
+      return nullptr;
+    memcpy(&header, data, sizeof(header));
+    if(memcmp(header.signature, saved_chunk_index_signature, sizeof(header.signature)) != 0 || header.version != 1)
+      return nullptr;
+    if(header.data_size != file->getSize() || header.num_nodes == 0 || header.table_shift == 0 || header.table_shift > 28)
+      return nullptr;
+    auto table_size = static_cast<size_t>(1) << (32 - header.table_shift);
+    if(size != sizeof(header) + header.num_nodes * sizeof(node_t) + 2 * table_size * sizeof(uint32_t) || table_size < header.num_nodes * 2)
+      return nullptr;
+
+    std::unique_ptr<ChunkIndex> index(new ChunkIndex(file));
+    index->m_table_shift = header.table_shift;
+    index->m_nodes.resize(header.num_nodes);
+    index->m_chunk_table.resize(table_size);
+    index->m_type_table.resize(table_size);
+    data += sizeof(header);
+    memcpy(index->m_nodes.data(), data, header.num_nodes * sizeof(node_t));
+    data += header.num_nodes * sizeof(node_t);
+    memcpy(index->m_chunk_table.data(), data, table_size * sizeof(uint32_t));
+    data += table_size * sizeof(uint32_t);
+    memcpy(index->m_type_table.data(), data, table_size * sizeof(uint32_t));
+
+    // Every link must stay within the index, the tables must have free slots to end probing, and
+    // every node must describe a chunk of the file.
+    auto num_nodes = header.num_nodes;
+    uint32_t num_used = 0;
+    for(uint32_t slot = 0; slot < table_size; ++slot)
+    {
+      if(index->m_chunk_table[slot] >= num_nodes || index->m_type_table[slot] >= num_nodes)
+        return nullptr;
+      num_used += (index->m_chunk_table[slot] != 0) + (index->m_type_table[slot] != 0);
+    }
+    if(num_used > (num_nodes - 1) * 2)
+      return nullptr;
+    for(uint32_t node = 0; node < num_nodes; ++node)
+    {
+      auto& n = index->m_nodes[node];
+      // Links only ever point forwards in depth-first order, which also rules out cycles.
+      if(!IsForwardLink(node, n.first_child, num_nodes) || !IsForwardLink(node, n.next_sibling, num_nodes) || !IsForwardLink(node, n.next_same_type, num_nodes))
+        return nullptr;
+      if(node == 0)
+        continue;
+      if(n.parent >= node || n.offset > file->getSize() || file->getSize() - n.offset < sizeof(Chunk))
+        return nullptr;
+      auto chunk = index->getChunk(node);
+      if(chunk->getType() != n.type || !chunk->_isChildOf(n.parent == 0 ? file : index->getChunk(n.parent)))
+        return nullptr;
+    }
+    return move(index);
+  }
+
+  void ChunkIndex::save(std::vector<uint8_t>& out) const
+  {
+    SavedChunkIndexHeader header;
+    memcpy(header.signature, saved_chunk_index_signature, sizeof(header.signature));
+    header.version = 1;
+    header.data_size = m_file->getSize();
+    header.num_nodes = static_cast<uint32_t>(m_nodes.size());
+    header.table_shift = m_table_shift;
+
+    auto append = [&](const void* data, size_t size) {
+      auto bytes = static_cast<const uint8_t*>(data);
+      out.insert(out.end(), bytes, bytes + size);
+    };
+    append(&header, sizeof(header));
+    append(m_nodes.data(), m_nodes.size() * sizeof(node_t));
+    append(m_chunk_table.data(), m_chunk_table.size() * sizeof(uint32_t));
+    append(m_type_table.data(), m_type_table.size() * sizeof(uint32_t));
+  }
+
+  uint32_t ChunkIndex::findNode(const Chunk* chunk) const
+  {
+    if(chunk == m_file)
+      return 0;
+    auto root_data = m_file->getContents();
+    auto ptr = reinterpret_cast<const uint8_t*>(chunk);
+    if(ptr < root_data || ptr >= root_data + m_file->getSize())
+      return no_node;
+    auto offset = static_cast<uint32_t>(ptr - root_data);
+    const uint32_t mask = static_cast<uint32_t>(m_chunk_table.size()) - 1;
+    for(auto slot = HashKey(offset) >> m_table_shift; ; slot = (slot + 1) & mask)
+    {
+      auto node = m_chunk_table[slot];
+      if(node == 0)
+        return no_node;
+      if(m_nodes[node].offset == offset)
+        return node;
+    }
+  }
+
+  const Chunk* ChunkIndex::getChunk(uint32_t node) const
+  {
+    return reinterpret_cast<const Chunk*>(m_file->getContents() + m_nodes[node].offset);
+  }
+
+  uint32_t ChunkIndex::firstChild(uint32_t parent, const ChunkQuery& query) const
+  {
+    if(!query.isExactType())
+      return skipToMatch(m_nodes[parent].first_child, query);
+
+    const uint32_t mask = static_cast<uint32_t>(m_type_table.size()) - 1;
+    auto type = query.getType();
+    auto slot = HashKey(parent, type) >> m_table_shift;
+    uint32_t child;
+    while((child = m_type_table[slot]) != 0 && (m_nodes[child].parent != parent || m_nodes[child].type != type))
+      slot = (slot + 1) & mask;
+    return skipToMatch(child, query);
+  }
+
+  uint32_t ChunkIndex::nextChild(uint32_t child, const ChunkQuery& query) const
+  {
+    return skipToMatch(query.isExactType() ? m_nodes[child].next_same_type : m_nodes[child].next_sibling, query);
+  }
+
+  uint32_t ChunkIndex::skipToMatch(uint32_t child, const ChunkQuery& query) const
+  {
+    while(child && !query(getChunk(child)))
+      child = query.isExactType() ? m_nodes[child].next_same_type : m_nodes[child].next_sibling;
+    return child;
+  }
+
+  const Chunk* ChunkIndex::findFirst(const Chunk* parent, const ChunkQuery& query) const
+  {
+    auto range = children(parent, query);
+    auto first = range.begin();
+    return first == range.end() ? nullptr : *first;
+  }
+
+  ArenaVector<const Chunk*> ChunkIndex::findAll(const Chunk* parent, const ChunkQuery& query, Arena& arena) const
+  {
+    ArenaVector<const Chunk*> results(&arena);
+    for(auto child : children(parent, query))
+      results.push_back(child);
+    return results;
+  }
+
+  ChunkChildRange::iterator::iterator(const ChunkIndex* index, const Chunk* parent, const ChunkQuery& query)
+    : m_index(nullptr)
+    , m_parent(parent)
+    , m_child(nullptr)
+    , m_node(0)
+    , m_query(query)
+  {
+    if(parent == nullptr)
+      return;
+    if(index)
+    {
+      // Chunks which the index does not know about fall back to walking the file.
+      auto node = index->findNode(parent);
+      if(node != no_node)
+      {
+        m_index = index;
+        m_node = index->firstChild(node, m_query);
+        m_child = m_node ? index->getChunk(m_node) : nullptr;
+        return;
+      }
+    }
+    if(parent->m_kind != 'ATAD')
+      seek(reinterpret_cast<const Chunk*>(parent->getContents()));
+  }
+
+  void ChunkChildRange::iterator::advance()
+  {
+    if(m_index)
+    {
+      m_node = m_index->nextChild(m_node, m_query);
+      m_child = m_node ? m_index->getChunk(m_node) : nullptr;
+    }
+    else
+    {
+      seek(reinterpret_cast<const Chunk*>(m_child->getContents() + m_child->getSize()));
+    }
+  }
+
+  void ChunkChildRange::iterator::seek(const Chunk* child)
+  {
+    for(; child->_isChildOf(m_parent); child = reinterpret_cast<const Chunk*>(child->getContents() + child->getSize()))
+    {
+      if(m_query(child))
+      {
+        m_child = child;
+        return;
+      }
+    }
+    m_child = nullptr;
+  }
+
   ChunkReader::ChunkReader(const Chunk* chunk)
     : m_ptr(chunk->getContents())
     , m_end(m_ptr + chunk->getSize())
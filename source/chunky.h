@@ -1,10 +1,129 @@
 #pragma once
 #include "mappable.h"
+#include "arena.h"
+#include "hash.h"
 #include <vector>
 #include <string>
+#include <iterator>
 
 namespace Essence
 {
+  class Chunk;
+  class ChunkIndex;
+  class ChunkChildRange;
+
+  namespace ChunkQueryDetail
+  {
+    struct fields_t
+    {
+      ESSENCE_CONSTEXPR fields_t(uint32_t kind_mask, uint32_t kind, uint32_t type_mask, uint32_t type, uint32_t version_mask, uint32_t version)
+        : kind_mask(kind_mask), kind(kind), type_mask(type_mask), type(type), version_mask(version_mask), version(version)
+      {
+      }
+
+      uint32_t kind_mask, kind;
+      uint32_t type_mask, type;
+      uint32_t version_mask, version;
+    };
+
+    // The query parser, as a chain of single-expression functions (each computing one more piece
+    // of the query and passing it on) so that it is a valid C++11 constant expression.
+    ESSENCE_CONSTEXPR inline uint32_t Byte(const char* q, uint32_t i)
+    {
+      return static_cast<uint32_t>(static_cast<uint8_t>(q[i]));
+    }
+
+    ESSENCE_CONSTEXPR inline uint32_t KindTypeEnd(const char* q, uint32_t i, uint32_t len)
+    {
+      return i < len && q[i] != ' ' ? KindTypeEnd(q, i + 1, len) : i;
+    }
+
+    ESSENCE_CONSTEXPR inline uint32_t SkipSpaces(const char* q, uint32_t i, uint32_t len)
+    {
+      return i < len && q[i] == ' ' ? SkipSpaces(q, i + 1, len) : i;
+    }
+
+    ESSENCE_CONSTEXPR inline uint32_t Decimal(const char* q, uint32_t i, uint32_t len, uint32_t value)
+    {
+      return i < len && q[i] >= '0' && q[i] <= '9' ? Decimal(q, i + 1, len, value * 10 + static_cast<uint32_t>(q[i] - '0')) : value;
+    }
+
+    // A TYPE of fewer than four characters occupies the high bytes, and '?' matches anything.
+    ESSENCE_CONSTEXPR inline uint32_t TypeByte(const char* q, uint32_t begin, uint32_t type_len, uint32_t j, bool mask)
+    {
+      return j < 4 - type_len ? 0
+        : q[begin + j - (4 - type_len)] == '?' ? 0
+        : mask ? 0xFF : Byte(q, begin + j - (4 - type_len));
+    }
+
+    ESSENCE_CONSTEXPR inline uint32_t Type(const char* q, uint32_t begin, uint32_t type_len, bool mask)
+    {
+      return TypeByte(q, begin, type_len, 0, mask) | (TypeByte(q, begin, type_len, 1, mask) << 8)
+          | (TypeByte(q, begin, type_len, 2, mask) << 16) | (TypeByte(q, begin, type_len, 3, mask) << 24);
+    }
+
+    ESSENCE_CONSTEXPR inline fields_t ParseVersion(const char* q, uint32_t len, uint32_t kind_mask, uint32_t kind, uint32_t type_mask, uint32_t type, uint32_t v)
+    {
+      return v < len && q[v] == 'v'
+        ? fields_t(kind_mask, kind, type_mask, type, 0xFFFFFFFF, Decimal(q, v + 1, len, 0))
+        : fields_t(kind_mask, kind, type_mask, type, 0, 0);
+    }
+
+    ESSENCE_CONSTEXPR inline fields_t ParseType(const char* q, uint32_t len, uint32_t kind_mask, uint32_t kind, uint32_t begin, uint32_t type_len)
+    {
+      return ParseVersion(q, len, kind_mask, kind, Type(q, begin, type_len, true), Type(q, begin, type_len, false), SkipSpaces(q, begin + type_len, len));
+    }
+
+    ESSENCE_CONSTEXPR inline fields_t ParseKind(const char* q, uint32_t len, uint32_t kind_type_end)
+    {
+      return kind_type_end > 4
+        ? ParseType(q, len, 0xFFFFFFFF, Byte(q, 0) | (Byte(q, 1) << 8) | (Byte(q, 2) << 16) | (Byte(q, 3) << 24), 4, kind_type_end - 4 > 4 ? 4 : kind_type_end - 4)
+        : ParseType(q, len, 0, 0, 0, kind_type_end);
+    }
+
+    ESSENCE_CONSTEXPR inline fields_t Parse(const char* q, uint32_t len)
+    {
+      return ParseKind(q, len, KindTypeEnd(q, 0, len));
+    }
+  }
+
+  //! Criteria for Chunk::findFirst and friends.
+  /*!
+    A query is a string of the form "(KIND)?TYPE(vVER)?" where "TYPE" is a string of up to four
+    characters (any of which can be '?' to match anything), "KIND" (if present) is either "FOLD"
+    or "DATA", and "VER" (if present) is a decimal integer. A chunk matches if it has the given
+    TYPE, and (if present) KIND and VER.
+
+    String literals convert implicitly, and where constexpr is available they are parsed at
+    compile time, leaving only a masked compare per chunk. Other strings must go through Parse.
+  */
+  class ChunkQuery
+  {
+  public:
+    template <uint32_t N>
+    ESSENCE_CONSTEXPR ChunkQuery(const char (&query)[N])
+      : m_q(ChunkQueryDetail::Parse(query, N - 1))
+    {
+    }
+
+    //! Parse a query which is not a string literal; nullptr matches every chunk.
+    static ChunkQuery Parse(const char* query);
+
+    //! Whether the query names a complete TYPE, without any '?'s.
+    ESSENCE_CONSTEXPR bool isExactType() const { return m_q.type_mask == 0xFFFFFFFF; }
+    ESSENCE_CONSTEXPR uint32_t getType() const { return m_q.type; }
+    ESSENCE_CONSTEXPR uint32_t getVersion() const { return m_q.version; }
+    ESSENCE_CONSTEXPR bool hasKind() const { return m_q.kind_mask != 0; }
+    ESSENCE_CONSTEXPR bool hasVersion() const { return m_q.version_mask != 0; }
+
+    inline bool operator()(const Chunk* chunk) const;
+
+  private:
+    ChunkQuery(const ChunkQueryDetail::fields_t& q) : m_q(q) {}
+
+    ChunkQueryDetail::fields_t m_q;
+  };
+
 #pragma pack(push)
 #pragma pack(1)
   //! A single chunk in a Relic Chunky file.
@@ -30,20 +149,28 @@ namespace Essence
 
     //! Find the first child chunk satisfying some criteria.
     /*!
-      \param query A string of the form "(KIND)?TYPE(vVER)?" where "TYPE" is a string of up to
-                   four characters, "KIND" (if present) is either "FOLD" or "DATA", and "VER"
-                   (if present) is a decimal integer.
-      \return The first child chunk matching the given TYPE, and (if present) KIND and VER, or
-              nullptr if no such child exists.
+      \param query See ChunkQuery; usually a string literal such as "FOLDDXTCv3".
+      \return The first child chunk matching the query, or nullptr if no such child exists.
       \note This method can be called on a nullptr instance, thereby allowing for chained calls
             without the need for intermediate null checks.
     */
-    const Chunk* findFirst(const char* query) const;
+    const Chunk* findFirst(const ChunkQuery& query) const;
 
     //! Find all child chunks satisfying some criteria.
-    std::vector<const Chunk*> findAll(const char* query) const;
+    std::vector<const Chunk*> findAll(const ChunkQuery& query) const;
+
+    //! Find all child chunks satisfying some criteria, without touching the heap.
+    ArenaVector<const Chunk*> findAll(const ChunkQuery& query, Arena& arena) const;
+
+    //! Lazily iterate over the child chunks satisfying some criteria, without allocating anything.
+    /*!
+      \note Like findFirst, this method can be called on a nullptr instance (giving an empty range).
+    */
+    inline ChunkChildRange children(const ChunkQuery& query) const;
 
   protected:
+    friend class ChunkIndex;
+    friend class ChunkChildRange;
     bool _isChildOf(const Chunk* parent) const;
     const uint8_t* _getEndOfHeader() const;
 
@@ -92,6 +219,79 @@ namespace Essence
 #pragma warning(pop)
 #pragma pack(pop)
 
+  inline bool ChunkQuery::operator()(const Chunk* chunk) const
+  {
+    return 0 ==
+    ( ((chunk->getKind()    & m_q.kind_mask   ) ^ m_q.kind   )
+    | ((chunk->getType()    & m_q.type_mask   ) ^ m_q.type   )
+    | ((chunk->getVersion() & m_q.version_mask) ^ m_q.version)
+    );
+  }
+
+  //! A forward range over the child chunks of a parent which match a ChunkQuery.
+  /*!
+    Obtained from Chunk::children or ChunkIndex::children. Matches are found one at a time as the
+    range is iterated, so nothing is allocated, and stopping early skips the rest of the search.
+    Iterators carry their own copy of the query, so remain valid after the range is gone.
+  */
+  class ChunkChildRange
+  {
+  public:
+    class iterator
+    {
+    public:
+      typedef std::forward_iterator_tag iterator_category;
+      typedef const Chunk* value_type;
+      typedef ptrdiff_t difference_type;
+      typedef const Chunk* const* pointer;
+      typedef const Chunk* const& reference;
+
+      //! The end iterator of every range.
+      iterator() : m_index(nullptr), m_parent(nullptr), m_child(nullptr), m_node(0), m_query("") {}
+
+      reference operator*() const { return m_child; }
+      pointer operator->() const { return &m_child; }
+      iterator& operator++() { advance(); return *this; }
+      iterator operator++(int) { auto previous = *this; advance(); return previous; }
+      bool operator==(const iterator& other) const { return m_child == other.m_child; }
+      bool operator!=(const iterator& other) const { return m_child != other.m_child; }
+
+    private:
+      friend class ChunkChildRange;
+      iterator(const ChunkIndex* index, const Chunk* parent, const ChunkQuery& query);
+      void advance();
+      void seek(const Chunk* child);
+
+      const ChunkIndex* m_index; //!< nullptr when walking the parent's contents directly.
+      const Chunk* m_parent;
+      const Chunk* m_child;      //!< nullptr once the range is exhausted.
+      uint32_t m_node;
+      ChunkQuery m_query;
+    };
+    typedef iterator const_iterator;
+
+    iterator begin() const { return iterator(m_index, m_parent, m_query); }
+    iterator end() const { return iterator(); }
+    bool empty() const { return begin() == end(); }
+
+  private:
+    friend class Chunk;
+    friend class ChunkIndex;
+    ChunkChildRange(const ChunkIndex* index, const Chunk* parent, const ChunkQuery& query)
+      : m_index(index), m_parent(parent), m_query(query)
+    {
+    }
+
+    const ChunkIndex* m_index;
+    const Chunk* m_parent;
+    ChunkQuery m_query;
+  };
+
+  inline ChunkChildRange Chunk::children(const ChunkQuery& query) const
+  {
+    return ChunkChildRange(nullptr, this, query);
+  }
+
   //! A Relic Chunky file.
   class ChunkyFile : public Chunk
   {
@@ -102,10 +302,83 @@ namespace Essence
     */
     static std::unique_ptr<const ChunkyFile> Open(std::unique_ptr<MappableFile> file);
 
+    //! As Open, but also give the file a ChunkIndex.
+    /*!
+      \param index_data A ChunkIndex previously saved for this file, or nullptr. If it is missing or
+                        does not match the file, the index is built from scratch instead.
+    */
+    static std::unique_ptr<const ChunkyFile> OpenIndexed(std::unique_ptr<MappableFile> file, const uint8_t* index_data = nullptr, size_t index_size = 0);
+
+    //! The file's index, or nullptr if it was not opened with OpenIndexed.
+    const ChunkIndex* getIndex() const { return m_index.get(); }
+
   private:
     ChunkyFile();
     std::unique_ptr<MappableFile> m_file;
     MappedMemory m_contents;
+    std::unique_ptr<const ChunkIndex> m_index;
+  };
+
+  //! A flat index of every chunk in a ChunkyFile, for constant-time lookups by type.
+  /*!
+    Each chunk is a node recording its parent, first child, next sibling, and next sibling of the
+    same type. Two hash tables map chunk addresses to nodes, and (parent, type) pairs to the first
+    such child. Queries whose TYPE contains a '?' cannot use the latter table, so walk the parent's
+    children through the index instead.
+
+    The results of every lookup are identical to those of the equivalent Chunk method.
+  */
+  class ChunkIndex
+  {
+  public:
+    static std::unique_ptr<const ChunkIndex> Build(const ChunkyFile* file);
+
+    //! Recreate an index from save(), or return nullptr if the data does not describe this file.
+    static std::unique_ptr<const ChunkIndex> Load(const ChunkyFile* file, const uint8_t* data, size_t size);
+
+    //! Append a serialised form of the index, suitable for storing alongside the file.
+    void save(std::vector<uint8_t>& out) const;
+
+    //! Equivalent to parent->findFirst(query).
+    const Chunk* findFirst(const Chunk* parent, const ChunkQuery& query) const;
+
+    //! Equivalent to parent->findAll(query, arena).
+    ArenaVector<const Chunk*> findAll(const Chunk* parent, const ChunkQuery& query, Arena& arena) const;
+
+    //! Equivalent to parent->children(query), but walking the index rather than the file.
+    ChunkChildRange children(const Chunk* parent, const ChunkQuery& query) const { return ChunkChildRange(this, parent, query); }
+
+    uint32_t getNumChunks() const { return static_cast<uint32_t>(m_nodes.size()); }
+
+  private:
+    struct node_t
+    {
+      uint32_t offset;         //!< From the file's root data to the chunk's header.
+      uint32_t type;
+      uint32_t parent;
+      uint32_t first_child;    //!< Nodes are numbered from 1 in depth-first order; 0 means none.
+      uint32_t next_sibling;
+      uint32_t next_same_type;
+    };
+
+    friend class ChunkChildRange;
+    ChunkIndex(const ChunkyFile* file);
+    ChunkIndex(const ChunkIndex& cannot_copy);
+    ChunkIndex& operator= (const ChunkIndex& cannot_copy);
+
+    void addChildren(const Chunk* root, uint32_t root_node);
+    void buildTables();
+    uint32_t findNode(const Chunk* chunk) const;
+    const Chunk* getChunk(uint32_t node) const;
+    uint32_t firstChild(uint32_t parent, const ChunkQuery& query) const;
+    uint32_t nextChild(uint32_t child, const ChunkQuery& query) const;
+    uint32_t skipToMatch(uint32_t child, const ChunkQuery& query) const;
+
+    const ChunkyFile* m_file;
+    std::vector<node_t> m_nodes;          //!< m_nodes[0] is the root (the ChunkyFile itself).
+    std::vector<uint32_t> m_chunk_table;  //!< Node numbers, keyed by offset.
+    std::vector<uint32_t> m_type_table;   //!< Node numbers, keyed by (parent, type).
+    uint32_t m_table_shift;
   };
 
   //! Utility class for reading a sequence of values from a Chunk.
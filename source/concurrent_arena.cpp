@@ -0,0 +1,66 @@
+#include "stdafx.h"
+#include "concurrent_arena.h"
+#include <atomic>
+using namespace std;
+
+// VS2012 has no thread_local, but does support thread-local storage of plain data.
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+namespace
+{
+  struct lane_cache_t
+  {
+    uint64_t owner_id;
+    Arena* lane;
+  };
+
+  THREAD_LOCAL lane_cache_t t_lane_cache;
+
+  atomic<uint64_t> g_next_id(1);
+}
+
+ConcurrentArena::ConcurrentArena(const char* name)
+  : m_id(g_next_id++)
+  , m_name(name)
+{
+}
+
+ConcurrentArena::~ConcurrentArena()
+{
+  while(!m_lanes.empty())
+    m_lanes.pop_back();
+}
+
+Arena* ConcurrentArena::local()
+{
+  auto& cache = t_lane_cache;
+  if(cache.owner_id == m_id)
+    return cache.lane;
+
+  auto lane = createLane();
+  cache.owner_id = m_id;
+  cache.lane = lane;
+  return lane;
+}
+
+Arena* ConcurrentArena::createLane()
+{
+  lock_guard<mutex> lock(m_lock);
+  auto& lane = m_lanes_by_thread[this_thread::get_id()];
+  if(!lane)
+  {
+    m_lanes.push_back(unique_ptr<Arena>(new Arena(m_name)));
+    lane = m_lanes.back().get();
+  }
+  return lane;
+}
+
+size_t ConcurrentArena::getLaneCount()
+{
+  lock_guard<mutex> lock(m_lock);
+  return m_lanes.size();
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include "arena.h"
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+//! An arena which any number of threads can allocate from at once.
+/*!
+  Every thread which allocates is given its own Arena (its lane), so after a thread's first
+  allocation it bumps through its own blocks without taking any locks. Lanes are plain Arenas, so a
+  lane can be passed to any existing code which takes an Arena*, provided that it is only used from
+  the thread which obtained it.
+
+  When the ConcurrentArena is destroyed, lanes are destroyed in the reverse of the order in which
+  they were created, and each destructs its objects in the same order as Arena does. Objects which
+  were allocated by different threads at the same time have no meaningful order between them.
+*/
+class ConcurrentArena
+{
+public:
+  //! \param name Given to every lane, so that they are reported together by ArenaTelemetry.
+  explicit ConcurrentArena(const char* name = "concurrent");
+  ~ConcurrentArena();
+
+  //! Get the calling thread's lane, creating it on first use.
+  /*!
+    The last lane used by each thread is cached in thread-local storage, so this only locks when a
+    thread first allocates, or switches between ConcurrentArenas.
+  */
+  Arena* local();
+
+  //! Allocate a single object in the calling thread's lane, which will be destructed with the arena.
+#define METHOD alloc
+#define MALLOC local()->malloc(sizeof(T), &Arena::deleter<T>)
+#include "arena_var_tem.h"
+
+  //! Allocate a single object, whose destructor will not be called, in the calling thread's lane.
+#define METHOD allocTrivial
+#define MALLOC local()->malloc(sizeof(T))
+#include "arena_var_tem.h"
+
+  //! Allocate a block of memory in the calling thread's lane.
+  void* malloc(size_t size) { return local()->malloc(size); }
+
+  template <typename T>
+  T* mallocArray(size_t extent) {
+    return static_cast<T*>(malloc(sizeof(T) * extent));
+  }
+
+  size_t getLaneCount();
+
+private:
+  ConcurrentArena(const ConcurrentArena& cannot_copy);
+  ConcurrentArena& operator= (const ConcurrentArena& cannot_copy);
+
+  Arena* createLane();
+
+  const uint64_t m_id; //!< Never reused, so stale thread-local caches can never match a new arena.
+  const char* m_name;
+  std::mutex m_lock;
+  std::vector<std::unique_ptr<Arena>> m_lanes;
+  std::unordered_map<std::thread::id, Arena*> m_lanes_by_thread;
+};
@@ -0,0 +1,139 @@
+#include "stdafx.h"
+#include "decompressor.h"
+#include "zlib.h"
+#ifdef WITH_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+using namespace std;
+
+namespace
+{
+  class ZlibDecompressor : public Decompressor
+  {
+  public:
+    ZlibDecompressor()
+    {
+      m_z.zalloc = nullptr;
+      m_z.zfree = nullptr;
+      m_z.opaque = nullptr;
+      if(inflateInit(&m_z) != Z_OK)
+        throw bad_alloc();
+    }
+
+    ~ZlibDecompressor()
+    {
+      inflateEnd(&m_z);
+    }
+
+    const char* getName() const override { return "zlib"; }
+
+    size_t decompress(uint8_t* dest, size_t dest_capacity, const uint8_t* src, size_t src_len, size_t* src_consumed) override
+    {
+      m_z.next_out = dest;
+      m_z.avail_out = static_cast<uInt>(dest_capacity);
+      m_z.next_in = src;
+      m_z.avail_in = static_cast<uInt>(src_len);
+      auto result = inflate(&m_z, Z_FINISH);
+      auto written = static_cast<size_t>(m_z.total_out);
+      auto consumed = src_len - m_z.avail_in;
+      auto msg = m_z.msg;
+      inflateReset(&m_z);
+      if(result != Z_STREAM_END)
+        throw runtime_error(msg ? msg : "Could not inflate compressed data.");
+      if(src_consumed)
+        *src_consumed = consumed;
+      return written;
+    }
+
+  private:
+    z_stream m_z;
+  };
+
+#ifdef WITH_LIBDEFLATE
+  class LibdeflateDecompressor : public Decompressor
+  {
+  public:
+    LibdeflateDecompressor()
+      : m_d(libdeflate_alloc_decompressor())
+    {
+      if(!m_d)
+        throw bad_alloc();
+    }
+
+    ~LibdeflateDecompressor()
+    {
+      libdeflate_free_decompressor(m_d);
+    }
+
+    const char* getName() const override { return "libdeflate"; }
+
+    size_t decompress(uint8_t* dest, size_t dest_capacity, const uint8_t* src, size_t src_len, size_t* src_consumed) override
+    {
+      size_t consumed, written;
+      if(libdeflate_zlib_decompress_ex(m_d, src, src_len, dest, dest_capacity, &consumed, &written) != LIBDEFLATE_SUCCESS)
+        throw runtime_error("Could not inflate compressed data.");
+      if(src_consumed)
+        *src_consumed = consumed;
+      return written;
+    }
+
+  private:
+    libdeflate_decompressor* m_d;
+  };
+#endif
+
+  struct backend_t
+  {
+    const char* name;
+    unique_ptr<Decompressor> (*create)();
+  };
+
+  template <typename T>
+  unique_ptr<Decompressor> CreateBackend()
+  {
+    return unique_ptr<Decompressor>(new T);
+  }
+
+  const backend_t g_backends[] = {
+#ifdef WITH_LIBDEFLATE
+    {"libdeflate", CreateBackend<LibdeflateDecompressor>},
+#endif
+    {"zlib", CreateBackend<ZlibDecompressor>},
+  };
+
+  const backend_t* g_preferred_backend = g_backends;
+}
+
+unique_ptr<Decompressor> Decompressor::create()
+{
+  return g_preferred_backend->create();
+}
+
+unique_ptr<Decompressor> Decompressor::create(const char* backend_name)
+{
+  for(auto& backend : g_backends)
+  {
+    if(strcmp(backend.name, backend_name) == 0)
+      return backend.create();
+  }
+  return nullptr;
+}
+
+void Decompressor::getBackendNames(vector<const char*>& names)
+{
+  for(auto& backend : g_backends)
+    names.push_back(backend.name);
+}
+
+bool Decompressor::setPreferredBackend(const char* backend_name)
+{
+  for(auto& backend : g_backends)
+  {
+    if(strcmp(backend.name, backend_name) == 0)
+    {
+      g_preferred_backend = &backend;
+      return true;
+    }
+  }
+  return false;
+}
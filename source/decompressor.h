@@ -0,0 +1,47 @@
+#pragma once
+#include <stdint.h>
+#include <memory>
+#include <vector>
+
+//! Interface to a whole-buffer decompressor for zlib-format data.
+/*!
+  Archive entries and texture mips are always inflated in one go, with the full input in memory and
+  the size of the output known up front, which is the case that libraries such as libdeflate are
+  optimised for. Backends other than zlib are only available if enabled at compile time: the
+  Visual Studio projects define WITH_LIBDEFLATE (and link libdeflate) when the LibdeflateDir
+  property names a directory holding libdeflate.h and libdeflatestatic.lib.
+
+  Instances hold decompression state, so each thread should use its own.
+*/
+class Decompressor
+{
+public:
+  virtual ~Decompressor() {}
+
+  virtual const char* getName() const = 0;
+
+  //! Inflate a zlib stream.
+  /*!
+    \param dest_capacity The size of the buffer at dest, which the output must fit within.
+    \param src_consumed If non-null, receives the number of bytes of src which the stream occupied.
+                        Anything after the end of the stream is otherwise silently ignored.
+    \return The number of bytes written to dest.
+    \throws std::runtime_error if the input is corrupt, or the output does not fit.
+  */
+  virtual size_t decompress(uint8_t* dest, size_t dest_capacity, const uint8_t* src, size_t src_len, size_t* src_consumed = nullptr) = 0;
+
+  //! Create an instance of the preferred backend.
+  static std::unique_ptr<Decompressor> create();
+
+  //! Create an instance of a named backend, or nullptr if it is not available in this build.
+  static std::unique_ptr<Decompressor> create(const char* backend_name);
+
+  //! Get the names of all the backends available in this build, from most to least preferred.
+  static void getBackendNames(std::vector<const char*>& names);
+
+  //! Change which backend create() uses (e.g. for benchmarking). Not thread-safe.
+  /*!
+    \return false if the named backend is not available in this build.
+  */
+  static bool setPreferredBackend(const char* backend_name);
+};
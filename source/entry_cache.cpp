@@ -0,0 +1,95 @@
+#include "stdafx.h"
+#include "entry_cache.h"
+using namespace std;
+
+namespace
+{
+  EntryCache g_entry_cache(64 * 1024 * 1024);
+}
+
+EntryCache::EntryCache(uint64_t budget)
+  : m_budget(budget)
+  , m_num_bytes(0)
+  , m_hits(0)
+  , m_misses(0)
+  , m_evictions(0)
+{
+}
+
+EntryCache& EntryCache::global()
+{
+  return g_entry_cache;
+}
+
+void EntryCache::setBudget(uint64_t budget)
+{
+  lock_guard<mutex> lock(m_lock);
+  m_budget = budget;
+  evictToFit(budget);
+}
+
+shared_ptr<const uint8_t> EntryCache::lookup(const void* owner, uint32_t index, uint64_t& size)
+{
+  Key key = {owner, index};
+  lock_guard<mutex> lock(m_lock);
+  auto found = m_lookup.find(key);
+  if(found == m_lookup.end())
+  {
+    ++m_misses;
+    return nullptr;
+  }
+
+  ++m_hits;
+  m_lru.splice(m_lru.begin(), m_lru, found->second);
+  size = found->second->size;
+  return found->second->data;
+}
+
+void EntryCache::insert(const void* owner, uint32_t index, shared_ptr<const uint8_t> data, uint64_t size)
+{
+  Key key = {owner, index};
+  lock_guard<mutex> lock(m_lock);
+  if(size > m_budget / 4 || m_lookup.find(key) != m_lookup.end())
+    return;
+
+  evictToFit(m_budget - size);
+  Entry entry = {key, move(data), size};
+  m_lru.push_front(move(entry));
+  m_lookup[key] = m_lru.begin();
+  m_num_bytes += size;
+}
+
+void EntryCache::evictOwner(const void* owner)
+{
+  lock_guard<mutex> lock(m_lock);
+  for(auto itr = m_lru.begin(); itr != m_lru.end(); )
+  {
+    if(itr->key.owner == owner)
+    {
+      m_num_bytes -= itr->size;
+      m_lookup.erase(itr->key);
+      itr = m_lru.erase(itr);
+    }
+    else
+      ++itr;
+  }
+}
+
+EntryCache::Stats EntryCache::getStats()
+{
+  lock_guard<mutex> lock(m_lock);
+  Stats stats = {m_hits, m_misses, m_evictions, m_lookup.size(), m_num_bytes, m_budget};
+  return stats;
+}
+
+void EntryCache::evictToFit(uint64_t budget)
+{
+  while(m_num_bytes > budget && !m_lru.empty())
+  {
+    auto& victim = m_lru.back();
+    m_num_bytes -= victim.size;
+    m_lookup.erase(victim.key);
+    m_lru.pop_back();
+    ++m_evictions;
+  }
+}
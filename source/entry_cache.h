@@ -0,0 +1,91 @@
+#pragma once
+#include <stdint.h>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+//! A byte-budgeted, thread-safe LRU cache of decompressed archive entries.
+/*!
+  Entries are keyed on an owner (typically the FileSource which inflated them) and an index which is
+  meaningful to that owner. Buffers are shared, so an entry which is evicted whilst still in use
+  stays alive until its last user lets go of it; only the cache's reference is dropped.
+*/
+class EntryCache
+{
+public:
+  struct Stats
+  {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t num_entries;
+    uint64_t num_bytes;
+    uint64_t budget;
+  };
+
+  EntryCache(uint64_t budget);
+
+  //! The cache which is shared by all archives.
+  static EntryCache& global();
+
+  //! Change the byte budget, evicting entries as required to fit within it.
+  void setBudget(uint64_t budget);
+
+  //! Find an entry, and mark it as the most recently used.
+  /*!
+    \return nullptr (and counts a miss) if the entry is not in the cache.
+  */
+  std::shared_ptr<const uint8_t> lookup(const void* owner, uint32_t index, uint64_t& size);
+
+  //! Add an entry, evicting the least recently used entries as required to fit within the budget.
+  /*!
+    Entries larger than a quarter of the budget are not cached, as they would push out too much else.
+  */
+  void insert(const void* owner, uint32_t index, std::shared_ptr<const uint8_t> data, uint64_t size);
+
+  //! Remove every entry belonging to an owner, e.g. because the owner is being destroyed.
+  void evictOwner(const void* owner);
+
+  Stats getStats();
+
+private:
+  EntryCache(const EntryCache& cannot_copy);
+  EntryCache& operator= (const EntryCache& cannot_copy);
+
+  struct Key
+  {
+    const void* owner;
+    uint32_t index;
+
+    bool operator== (const Key& other) const { return owner == other.owner && index == other.index; }
+  };
+
+  struct KeyHash
+  {
+    size_t operator()(const Key& key) const
+    {
+      return std::hash<const void*>()(key.owner) ^ (static_cast<size_t>(key.index) * 0x9E3779B1U);
+    }
+  };
+
+  struct Entry
+  {
+    Key key;
+    std::shared_ptr<const uint8_t> data;
+    uint64_t size;
+  };
+
+  typedef std::list<Entry> lru_list_t; //!< Most recently used at the front.
+
+  void evictToFit(uint64_t budget);
+
+  std::mutex m_lock;
+  lru_list_t m_lru;
+  std::unordered_map<Key, lru_list_t::iterator, KeyHash> m_lookup;
+  uint64_t m_budget;
+  uint64_t m_num_bytes;
+  uint64_t m_hits;
+  uint64_t m_misses;
+  uint64_t m_evictions;
+};
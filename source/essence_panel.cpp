@@ -74,7 +74,8 @@ namespace
 namespace Essence { namespace Graphics
 {
   Panel::Panel(C6::UI::Factories& factories, FileSource* mod_fs)
-    : m_device(factories.d3)
+    : m_arena("essence_panel")
+    , m_device(factories.d3)
     , m_camera_angle(0)
     , m_camera_height(2.f)
     , m_object_visibility(nullptr)
@@ -1,16 +1,25 @@
 #include "stdafx.h"
 #include "fs.h"
 #include "mappable.h"
+#include "arena.h"
+#include <stdio.h>
+#ifndef _WIN32
+#include <dirent.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 using namespace std;
 
 namespace
 {
+#ifdef _WIN32
   class Win32FileSource : public Essence::FileSource
   {
   public:
     unique_ptr<MappableFile> readFile(const string& path) override
     {
-      if(GetFileAttributesA(path.c_str()) == INVALID_FILE_ATTRIBUTES)
+      if(!Essence::PhysicalPathExists(path))
         return nullptr;
 
       return MapPhysicalFileA(path.c_str());
@@ -62,12 +71,266 @@ namespace
       }
     }
   } g_Win32FileSource;
+#else
+  // Paths within the engine always use backslashes, which POSIX treats as ordinary characters.
+  string NativePath(const string& path)
+  {
+    string native(path);
+    replace(native.begin(), native.end(), '\\', '/');
+    return native;
+  }
+
+  //! Like NativePath, but also finds the on-disk name of every component which differs only in
+  //! case, as names are presented in lowercase (see getFilesOrDirs) and POSIX is case-sensitive.
+  string ResolveNativePath(const string& path)
+  {
+    auto native = NativePath(path);
+    if(access(native.c_str(), F_OK) == 0)
+      return native;
+
+    string resolved;
+    for(size_t begin = 0; begin <= native.size();)
+    {
+      auto end = native.find('/', begin);
+      if(end == string::npos)
+        end = native.size();
+      auto component = native.substr(begin, end - begin);
+      auto parent = resolved;
+      if(begin != 0)
+        resolved += '/';
+      if(!component.empty() && access((resolved + component).c_str(), F_OK) != 0)
+      {
+        if(DIR* dir = opendir(parent.empty() ? (begin == 0 ? "." : "/") : parent.c_str()))
+        {
+          while(auto entry = readdir(dir))
+          {
+            if(strcasecmp(entry->d_name, component.c_str()) == 0)
+            {
+              component = entry->d_name;
+              break;
+            }
+          }
+          closedir(dir);
+        }
+      }
+      resolved += component;
+      begin = end + 1;
+    }
+    return resolved;
+  }
+
+  class PosixFileSource : public Essence::FileSource
+  {
+  public:
+    unique_ptr<MappableFile> readFile(const string& path) override
+    {
+      auto native = ResolveNativePath(path);
+      if(access(native.c_str(), F_OK) != 0)
+        return nullptr;
+
+      return MapPhysicalFileA(native.c_str());
+    }
+
+    void getDirs(const string& path, vector<std::string>& dirs) override
+    {
+      getFilesOrDirs(path, dirs, true);
+    }
+
+    void getFiles(const string& path, vector<string>& files) override
+    {
+      getFilesOrDirs(path, files, false);
+    }
+
+  private:
+    void getFilesOrDirs(const string& path, vector<string>& names, bool want_dirs)
+    {
+      if(path.empty())
+        return;
+
+      auto native = ResolveNativePath(path);
+      if(*native.rbegin() != '/')
+        native += '/';
+
+      if(DIR* dir = opendir(native.c_str()))
+      {
+        while(auto entry = readdir(dir))
+        {
+          if(!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+            continue;
+
+          struct stat st;
+          if(stat((native + entry->d_name).c_str(), &st) != 0 || S_ISDIR(st.st_mode) != want_dirs)
+            continue;
+
+          // To be consistent with .sga archives, names are always presented in lowercase.
+          string name(entry->d_name);
+          transform(name.begin(), name.end(), name.begin(), [](char c) { return static_cast<char>(tolower(c)); });
+          names.push_back(move(name));
+        }
+        closedir(dir);
+      }
+    }
+  } g_PosixFileSource;
+#endif
+
+  void ExtractDirectory(Essence::FileSource* fs, Essence::ExtractionSink* sink, const string& dir)
+  {
+    const string prefix = dir.empty() ? string() : dir + '\\';
+    vector<string> names;
+    fs->getFiles(dir, names);
+    for(auto& name : names)
+    {
+      auto path = prefix + name;
+      if(auto file = fs->readFile(path))
+      {
+        if(file->getSize() == 0)
+        {
+          sink->onFile(path, nullptr, 0);
+          continue;
+        }
+        auto contents = file->mapAll();
+        sink->onFile(path, contents.begin, contents.size());
+      }
+    }
+
+    names.clear();
+    fs->getDirs(dir, names);
+    for(auto& name : names)
+      ExtractDirectory(fs, sink, prefix + name);
+  }
+
+  void CreateParentDirectories(const string& path)
+  {
+    // Failures are ignored here, as they'll be reported when the file itself cannot be created.
+    for(auto pos = path.find_first_of("\\/", 1); pos != string::npos; pos = path.find_first_of("\\/", pos + 1))
+    {
+      auto dir = path.substr(0, pos);
+#ifdef _WIN32
+      CreateDirectoryA(dir.c_str(), nullptr);
+#else
+      mkdir(dir.c_str(), 0777);
+#endif
+    }
+  }
+
+  class PhysicalExtractionSink : public Essence::ExtractionSink
+  {
+  public:
+    PhysicalExtractionSink(string root)
+      : m_root(move(root))
+    {
+      while(!m_root.empty() && (*m_root.rbegin() == '\\' || *m_root.rbegin() == '/'))
+        m_root.pop_back();
+    }
+
+    void onFile(const string& path, const uint8_t* data, size_t size) override
+    {
+      CheckRelativePath(path);
+      auto full_path = m_root + '\\' + path;
+#ifndef _WIN32
+      full_path = NativePath(full_path);
+#endif
+      // Optimistically assume that the directory already exists, as it usually will.
+      FILE* f = fopen(full_path.c_str(), "wb");
+      if(!f)
+      {
+        CreateParentDirectories(full_path);
+        if(!(f = fopen(full_path.c_str(), "wb")))
+          throw runtime_error("Cannot create file `" + full_path + "'");
+      }
+      bool ok = fwrite(data, 1, size, f) == size;
+      ok = (fclose(f) == 0) && ok;
+      if(!ok)
+        throw runtime_error("Cannot write file `" + full_path + "'");
+    }
+
+  private:
+    //! Archives (particularly modded ones) come from third parties, so a path within one must not
+    //! be able to name anything outside of the extraction root.
+    static void CheckRelativePath(const string& path)
+    {
+      for(size_t begin = 0;;)
+      {
+        auto end = path.find_first_of("\\/", begin);
+        auto component = path.substr(begin, end == string::npos ? string::npos : end - begin);
+        // An empty component means an absolute path (or a doubled separator), and a colon means a
+        // drive prefix (or an NTFS stream name).
+        if(component.empty() || component == "." || component == ".." || component.find(':') != string::npos)
+          throw runtime_error("Cannot extract file `" + path + "' as it is not a plain relative path");
+        if(end == string::npos)
+          break;
+        begin = end + 1;
+      }
+    }
+
+    string m_root;
+  };
 }
 
 namespace Essence
 {
   FileSource* CreatePhysicalFileSource(Arena* arena)
   {
+#ifdef _WIN32
     return &g_Win32FileSource;
+#else
+    return &g_PosixFileSource;
+#endif
+  }
+
+  void FileSource::extractAll(ExtractionSink* sink, unsigned)
+  {
+    ExtractDirectory(this, sink, string());
+  }
+
+  vector<unique_ptr<MappableFile>> FileSource::readFiles(const vector<string>& paths)
+  {
+    vector<unique_ptr<MappableFile>> files;
+    files.reserve(paths.size());
+    for(auto& path : paths)
+      files.push_back(readFile(path));
+    return files;
+  }
+
+  ExtractionSink* CreatePhysicalExtractionSink(Arena* arena, const string& root)
+  {
+    return arena->alloc<PhysicalExtractionSink>(root);
+  }
+
+  string NativePhysicalPath(const string& path)
+  {
+#ifdef _WIN32
+    return path;
+#else
+    return ResolveNativePath(path);
+#endif
+  }
+
+  bool GetPhysicalFileStamp(const string& path, uint64_t& size, uint64_t& mtime)
+  {
+#ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+    if(!GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &attributes))
+      return false;
+    size = (static_cast<uint64_t>(attributes.nFileSizeHigh) << 32) | attributes.nFileSizeLow;
+    mtime = (static_cast<uint64_t>(attributes.ftLastWriteTime.dwHighDateTime) << 32) | attributes.ftLastWriteTime.dwLowDateTime;
+#else
+    struct stat st;
+    if(stat(ResolveNativePath(path).c_str(), &st) != 0)
+      return false;
+    size = static_cast<uint64_t>(st.st_size);
+    // Nanoseconds, as an archive can be rewritten with the same size within a second.
+    mtime = static_cast<uint64_t>(st.st_mtim.tv_sec) * 1000000000U + static_cast<uint64_t>(st.st_mtim.tv_nsec);
+#endif
+    return true;
+  }
+
+  bool PhysicalPathExists(const string& path)
+  {
+#ifdef _WIN32
+    return GetFileAttributesA(path.c_str()) != INVALID_FILE_ATTRIBUTES;
+#else
+    return access(ResolveNativePath(path).c_str(), F_OK) == 0;
+#endif
   }
 }
\ No newline at end of file
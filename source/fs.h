@@ -1,4 +1,5 @@
 #pragma once
+#include <stdint.h>
 #include <vector>
 #include <string>
 #include <memory>
@@ -8,6 +9,54 @@ class MappableFile;
 
 namespace Essence
 {
+  //! Receives the contents of files extracted in bulk from a FileSource.
+  class ExtractionSink
+  {
+  public:
+    virtual ~ExtractionSink() {}
+
+    //! Called once per extracted file.
+    /*!
+      May be called concurrently from several threads, and in no particular order.
+      \param path The full path of the file within the FileSource.
+      \param data The contents of the file, which are only valid for the duration of the call.
+    */
+    virtual void onFile(const std::string& path, const uint8_t* data, size_t size) = 0;
+  };
+
+  //! Describes the lookup structures which a FileSource built when it was created.
+  struct IndexStats
+  {
+    IndexStats()
+      : num_entries(0)
+      , num_entries_reused(0)
+      , num_bytes(0)
+      , build_seconds(0.)
+    {
+    }
+
+    uint64_t num_entries;
+    uint64_t num_entries_reused; //!< Entries which came from a cache rather than being built.
+    uint64_t num_bytes;
+    double build_seconds;
+  };
+
+  //! The outcome of checking the checksums which SGA archives store about themselves.
+  struct VerifyReport
+  {
+    VerifyReport()
+      : num_checksums(0)
+      , num_bytes(0)
+      , seconds(0.)
+    {
+    }
+
+    uint64_t num_checksums; //!< Header MD5s, contents MD5s and per-file hashes which were checked.
+    uint64_t num_bytes;     //!< Bytes which were read in order to check them.
+    double seconds;
+    std::vector<std::string> failures; //!< One line per checksum which did not match.
+  };
+
   //! Common interface for accessing SGA archives, directories, and unions thereof.
   class FileSource
   {
@@ -17,19 +66,162 @@ namespace Essence
     //! Open a single file for reading.
     virtual std::unique_ptr<MappableFile> readFile(const std::string& path) = 0;
 
+    //! Open several files for reading, as a single batch.
+    /*!
+      The default implementation calls readFile for each path in turn. Sources which know where
+      their files lie (e.g. SGA archives) instead resolve every path up front, and then read the
+      files in on-disk order, with neighbouring files coalesced into large sequential reads, which
+      spares cold caches and spinning disks from seeking back and forth.
+      \return One file per path (nullptr if readFile would have returned nullptr), in the same
+              order as paths.
+    */
+    virtual std::vector<std::unique_ptr<MappableFile>> readFiles(const std::vector<std::string>& paths);
+
     //! Get a list of all files within a particular directory.
     virtual void getFiles(const std::string& path, std::vector<std::string>& files) = 0;
 
     //! Get a list of of all subdirectories within a particular directory.
     virtual void getDirs(const std::string& path, std::vector<std::string>& dirs) = 0;
+
+    //! Pass every file within the source to a sink.
+    /*!
+      The default implementation walks the directory tree and reads one file at a time; sources
+      which can do better (e.g. SGA archives, which inflate files in parallel) override it.
+      \param num_threads An upper bound on the number of threads to use, or zero for one per
+                         hardware thread.
+    */
+    virtual void extractAll(ExtractionSink* sink, unsigned num_threads = 0);
+
+    //! Get the size of, and time taken to build, any lookup index which the source holds.
+    /*!
+      \return false if the source has no such index (e.g. because it defers to the OS).
+    */
+    virtual bool getIndexStats(IndexStats&) { return false; }
+
+    //! Check every checksum stored within the source, appending the results to a report.
+    /*!
+      \param num_threads An upper bound on the number of threads to use, or zero for one per
+                         hardware thread.
+      \return false if the source stores no checksums (e.g. because it defers to the OS).
+    */
+    virtual bool verify(VerifyReport&, unsigned = 0) { return false; }
   };
 
   //! View the computer's file system (C:\, etc.) as a FileSource.
   FileSource* CreatePhysicalFileSource(Arena* arena);
 
+  //! Test whether a file or directory exists on the computer's file system.
+  bool PhysicalPathExists(const std::string& path);
+
+  //! Convert a path which uses the engine's conventions into one which can be given to the OS.
+  /*!
+    On Windows, this is the identity. Elsewhere, backslashes become slashes, and every component
+    which exists on disk with different case (e.g. `Archives' in a .module file versus `archives'
+    on disk) is replaced by its on-disk name. Components which do not exist are left as-is.
+  */
+  std::string NativePhysicalPath(const std::string& path);
+
+  //! Write extracted files beneath a directory on the computer's file system.
+  /*!
+    Subdirectories are created as required, and existing files are overwritten.
+  */
+  ExtractionSink* CreatePhysicalExtractionSink(Arena* arena, const std::string& root);
+
+  //! Get the size and last modification time of a file on the computer's file system.
+  /*!
+    \return false if the file does not exist.
+  */
+  bool GetPhysicalFileStamp(const std::string& path, uint64_t& size, uint64_t& mtime);
+
+  //! A block of memory holding the lookup tables which were built for an SGA archive.
+  /*!
+    The block is position-independent, so it can be saved to disk and reused on a later run.
+  */
+  struct ArchiveIndex
+  {
+    ArchiveIndex()
+      : data(nullptr)
+      , size(0)
+    {
+    }
+
+    //! Bumped whenever the layout of the block (or Essence::Hash) changes.
+    static const uint32_t format_version = 2;
+
+    const uint8_t* data;
+    size_t size;
+  };
+
   //! View an SGA archive as a FileSource.
-  FileSource* CreateArchiveFileSource(Arena* arena, std::unique_ptr<MappableFile> archive);
+  /*!
+    \param index If non-null, and index->data is non-null, lookup tables previously obtained from
+                 this function. If they match the archive, they are used as-is (and so must outlive
+                 the FileSource), otherwise they are ignored and new tables are built. On return,
+                 describes the tables which the FileSource is using.
+  */
+  FileSource* CreateArchiveFileSource(Arena* arena, std::unique_ptr<MappableFile> archive, ArchiveIndex* index = nullptr);
+
+  //! Settings for WriteArchive.
+  struct ArchiveWriteOptions
+  {
+    ArchiveWriteOptions()
+      : version(6)
+      , compression_level(-1)
+      , num_threads(0)
+      , block_size(0)
+      , entry_point("data")
+    {
+    }
+
+    uint32_t version;         //!< 4, 6, 7 or 9; no other versions can be written.
+    int compression_level;    //!< A zlib level, where 0 stores every file, and -1 is zlib's default.
+    unsigned num_threads;     //!< An upper bound on the number of threads, or zero for one per hardware thread.
+    uint32_t block_size;      //!< Version 9 only: files larger than this are deflated as independent blocks of this size, which readers inflate in parallel. Zero (the default) disables this, as only this project can read such files.
+    std::string entry_point;  //!< The name of the archive's single entry point (table of contents).
+    std::string archive_name; //!< Stored in the file header.
+  };
+
+  //! Describes an archive written by WriteArchive.
+  struct ArchiveWriteReport
+  {
+    ArchiveWriteReport()
+      : num_dirs(0)
+      , num_files(0)
+      , num_files_stored(0)
+      , num_files_blocked(0)
+      , num_bytes_in(0)
+      , num_bytes_out(0)
+      , seconds(0.)
+    {
+    }
+
+    uint64_t num_dirs;
+    uint64_t num_files;
+    uint64_t num_files_stored; //!< Files which did not get any smaller when deflated.
+    uint64_t num_files_blocked; //!< Files deflated as independent blocks.
+    uint64_t num_bytes_in;     //!< The total size of the files.
+    uint64_t num_bytes_out;    //!< The size of the archive.
+    double seconds;
+  };
+
+  //! Write every file beneath a directory of a FileSource into a new SGA archive.
+  /*!
+    Files are deflated in parallel, and are stored as-is wherever deflating does not make them
+    smaller. Directories and files are sorted by name, so the archive is byte-for-byte identical
+    regardless of how many threads are used, or in what order the source lists its contents.
+    \param root The directory within the source which becomes the root of the archive, e.g. a
+                directory on the computer's file system, or "" for the whole of the source.
+    \param archive_path Where to write the archive on the computer's file system. The archive is
+                        written to archive_path + ".tmp", and only replaces archive_path once
+                        complete, so any file already there is left intact if writing fails.
+  */
+  void WriteArchive(FileSource* source, const std::string& root, const std::string& archive_path, const ArchiveWriteOptions& options, ArchiveWriteReport* report = nullptr);
 
   //! View a .module file as a FileSource.
-  FileSource* CreateModFileSource(Arena* arena, const std::string& module_file_path);
+  /*!
+    \param index_cache_path If non-empty, a file in which to save the lookup tables of every archive
+                            in the module, so that later calls can map them in rather than rebuilding
+                            them. The file is created or updated as needed.
+  */
+  FileSource* CreateModFileSource(Arena* arena, const std::string& module_file_path, const std::string& index_cache_path = std::string());
 }
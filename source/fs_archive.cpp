@@ -2,74 +2,155 @@
 #include "fs.h"
 #include "mappable.h"
 #include "arena.h"
+#include "decompressor.h"
+#include "entry_cache.h"
 #include "hash.h"
+#include "md5.h"
+#include "range_reader.h"
+#include "stopwatch.h"
+#include "thread_pool.h"
 #include "zlib.h"
 using namespace std;
 
 namespace
 {
-  struct StringHashTable
+  //! An open-addressed hash table of fixed-size entries, stored in a single block of memory.
+  /*!
+    Entries hold indices rather than pointers, so a table does not depend on where the archive's
+    headers happen to be mapped, and can be saved to disk and mapped back in verbatim. As the table
+    cannot see names itself, callers of lookup() supply a predicate for confirming that a candidate
+    entry really is the name being looked for.
+
+    \param Entry A POD type with uint32_t members called hash and index. An index of 0xFFFFFFFF
+                 marks an empty slot.
+  */
+  template <typename Entry>
+  struct HashIndex
   {
   public:
-    static StringHashTable* create(Arena* arena, size_t num_entries)
+    static size_t getMemoryFootprint(size_t num_entries)
     {
-      num_entries = num_entries + (num_entries / 3);
-      size_t mask = 1;
-      while(mask < num_entries)
-        mask = mask | (mask << 1);
+      return sizeof(HashIndex) + getMask(num_entries) * sizeof(Entry);
+    }
 
-      auto result = static_cast<StringHashTable*>(arena->malloc(sizeof(StringHashTable) + mask * sizeof(Entry)));
-      result->m_mask = mask;
+    static HashIndex* create(void* memory, size_t num_entries)
+    {
+      auto mask = getMask(num_entries);
+      auto result = static_cast<HashIndex*>(memory);
+      result->m_mask = static_cast<uint32_t>(mask);
+      memset(result->m_table, 0xFF, (mask + 1) * sizeof(Entry));
       return result;
     }
 
-    void insert(const char* str, uint32_t len, const void* data)
+    //! Check that a table which was loaded from elsewhere has the expected shape.
+    bool isSizedFor(size_t num_entries) const
+    {
+      return m_mask == getMask(num_entries);
+    }
+
+    //! Check that a table which was loaded from elsewhere has an empty slot (without which lookup
+    //! would never terminate), and that valid(e) holds for every entry.
+    template <typename Predicate>
+    bool isConsistent(Predicate&& valid) const
+    {
+      bool any_empty = false;
+      for(uint32_t i = 0; i <= m_mask; ++i)
+      {
+        if(m_table[i].index == empty)
+          any_empty = true;
+        else if(!valid(m_table[i]))
+          return false;
+      }
+      return any_empty;
+    }
+
+    void insert(const Entry& e)
     {
-      Entry e = {
-        Essence::Hash(str, len),
-#ifndef ASSUME_PERFECT_HASHING
-        str, len,
-#endif
-        data};
       auto index = e.hash;
       do
       {
         index = (index + 1) & m_mask;
-      } while(m_table[index].data);
+      } while(m_table[index].index != empty);
       m_table[index] = e;
     }
 
-    const void* lookup(const char* str, uint32_t len)
+    template <typename Predicate>
+    const Entry* lookup(uint32_t hash, Predicate&& matches) const
     {
-      auto hash = Essence::Hash(str, len);
       auto index = hash;
       for(;;)
       {
         index = (index + 1) & m_mask;
         auto& e = m_table[index];
-        if(!e.data)
+        if(e.index == empty)
           return nullptr;
         if(hash == e.hash) {
 #ifndef ASSUME_PERFECT_HASHING
-          if(len == e.len && !memcmp(str, e.str, len))
+          if(matches(e))
 #endif
-            return e.data;
+            return &e;
         }
       }
     }
 
   private:
+    static const uint32_t empty = 0xFFFFFFFFU;
+
+    static size_t getMask(size_t num_entries)
+    {
+      num_entries = num_entries + (num_entries / 3);
+      size_t mask = 1;
+      while(mask < num_entries)
+        mask = mask | (mask << 1);
+      return mask;
+    }
+
     uint32_t m_mask;
+    Entry m_table[1];
+  };
 
-    struct Entry {
-      uint32_t hash;
-#ifndef ASSUME_PERFECT_HASHING
-      const char* str;
-      uint32_t len;
-#endif
-      const void* data;
-    } m_table[1];
+  struct DirectoryEntry
+  {
+    uint32_t hash;  //!< Hash of the directory name.
+    uint32_t index; //!< Index into the archive's directory table.
   };
+
+  struct FileEntry
+  {
+    uint32_t hash;  //!< Hash of the full path, i.e. directory name, backslash, file name.
+    uint32_t index; //!< Index into the archive's file table.
+    uint32_t dir_index;
+  };
+
+  //! Identifies the archive (and code) for which a block of lookup tables was built.
+  struct index_key_t
+  {
+    char signature[8];
+    uint32_t format_version; //!< Must be bumped whenever the table layout or Essence::Hash changes.
+    uint32_t archive_version;
+    uint64_t data_offset;
+    uint32_t data_header_size;
+    uint32_t directory_count;
+    uint32_t file_count;
+    int32_t header_md5[4]; //!< Zero for archive versions which have no header MD5.
+    uint32_t reserved; //!< Zero; makes the padding explicit, as keys are compared with memcmp.
+  };
+
+  //! Start of the block of memory holding an archive's lookup tables.
+  struct index_header_t
+  {
+    index_key_t key;
+    uint32_t size;
+    uint32_t dirs_lut_offset;
+    uint32_t files_lut_offset;
+  };
+
+  const uint32_t index_format_version = Essence::ArchiveIndex::format_version;
+
+  uint32_t AlignIndexOffset(size_t offset)
+  {
+    return static_cast<uint32_t>((offset + 7) & ~static_cast<size_t>(7));
+  }
 }
 
 namespace
@@ -108,9 +189,14 @@ namespace
         offset_end = m_size;
     }
 
-    MappedMemory map(uint64_t offset_begin, uint64_t offset_end) override
+    MappedMemory map(uint64_t offset_begin, uint64_t offset_end, AccessPattern::E pattern) override
     {
-      return m_file->map(m_begin + offset_begin, m_begin + offset_end);
+      return m_file->map(m_begin + offset_begin, m_begin + offset_end, pattern);
+    }
+
+    void prefetch(uint64_t offset_begin, uint64_t offset_end) override
+    {
+      m_file->prefetch(m_begin + offset_begin, m_begin + (std::min)(offset_end, m_size));
     }
 
   private:
@@ -118,10 +204,198 @@ namespace
     uint64_t m_begin;
   };
 
-  class UncompressedFile : public MappableFile
+  uint32_t InflateCompressedFile(Decompressor& decompressor, MappableFile* archive, uint64_t data_offset, uint32_t data_length_compressed, uint8_t* destination, uint32_t data_length)
+  {
+    auto mapped = archive->map(data_offset, data_offset + data_length_compressed, AccessPattern::Sequential);
+    return static_cast<uint32_t>(decompressor.decompress(destination, data_length, mapped.begin, data_length_compressed));
+  }
+
+  //! Inflate a file which is stored as internal::StorageBlocks (see fs_archive_structs.h).
+  /*!
+    \param pool If non-null, the blocks are spread across the pool's threads, each of which uses
+                its own Decompressor. Otherwise, they are inflated in turn using decompressor.
+  */
+  uint32_t InflateBlockCompressedFile(Decompressor& decompressor, WorkStealingPool* pool, MappableFile* archive, uint64_t data_offset, uint32_t data_length_compressed, uint8_t* destination, uint32_t data_length, uint32_t block_size)
+  {
+    if(block_size == 0)
+      throw std::runtime_error("Block-compressed file in an archive without a block size.");
+    const uint32_t num_blocks = data_length / block_size + (data_length % block_size != 0);
+    const uint64_t table_size = static_cast<uint64_t>(num_blocks) * sizeof(uint32_t);
+    if(table_size > data_length_compressed)
+      throw std::runtime_error("Could not inflate compressed file.");
+
+    auto mapped = archive->map(data_offset, data_offset + data_length_compressed, AccessPattern::Sequential);
+    const auto blocks = mapped.begin + table_size;
+    const auto blocks_size = data_length_compressed - table_size;
+    auto block_end = [&](uint32_t i) -> uint32_t
+    {
+      uint32_t end;
+      memcpy(&end, mapped.begin + i * sizeof(uint32_t), sizeof(end));
+      return end;
+    };
+    auto inflate_block = [&](uint32_t i, Decompressor& block_decompressor)
+    {
+      auto begin = i ? block_end(i - 1) : 0;
+      auto end = block_end(i);
+      if(begin > end || end > blocks_size)
+        throw std::runtime_error("Could not inflate compressed file.");
+      auto out_begin = static_cast<uint64_t>(i) * block_size;
+      auto out_size = static_cast<size_t>((std::min)(static_cast<uint64_t>(block_size), data_length - out_begin));
+      if(block_decompressor.decompress(destination + out_begin, out_size, blocks + begin, end - begin) != out_size)
+        throw std::runtime_error("Could not inflate compressed file.");
+    };
+
+    if(pool && num_blocks > 1)
+    {
+      vector<unique_ptr<Decompressor>> decompressors(pool->getThreadCount());
+      pool->run(num_blocks, [&](size_t i, unsigned worker_index) {
+        auto& block_decompressor = decompressors[worker_index];
+        if(!block_decompressor)
+          block_decompressor = Decompressor::create();
+        inflate_block(static_cast<uint32_t>(i), *block_decompressor);
+      });
+    }
+    else
+    {
+      for(uint32_t i = 0; i < num_blocks; ++i)
+        inflate_block(i, decompressor);
+    }
+    return data_length;
+  }
+
+  //! The pool which InflatingFile spreads blocks across, shared so that reads do not pay for
+  //! creating threads. It is created on first use, and deliberately never destroyed, as joining
+  //! threads during static destruction can deadlock.
+  mutex g_block_pool_lock;
+  WorkStealingPool* g_block_pool = nullptr;
+
+  //! A compressed file within an archive, which is only inflated as far as has been mapped.
+  /*!
+    Callers often only want a file's header (e.g. to identify a texture format), so rather than
+    inflating everything up front, the zlib stream is kept open and resumed whenever a range beyond
+    what has been inflated so far is mapped. The output buffer is allocated in full immediately, so
+    that previously returned mappings remain valid. Once fully inflated, the buffer is shared with
+    the global EntryCache, so that other readers of the same entry need not inflate it again.
+
+    Block-compressed files are always inflated in full, with their blocks spread across threads
+    (unless there are only a few blocks, or another file is already using the threads).
+  */
+  class InflatingFile : public MappableFile
+  {
+  public:
+    InflatingFile(MappableFile* archive, uint64_t data_offset, uint32_t data_length_compressed, uint32_t data_length, uint32_t block_size, const void* cache_owner, uint32_t cache_index)
+      : m_archive(archive)
+      , m_data_offset(data_offset)
+      , m_data_length_compressed(data_length_compressed)
+      , m_block_size(block_size)
+      , m_cache_owner(cache_owner)
+      , m_cache_index(cache_index)
+      , m_memory(new uint8_t[data_length], default_delete<uint8_t[]>())
+      , m_inflated(0)
+      , m_stream_open(false)
+    {
+      m_size = data_length;
+    }
+
+    ~InflatingFile()
+    {
+      if(m_stream_open)
+        inflateEnd(&m_stream);
+    }
+
+    void expand(uint64_t&, uint64_t& offset_end) override
+    {
+      if(offset_end > m_size)
+        offset_end = m_size;
+    }
+
+    MappedMemory map(uint64_t offset_begin, uint64_t offset_end, AccessPattern::E) override
+    {
+      if(offset_begin > offset_end || offset_end > m_size)
+        throw std::runtime_error("Invalid range for mapping.");
+      if(offset_end > m_inflated)
+        inflateUpTo(offset_end);
+      if(offset_end > m_size) // The stream turned out to be shorter than advertised.
+        throw std::runtime_error("Invalid range for mapping.");
+      return MappedMemory(m_memory.get() + offset_begin, m_memory.get() + offset_end);
+    }
+
+  private:
+    void inflateUpTo(uint64_t offset_end)
+    {
+      if(m_block_size != 0)
+      {
+        const uint64_t min_parallel_blocks = 4;
+        auto decompressor = Decompressor::create();
+        unique_lock<mutex> pool_lock(g_block_pool_lock, defer_lock);
+        if((m_size + m_block_size - 1) / m_block_size >= min_parallel_blocks && pool_lock.try_lock() && !g_block_pool)
+          g_block_pool = new WorkStealingPool;
+        auto pool = pool_lock.owns_lock() ? g_block_pool : nullptr;
+        m_inflated = m_size = InflateBlockCompressedFile(*decompressor, pool, m_archive, m_data_offset, m_data_length_compressed, m_memory.get(), static_cast<uint32_t>(m_size), m_block_size);
+        EntryCache::global().insert(m_cache_owner, m_cache_index, m_memory, m_size);
+        return;
+      }
+
+      if(m_inflated == 0 && offset_end == m_size)
+      {
+        // The whole file is wanted in one go, which a Decompressor can do faster than zlib's streaming API.
+        auto decompressor = Decompressor::create();
+        m_inflated = m_size = InflateCompressedFile(*decompressor, m_archive, m_data_offset, m_data_length_compressed, m_memory.get(), static_cast<uint32_t>(m_size));
+        EntryCache::global().insert(m_cache_owner, m_cache_index, m_memory, m_size);
+        return;
+      }
+
+      if(!m_stream_open)
+      {
+        m_compressed = m_archive->map(m_data_offset, m_data_offset + m_data_length_compressed, AccessPattern::Sequential);
+        memset(&m_stream, 0, sizeof(m_stream));
+        if(inflateInit(&m_stream) != Z_OK)
+          throw std::runtime_error("Could not inflate compressed file.");
+        m_stream.next_in = m_compressed.begin;
+        m_stream.avail_in = m_data_length_compressed;
+        m_stream_open = true;
+      }
+
+      // Inflating in tiny steps costs more in call overhead than it saves, so always make some headway.
+      const uint64_t min_step = 16 * 1024;
+      offset_end = (std::min)((std::max)(offset_end, m_inflated + min_step), m_size);
+
+      m_stream.next_out = m_memory.get() + m_inflated;
+      m_stream.avail_out = static_cast<uInt>(offset_end - m_inflated);
+      auto result = inflate(&m_stream, Z_SYNC_FLUSH);
+      m_inflated = m_stream.total_out;
+      if(result == Z_STREAM_END)
+      {
+        m_size = m_inflated;
+        inflateEnd(&m_stream);
+        m_stream_open = false;
+        m_compressed = nullptr;
+        EntryCache::global().insert(m_cache_owner, m_cache_index, m_memory, m_size);
+      }
+      else if(result != Z_OK || m_inflated < offset_end)
+      {
+        throw std::runtime_error("Could not inflate compressed file.");
+      }
+    }
+
+    MappableFile* m_archive;
+    uint64_t m_data_offset;
+    uint32_t m_data_length_compressed;
+    uint32_t m_block_size; //!< Zero unless the file is block-compressed.
+    const void* m_cache_owner;
+    uint32_t m_cache_index;
+    shared_ptr<uint8_t> m_memory;
+    uint64_t m_inflated;
+    MappedMemory m_compressed;
+    z_stream m_stream;
+    bool m_stream_open;
+  };
+
+  //! A file whose decompressed contents came from the global EntryCache.
+  class CachedFile : public MappableFile
   {
   public:
-    UncompressedFile(unique_ptr<uint8_t[]> memory, uint64_t size)
+    CachedFile(shared_ptr<const uint8_t> memory, uint64_t size)
       : m_memory(move(memory))
     {
       m_size = size;
@@ -134,7 +408,7 @@ namespace
         offset_end = m_size;
     }
 
-    MappedMemory map(uint64_t offset_begin, uint64_t offset_end) override
+    MappedMemory map(uint64_t offset_begin, uint64_t offset_end, AccessPattern::E) override
     {
       if(offset_begin <= offset_end && offset_end <= m_size)
         return MappedMemory(m_memory.get() + offset_begin, m_memory.get() + offset_end);
@@ -143,20 +417,23 @@ namespace
     }
 
   private:
-    unique_ptr<uint8_t[]> m_memory;
+    shared_ptr<const uint8_t> m_memory;
   };
 
-  unique_ptr<MappableFile> ReadCompressedFile(MappableFile* archive, uint32_t data_offset, uint32_t data_length_compressed, uint32_t data_length)
+  //! Open a file within an archive.
+  /*!
+    \param block_size Zero, unless the file is block-compressed.
+    \param cache_owner, cache_index Identify the file within the global EntryCache.
+  */
+  unique_ptr<MappableFile> ReadCompressedFile(MappableFile* archive, uint64_t data_offset, uint32_t data_length_compressed, uint32_t data_length, bool stored, uint32_t block_size, const void* cache_owner, uint32_t cache_index)
   {
-    if(data_length_compressed == data_length)
+    if(stored)
       return unique_ptr<MappableFile>(new StoredFile(archive, data_offset, data_length));
 
-    auto mapped = archive->map(data_offset, data_offset + data_length_compressed);
-    unique_ptr<uint8_t[]> uncompressed(new uint8_t[data_length]);
-    uLong destLen = data_length;
-    if(uncompress(uncompressed.get(), &destLen, mapped.begin, data_length_compressed) != Z_OK)
-      throw std::runtime_error("Could not inflate compressed file.");
-    return unique_ptr<MappableFile>(new UncompressedFile(move(uncompressed), destLen));
+    uint64_t cached_size;
+    if(auto cached = EntryCache::global().lookup(cache_owner, cache_index, cached_size))
+      return unique_ptr<MappableFile>(new CachedFile(move(cached), cached_size));
+    return unique_ptr<MappableFile>(new InflatingFile(archive, data_offset, data_length_compressed, data_length, block_size, cache_owner, cache_index));
   }
 
   template <int version>
@@ -167,30 +444,50 @@ namespace
     typedef const data_header_t<version>* data_header_ptr;
     typedef const directory_t<version>* directory_ptr;
     typedef const file_t<version>* file_ptr;
+    typedef HashIndex<DirectoryEntry> dirs_lut_t;
+    typedef HashIndex<FileEntry> files_lut_t;
 
-    static FileSource* create(Arena* arena, unique_ptr<MappableFile> archive, MappedMemory& file_header_mem)
+    ~Archive()
+    {
+      // Another archive may later be allocated at the same address, so mustn't inherit our entries.
+      EntryCache::global().evictOwner(this);
+    }
+
+    static FileSource* create(Arena* arena, unique_ptr<MappableFile> archive, MappedMemory& file_header_mem, Essence::ArchiveIndex* index)
     {
       auto file_header = reinterpret_cast<file_header_ptr>(file_header_mem.begin);
       runtime_assert(file_header->getPlatform() == 1, "Unsupported archive platform.");
 
       auto self = arena->alloc<Archive>();
       uint64_t data_header_begin = file_header->getDataHeaderOffset();
-      self->m_data_header_mem = archive->map(data_header_begin, data_header_begin + file_header->data_header_size);
+      self->m_data_header_mem = archive->map(data_header_begin, data_header_begin + file_header->data_header_size, AccessPattern::Random);
 
       auto data_header = reinterpret_cast<data_header_ptr>(self->m_data_header_mem.begin);
-      self->m_dirs_lut = StringHashTable::create(arena, data_header->directory_count);
       self->m_data_offset = file_header->data_offset;
+      self->m_block_size = data_header->getBlockSize();
       self->m_directories = reinterpret_cast<directory_ptr>(self->m_data_header_mem.begin + data_header->directory_offset);
       self->m_files = reinterpret_cast<file_ptr>(self->m_data_header_mem.begin + data_header->file_offset);
       self->m_strings = reinterpret_cast<const char*>(self->m_data_header_mem.begin + data_header->strings_offset);
       self->m_archive_file = move(archive);
-      for(uint32_t i = 0; i < data_header->directory_count; ++i)
+
+      Stopwatch timer;
+      index_key_t key;
+      MakeIndexKey(key, file_header, data_header);
+      bool reused = index && index->data && self->adoptIndex(key, *index);
+      if(!reused)
+        self->buildIndex(arena, key);
+      if(index)
       {
-        auto dir = self->m_directories + i;
-        auto name = self->m_strings + dir->name_offset;
-        self->m_dirs_lut->insert(name, static_cast<uint32_t>(strlen(name)), static_cast<const void*>(dir));
+        index->data = reinterpret_cast<const uint8_t*>(self->m_index);
+        index->size = self->m_index->size;
       }
 
+      auto& stats = self->m_index_stats;
+      stats.num_entries = key.directory_count + key.file_count;
+      stats.num_entries_reused = reused ? stats.num_entries : 0;
+      stats.num_bytes = self->m_index->size;
+      stats.build_seconds = timer.elapsedSeconds();
+
       return self;
     }
 
@@ -208,36 +505,495 @@ namespace
 
     unique_ptr<MappableFile> readFile(const string& path) override
     {
-      auto file_sep_pos = path.find_last_of('\\');
-      uint32_t dir_part_length = 0;
-      auto file_part = path.c_str();
-      if(file_sep_pos != string::npos)
+      if(auto file = getFile(path))
+        return openFile(file);
+      return nullptr;
+    }
+
+    vector<unique_ptr<MappableFile>> readFiles(const vector<string>& paths) override
+    {
+      struct request_t
       {
-        dir_part_length = static_cast<uint32_t>(file_sep_pos);
-        file_part += file_sep_pos + 1;
+        size_t path_index;
+        file_ptr file;
+      };
+      vector<request_t> requests;
+      requests.reserve(paths.size());
+      for(size_t i = 0; i < paths.size(); ++i)
+      {
+        if(auto file = getFile(paths[i]))
+        {
+          request_t request = {i, file};
+          requests.push_back(request);
+        }
       }
-      if(auto dir = static_cast<directory_ptr>(m_dirs_lut->lookup(path.c_str(), dir_part_length)))
+      sort(requests.begin(), requests.end(), [](const request_t& lhs, const request_t& rhs) {
+        return lhs.file->data_offset < rhs.file->data_offset;
+      });
+
+      // Neighbouring files are coalesced into runs (reading through small gaps rather than seeking
+      // over them), and the OS is asked to read each run in one go before anything is touched.
+      const uint64_t max_gap = 256 * 1024;
+      const uint64_t max_run = 8 * 1024 * 1024;
+      uint64_t run_begin = 0;
+      uint64_t run_end = 0;
+      for(auto& request : requests)
       {
-        auto itr = m_files + dir->first_file;
-        auto end = m_files + dir->last_file;
-        for(; itr != end; ++itr)
+        uint64_t begin = m_data_offset + request.file->data_offset;
+        uint64_t end = begin + request.file->data_length_compressed;
+        if(run_end != 0 && begin <= run_end + max_gap && end - run_begin <= max_run)
         {
-          if(strcmp(m_strings + itr->name_offset, file_part) == 0)
-            return ReadCompressedFile(&*m_archive_file, m_data_offset + itr->data_offset, itr->data_length_compressed, itr->data_length);
+          run_end = max(run_end, end);
+          continue;
         }
+        if(run_end != 0)
+          m_archive_file->prefetch(run_begin, run_end);
+        run_begin = begin;
+        run_end = end;
       }
-      return nullptr;
+      if(run_end != 0)
+        m_archive_file->prefetch(run_begin, run_end);
+
+      // Compressed files are inflated now, while going through the archive in order, rather than
+      // whenever the caller gets around to them.
+      vector<unique_ptr<MappableFile>> files(paths.size());
+      for(auto& request : requests)
+      {
+        auto& file = files[request.path_index];
+        file = openFile(request.file);
+        if(!request.file->isStored() && request.file->data_length != 0)
+          file->mapAll();
+      }
+      return files;
+    }
+
+    bool getIndexStats(Essence::IndexStats& stats) override
+    {
+      stats = m_index_stats;
+      return true;
+    }
+
+    void extractAll(Essence::ExtractionSink* sink, unsigned num_threads) override
+    {
+      struct job_t
+      {
+        directory_ptr dir;
+        file_ptr file;
+      };
+
+      auto data_header = reinterpret_cast<data_header_ptr>(m_data_header_mem.begin);
+      vector<job_t> jobs;
+      jobs.reserve(data_header->file_count);
+      for(uint32_t i = 0; i < data_header->directory_count; ++i)
+      {
+        auto dir = m_directories + i;
+        for(auto file = m_files + dir->first_file, end = m_files + dir->last_file; file != end; ++file)
+        {
+          job_t job = {dir, file};
+          jobs.push_back(job);
+        }
+      }
+
+      // Scheduling the largest files first means that the pool finishes with a long tail of small
+      // files, which balance out nicely between workers, rather than one worker inflating a huge
+      // file while the others sit idle.
+      sort(jobs.begin(), jobs.end(), [](const job_t& lhs, const job_t& rhs) {
+        return lhs.file->data_length > rhs.file->data_length;
+      });
+
+      auto get_path = [&](const job_t& job) -> string
+      {
+        string path(m_strings + job.dir->name_offset);
+        if(!path.empty())
+          path += '\\';
+        path += m_strings + job.file->name_offset;
+        return path;
+      };
+
+      // Block-compressed files are large by design, and their blocks are independent, so each of
+      // them gets a whole pool to itself, rather than one worker.
+      auto first_unblocked = stable_partition(jobs.begin(), jobs.end(), [](const job_t& job) {
+        return job.file->isBlockCompressed() && job.file->data_length != 0;
+      });
+      if(first_unblocked != jobs.begin())
+      {
+        WorkStealingPool pool(num_threads);
+        auto decompressor = Decompressor::create();
+        vector<uint8_t> buffer;
+        for(auto job = jobs.begin(); job != first_unblocked; ++job)
+        {
+          auto file = job->file;
+          if(buffer.size() < file->data_length)
+            buffer.resize(file->data_length);
+          auto length = InflateBlockCompressedFile(*decompressor, &pool, &*m_archive_file, m_data_offset + file->data_offset, file->data_length_compressed, buffer.data(), file->data_length, m_block_size);
+          sink->onFile(get_path(*job), buffer.data(), length);
+        }
+        jobs.erase(jobs.begin(), first_unblocked);
+      }
+
+      // Everything else goes through a RangeReader, which either maps each file on a worker (in the
+      // order above), or streams the files from disk in archive order, and hands them to workers.
+      auto reader = RangeReader::create(&*m_archive_file, num_threads);
+      if(reader->wantsFileOrder())
+      {
+        sort(jobs.begin(), jobs.end(), [](const job_t& lhs, const job_t& rhs) {
+          return lhs.file->data_offset < rhs.file->data_offset;
+        });
+      }
+      vector<RangeReader::range_t> ranges(jobs.size());
+      for(size_t i = 0; i < jobs.size(); ++i)
+      {
+        auto file = jobs[i].file;
+        ranges[i].offset = m_data_offset + file->data_offset;
+        ranges[i].size = file->data_length == 0 ? 0 : file->isStored() ? file->data_length : file->data_length_compressed;
+      }
+
+      vector<vector<uint8_t>> scratch(reader->getThreadCount());
+      vector<unique_ptr<Decompressor>> decompressors(reader->getThreadCount());
+      reader->run(ranges.data(), ranges.size(), [&](size_t job_index, const uint8_t* data, size_t size, unsigned worker_index) {
+        auto& job = jobs[job_index];
+        auto file = job.file;
+        auto path = get_path(job);
+
+        if(file->data_length == 0)
+        {
+          sink->onFile(path, nullptr, 0);
+        }
+        else if(file->isStored())
+        {
+          sink->onFile(path, data, size);
+        }
+        else
+        {
+          auto& buffer = scratch[worker_index];
+          if(buffer.size() < file->data_length)
+            buffer.resize(file->data_length);
+          auto& decompressor = decompressors[worker_index];
+          if(!decompressor)
+            decompressor = Decompressor::create();
+          auto length = decompressor->decompress(buffer.data(), file->data_length, data, size);
+          sink->onFile(path, buffer.data(), length);
+        }
+      });
+    }
+
+    bool verify(Essence::VerifyReport& report, unsigned num_threads) override
+    {
+      Stopwatch timer;
+      auto file_header_mem = m_archive_file->map(0, sizeof(file_header_t<version>));
+      auto file_header = reinterpret_cast<file_header_ptr>(file_header_mem.begin);
+      auto data_header = reinterpret_cast<data_header_ptr>(m_data_header_mem.begin);
+      auto contents_md5 = file_header->getContentsMD5();
+      if(!file_header->getHeaderMD5() && !contents_md5 && !file_t<version>::hasCRC())
+        return false;
+
+      string archive_name;
+      for(auto c : file_header->archive_name)
+      {
+        if(c == 0)
+          break;
+        archive_name += static_cast<char>(c < 0x80 ? c : '?');
+      }
+      mutex failures_lock;
+      auto fail = [&](const string& what)
+      {
+        lock_guard<mutex> lock(failures_lock);
+        report.failures.push_back(archive_name.empty() ? what : archive_name + ": " + what);
+      };
+      uint64_t num_checksums = 0;
+      uint64_t num_bytes = 0;
+
+      if(auto header_md5 = file_header->getHeaderMD5())
+      {
+        MD5 md5;
+        md5.update("DFC9AF62-FC1B-4180-BC27-11CCE87D3EFF", 36);
+        md5.update(m_data_header_mem.begin, m_data_header_mem.size());
+        if(!CheckMD5(md5, header_md5))
+          fail("header MD5 mismatch");
+        ++num_checksums;
+        num_bytes += m_data_header_mem.size();
+      }
+
+      // Files are checked in runs which lie within one chunk of the archive, so that every run is
+      // one large sequential read, and the whole archive is swept in order.
+      struct job_t
+      {
+        directory_ptr dir;
+        file_ptr file;
+      };
+      struct run_t
+      {
+        size_t first_job;
+        size_t end_job;
+      };
+      const uint64_t chunk_size = 8 * 1024 * 1024;
+      vector<job_t> jobs;
+      vector<run_t> runs;
+      if(file_t<version>::hasCRC())
+      {
+        jobs.reserve(data_header->file_count);
+        for(uint32_t i = 0; i < data_header->directory_count; ++i)
+        {
+          auto dir = m_directories + i;
+          for(auto file = m_files + dir->first_file, end = m_files + dir->last_file; file != end; ++file)
+          {
+            job_t job = {dir, file};
+            jobs.push_back(job);
+          }
+        }
+        sort(jobs.begin(), jobs.end(), [](const job_t& lhs, const job_t& rhs) {
+          return lhs.file->data_offset < rhs.file->data_offset;
+        });
+        for(size_t i = 0; i < jobs.size(); ++i)
+        {
+          if(runs.empty() || jobs[i].file->data_offset + jobs[i].file->data_length_compressed - jobs[runs.back().first_job].file->data_offset > chunk_size)
+          {
+            run_t run = {i, i};
+            runs.push_back(run);
+          }
+          runs.back().end_job = i + 1;
+        }
+      }
+
+      // The contents MD5 is inherently serial. No version has both it and per-file CRCs, so there
+      // is nothing for it to run alongside.
+      const auto archive_size = m_archive_file->getSize();
+      const size_t num_md5s = contents_md5 ? 1 : 0;
+      if(contents_md5)
+      {
+        MD5 md5;
+        md5.update("E01519D6-2DB7-4640-AF54-0A23319C56C3", 36);
+        for(uint64_t offset = file_header->getDataHeaderOffset(); offset < archive_size; offset += chunk_size)
+        {
+          auto mapped = m_archive_file->map(offset, min(archive_size, offset + chunk_size), AccessPattern::Sequential);
+          md5.update(mapped.begin, mapped.size());
+          num_bytes += mapped.size();
+        }
+        if(!CheckMD5(md5, contents_md5))
+          fail("contents MD5 mismatch");
+      }
+
+      // Runs are already in archive order, as streaming RangeReaders want them.
+      vector<RangeReader::range_t> ranges(runs.size());
+      for(size_t r = 0; r < runs.size(); ++r)
+      {
+        uint64_t run_begin = m_data_offset + jobs[runs[r].first_job].file->data_offset;
+        uint64_t run_end = run_begin;
+        for(auto i = runs[r].first_job; i < runs[r].end_job; ++i)
+          run_end = max(run_end, static_cast<uint64_t>(m_data_offset) + jobs[i].file->data_offset + jobs[i].file->data_length_compressed);
+        ranges[r].offset = min(run_begin, archive_size);
+        ranges[r].size = min(run_end, archive_size) - ranges[r].offset;
+      }
+      vector<uint64_t> worker_bytes;
+      if(!ranges.empty())
+      {
+        auto reader = RangeReader::create(&*m_archive_file, num_threads);
+        worker_bytes.resize(reader->getThreadCount());
+        reader->run(ranges.data(), ranges.size(), [&](size_t run_index, const uint8_t* data, size_t size, unsigned worker_index) {
+          auto& run = runs[run_index];
+          uint64_t run_begin = ranges[run_index].offset;
+          for(auto i = run.first_job; i < run.end_job; ++i)
+          {
+            auto file = jobs[i].file;
+            uint64_t begin = m_data_offset + file->data_offset;
+            uint64_t end = begin + file->data_length_compressed;
+            string error;
+            if(end > archive_size)
+              error = "truncated";
+            else if(crc32(0, data + (begin - run_begin), file->data_length_compressed) != file->getCRC())
+              error = "CRC mismatch";
+            else
+              continue;
+
+            string path(m_strings + jobs[i].dir->name_offset);
+            if(!path.empty())
+              path += '\\';
+            path += m_strings + file->name_offset;
+            fail(path + " " + error);
+          }
+          worker_bytes[worker_index] += size;
+        });
+      }
+
+      for(auto bytes : worker_bytes)
+        num_bytes += bytes;
+      report.num_checksums += num_checksums + num_md5s + jobs.size();
+      report.num_bytes += num_bytes;
+      report.seconds += timer.elapsedSeconds();
+      return true;
     }
 
   private:
+    static bool CheckMD5(MD5& md5, const int32_t* expected)
+    {
+      uint8_t digest[16];
+      md5.finish(digest);
+      return memcmp(digest, expected, sizeof(digest)) == 0;
+    }
+
+    static void MakeIndexKey(index_key_t& key, file_header_ptr file_header, data_header_ptr data_header)
+    {
+      memset(&key, 0, sizeof(key));
+      memcpy(key.signature, "SGAINDEX", 8);
+      key.format_version = index_format_version;
+      key.archive_version = version;
+      key.data_header_size = file_header->data_header_size;
+      key.data_offset = file_header->data_offset;
+      key.directory_count = data_header->directory_count;
+      key.file_count = data_header->file_count;
+      if(auto header_md5 = file_header->getHeaderMD5())
+        memcpy(key.header_md5, header_md5, sizeof(key.header_md5));
+    }
+
+    bool adoptIndex(const index_key_t& key, const Essence::ArchiveIndex& index)
+    {
+      auto header = reinterpret_cast<const index_header_t*>(index.data);
+      if(index.size < sizeof(index_header_t) || memcmp(&header->key, &key, sizeof(key)) || header->size != index.size)
+        return false;
+      if(header->dirs_lut_offset + dirs_lut_t::getMemoryFootprint(key.directory_count) > index.size
+      || header->files_lut_offset + files_lut_t::getMemoryFootprint(key.file_count) > index.size)
+        return false;
+
+      auto dirs_lut = reinterpret_cast<const dirs_lut_t*>(index.data + header->dirs_lut_offset);
+      auto files_lut = reinterpret_cast<const files_lut_t*>(index.data + header->files_lut_offset);
+      if(!dirs_lut->isSizedFor(key.directory_count) || !files_lut->isSizedFor(key.file_count))
+        return false;
+
+      // The tables came from disk, so a damaged cache file must not be able to make lookups index
+      // beyond the archive's tables (or never finish).
+      if(!dirs_lut->isConsistent([&](const DirectoryEntry& e) { return e.index < key.directory_count; })
+      || !files_lut->isConsistent([&](const FileEntry& e) { return e.index < key.file_count && e.dir_index < key.directory_count; }))
+        return false;
+
+      m_index = header;
+      m_dirs_lut = dirs_lut;
+      m_files_lut = files_lut;
+      return true;
+    }
+
+    void buildIndex(Arena* arena, const index_key_t& key)
+    {
+      auto dirs_lut_offset = AlignIndexOffset(sizeof(index_header_t));
+      auto files_lut_offset = AlignIndexOffset(dirs_lut_offset + dirs_lut_t::getMemoryFootprint(key.directory_count));
+      auto size = AlignIndexOffset(files_lut_offset + files_lut_t::getMemoryFootprint(key.file_count));
+
+      auto memory = static_cast<uint8_t*>(arena->malloc(size));
+      auto header = reinterpret_cast<index_header_t*>(memory);
+      memset(header, 0, dirs_lut_offset);
+      header->key = key;
+      header->size = size;
+      header->dirs_lut_offset = dirs_lut_offset;
+      header->files_lut_offset = files_lut_offset;
+      auto dirs_lut = dirs_lut_t::create(memory + dirs_lut_offset, key.directory_count);
+      auto files_lut = files_lut_t::create(memory + files_lut_offset, key.file_count);
+
+      // Full paths are gathered into batches and hashed several at a time by HashBatch. Pending
+      // directories are recorded as file entries with a dir_index of no_dir.
+      const uint32_t no_dir = 0xFFFFFFFF;
+      const size_t batch_size = 1024;
+      vector<char> paths;
+      vector<uint32_t> path_offsets, path_lengths, hashes;
+      vector<const uint8_t*> keys;
+      vector<FileEntry> pending;
+      auto add = [&](const string& path, uint32_t index, uint32_t dir_index)
+      {
+        path_offsets.push_back(static_cast<uint32_t>(paths.size()));
+        path_lengths.push_back(static_cast<uint32_t>(path.size()));
+        paths.insert(paths.end(), path.begin(), path.end());
+        FileEntry entry = {0, index, dir_index};
+        pending.push_back(entry);
+      };
+      auto flush = [&]
+      {
+        keys.resize(pending.size());
+        hashes.resize(pending.size());
+        for(size_t k = 0; k < pending.size(); ++k)
+          keys[k] = reinterpret_cast<const uint8_t*>(paths.data()) + path_offsets[k];
+        Essence::HashBatch(keys.data(), path_lengths.data(), hashes.data(), pending.size());
+        for(size_t k = 0; k < pending.size(); ++k)
+        {
+          auto& entry = pending[k];
+          entry.hash = hashes[k];
+          if(entry.dir_index == no_dir)
+          {
+            DirectoryEntry dir_entry = {entry.hash, entry.index};
+            dirs_lut->insert(dir_entry);
+          }
+          else
+            files_lut->insert(entry);
+        }
+        paths.clear();
+        path_offsets.clear();
+        path_lengths.clear();
+        pending.clear();
+      };
+
+      string path;
+      for(uint32_t i = 0; i < key.directory_count; ++i)
+      {
+        auto dir = m_directories + i;
+        path = m_strings + dir->name_offset;
+        add(path, i, no_dir);
+
+        if(!path.empty())
+          path += '\\';
+        auto dir_part_size = path.size();
+        for(uint32_t j = dir->first_file; j < dir->last_file; ++j)
+        {
+          path.resize(dir_part_size);
+          path += m_strings + m_files[j].name_offset;
+          add(path, j, i);
+          if(pending.size() >= batch_size)
+            flush();
+        }
+      }
+      flush();
+
+      m_index = header;
+      m_dirs_lut = dirs_lut;
+      m_files_lut = files_lut;
+    }
+
     directory_ptr getDirectory(const std::string& path)
     {
       // NB: Assuming that path is already normalised.
-      return static_cast<directory_ptr>(m_dirs_lut->lookup(path.c_str(), static_cast<uint32_t>(path.size())));
+      auto entry = m_dirs_lut->lookup(Essence::Hash(path.c_str(), static_cast<uint32_t>(path.size())), [&](const DirectoryEntry& e) -> bool {
+        return path == m_strings + m_directories[e.index].name_offset;
+      });
+      return entry ? m_directories + entry->index : nullptr;
+    }
+
+    file_ptr getFile(const std::string& path)
+    {
+      // NB: Assuming that path is already normalised.
+      auto file_sep_pos = path.find_last_of('\\');
+      size_t dir_part_length = 0;
+      auto file_part = path.c_str();
+      if(file_sep_pos != string::npos)
+      {
+        dir_part_length = file_sep_pos;
+        file_part += file_sep_pos + 1;
+      }
+
+      auto entry = m_files_lut->lookup(Essence::Hash(path.c_str(), static_cast<uint32_t>(path.size())), [&](const FileEntry& e) -> bool {
+        auto dir_name = m_strings + m_directories[e.dir_index].name_offset;
+        return !strncmp(dir_name, path.c_str(), dir_part_length) && dir_name[dir_part_length] == '\0'
+            && !strcmp(m_strings + m_files[e.index].name_offset, file_part);
+      });
+      return entry ? m_files + entry->index : nullptr;
+    }
+
+    unique_ptr<MappableFile> openFile(file_ptr file)
+    {
+      return ReadCompressedFile(&*m_archive_file, m_data_offset + file->data_offset, file->data_length_compressed, file->data_length, file->isStored(), file->isBlockCompressed() ? m_block_size : 0, this, static_cast<uint32_t>(file - m_files));
     }
 
-    StringHashTable* m_dirs_lut;
-    uint32_t m_data_offset;
+    const index_header_t* m_index;
+    const dirs_lut_t* m_dirs_lut;
+    const files_lut_t* m_files_lut;
+    Essence::IndexStats m_index_stats;
+    uint64_t m_data_offset;
+    uint32_t m_block_size;
     directory_ptr m_directories;
     file_ptr m_files;
     const char* m_strings;
@@ -248,12 +1004,14 @@ namespace
 
 namespace Essence
 {
-  FileSource* Essence::CreateArchiveFileSource(Arena* arena, std::unique_ptr<MappableFile> archive)
+  FileSource* CreateArchiveFileSource(Arena* arena, std::unique_ptr<MappableFile> archive, ArchiveIndex* index)
   {
     if(archive->getSize() < sizeof(file_header_t<4>))
       throw std::runtime_error("File too small to be an archive.");
 
-    auto file_header_mem = archive->map(0, sizeof(file_header_t<5>));
+    // Enough for the largest header, or failing that, for the version 5 header checked below.
+    auto header_size = (std::min)(archive->getSize(), static_cast<uint64_t>(sizeof(file_header_t<9>)));
+    auto file_header_mem = archive->map(0, (std::max)(header_size, static_cast<uint64_t>(sizeof(file_header_t<5>))));
     auto file_header = reinterpret_cast<const file_header_t<5>*>(file_header_mem.begin);
 
     if(memcmp(file_header->signature, "_ARCHIVE", 8))
@@ -261,16 +1019,22 @@ namespace Essence
     switch(file_header->version)
     {
     case 2:
-      return Archive<2>::create(arena, move(archive), file_header_mem);
+      return Archive<2>::create(arena, move(archive), file_header_mem, index);
     case 4:
-      return Archive<4>::create(arena, move(archive), file_header_mem);
+      return Archive<4>::create(arena, move(archive), file_header_mem, index);
     case 5:
       if(file_header->data_header_offset < 8)
-        return Archive<45>::create(arena, move(archive), file_header_mem);
+        return Archive<45>::create(arena, move(archive), file_header_mem, index);
       else
-        return Archive<5>::create(arena, move(archive), file_header_mem);
+        return Archive<5>::create(arena, move(archive), file_header_mem, index);
     case 6:
-      return Archive<6>::create(arena, move(archive), file_header_mem);
+      return Archive<6>::create(arena, move(archive), file_header_mem, index);
+    case 7:
+      return Archive<7>::create(arena, move(archive), file_header_mem, index);
+    case 9:
+      if(file_header_mem.size() < sizeof(file_header_t<9>))
+        throw std::runtime_error("File too small to be an archive.");
+      return Archive<9>::create(arena, move(archive), file_header_mem, index);
     default:
       throw std::runtime_error("Unsupported archive version.");
     }
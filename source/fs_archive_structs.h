@@ -16,13 +16,15 @@ namespace internal
       };
     };
     int32_t contents_md5[4];
-    wchar_t archive_name[64];
+    uint16_t archive_name[64]; // UTF-16, regardless of the size of wchar_t
     int32_t header_md5[4];
     uint32_t data_header_size;
     uint32_t data_offset;
 
     inline uint32_t getPlatform() const {return 1;}
     inline uint32_t getDataHeaderOffset() const {return sizeof(file_header_t);}
+    inline const int32_t* getHeaderMD5() const {return header_md5;}
+    inline const int32_t* getContentsMD5() const {return contents_md5;}
   };
 
   template <typename count>
@@ -38,6 +40,8 @@ namespace internal
     count  file_count;
     offset strings_offset;
     count  strings_count;
+
+    inline uint32_t getBlockSize() const {return 0;}
   };
 
   template <typename index>
@@ -111,6 +115,10 @@ struct file_t<2>
 
   static bool hasTimestamp() {return false;}
   uint32_t getTimestamp() const {return 0;}
+  static bool hasCRC() {return false;}
+  uint32_t getCRC() const {return 0;}
+  bool isStored() const {return data_length_compressed == data_length;}
+  bool isBlockCompressed() const {return false;}
 };
 
 /***** Version 4.0 *****/
@@ -151,6 +159,10 @@ struct file_t<4>
 
   static bool hasTimestamp() {return true;}
   uint32_t getTimestamp() const {return modification_time;}
+  static bool hasCRC() {return false;}
+  uint32_t getCRC() const {return 0;}
+  bool isStored() const {return data_length_compressed == data_length;}
+  bool isBlockCompressed() const {return false;}
 };
 
 /***** Version 5.0 as used by CoH2 alpha *****/
@@ -221,13 +233,15 @@ struct file_header_t<6>
 {
   char signature[8];
   uint32_t version;
-  wchar_t archive_name[64];
+  uint16_t archive_name[64]; // UTF-16, regardless of the size of wchar_t
   uint32_t data_header_size;
   uint32_t data_offset;
   uint32_t platform;
 
   inline uint32_t getPlatform() const {return platform;}
   inline uint32_t getDataHeaderOffset() const {return sizeof(file_header_t);}
+  inline const int32_t* getHeaderMD5() const {return nullptr;}
+  inline const int32_t* getContentsMD5() const {return nullptr;}
 };
 
 template <>
@@ -249,7 +263,131 @@ struct directory_t<6> : directory_t<45>
 template <>
 struct file_t<6> : file_t<4>
 {
-  uint32_t hash;
+  uint32_t hash; // CRC-32 of the data as stored (i.e. after compression)
+
+  static bool hasCRC() {return true;}
+  uint32_t getCRC() const {return hash;}
+};
+
+/***** Versions 7.0 and later *****/
+
+// Later versions say how each file is stored, rather than leaving readers to compare lengths.
+// StorageBlocks is particular to this project (WriteArchive emits it, and Relic's tools are not
+// known to): the data is a table of num_blocks uint32_t end offsets (relative to the end of the
+// table), followed by that many zlib streams, each of which inflates to block_size bytes (bar the
+// last), where num_blocks is data_length / block_size rounded up, and block_size comes from the
+// data header. The blocks are independent, so can be inflated in parallel.
+namespace internal
+{
+  enum storage_type_t
+  {
+    StorageStored = 0,
+    StorageStream = 1, //!< A single zlib stream.
+    StorageBuffer = 2, //!< A single zlib stream, which Relic intended to be inflated in one go.
+    StorageBlocks = 3,
+  };
+}
+
+template <>
+struct file_header_t<7> : file_header_t<6>
+{
+};
+
+template <>
+struct data_header_t<7> : data_header_t<6>
+{
+};
+
+template <>
+struct entry_point_t<7> : entry_point_t<6>
+{
+};
+
+template <>
+struct directory_t<7> : directory_t<6>
+{
+};
+
+template <>
+struct file_t<7>
+{
+  uint32_t name_offset;
+  uint32_t data_offset;
+  uint32_t data_length_compressed;
+  uint32_t data_length;
+  uint32_t modification_time;
+  uint8_t verification_type;
+  uint8_t storage_type; // internal::storage_type_t
+  uint32_t crc; // CRC-32 of the data as stored (i.e. after compression)
+  uint32_t hash_offset;
+
+  static bool hasTimestamp() {return true;}
+  uint32_t getTimestamp() const {return modification_time;}
+  static bool hasCRC() {return true;}
+  uint32_t getCRC() const {return crc;}
+  bool isStored() const {return storage_type == internal::StorageStored;}
+  bool isBlockCompressed() const {return storage_type == internal::StorageBlocks;}
+};
+
+/***** Version 9.0 (64-bit offsets) *****/
+
+template <>
+struct file_header_t<9>
+{
+  char signature[8];
+  uint32_t version;
+  uint16_t archive_name[64]; // UTF-16, regardless of the size of wchar_t
+  uint64_t data_header_offset;
+  uint32_t data_header_size;
+  uint64_t data_offset;
+  uint64_t data_size;
+  uint32_t platform;
+  uint8_t rsa_signature[256];
+
+  inline uint32_t getPlatform() const {return platform;}
+  inline uint64_t getDataHeaderOffset() const {return data_header_offset;}
+  inline const int32_t* getHeaderMD5() const {return nullptr;}
+  inline const int32_t* getContentsMD5() const {return nullptr;}
+};
+
+template <>
+struct data_header_t<9> : data_header_t<6>
+{
+  uint32_t hash_offset;
+  uint32_t hash_length;
+  uint32_t block_size;
+
+  inline uint32_t getBlockSize() const {return block_size;}
+};
+
+template <>
+struct entry_point_t<9> : entry_point_t<6>
+{
+};
+
+template <>
+struct directory_t<9> : directory_t<6>
+{
+};
+
+template <>
+struct file_t<9>
+{
+  uint32_t name_offset;
+  uint32_t hash_offset;
+  uint64_t data_offset;
+  uint32_t data_length_compressed;
+  uint32_t data_length;
+  uint8_t verification_type;
+  uint8_t storage_type; // internal::storage_type_t
+  uint32_t crc; // CRC-32 of the data as stored (i.e. after compression)
+
+  static bool hasTimestamp() {return false;}
+  uint32_t getTimestamp() const {return 0;}
+  static bool hasCRC() {return true;}
+  uint32_t getCRC() const {return crc;}
+  bool isStored() const {return storage_type == internal::StorageStored;}
+  bool isBlockCompressed() const {return storage_type == internal::StorageBlocks;}
 };
 
 #pragma pack(pop)
@@ -0,0 +1,528 @@
+#include "stdafx.h"
+#include "fs.h"
+#include "mappable.h"
+#include "md5.h"
+#include "stopwatch.h"
+#include "thread_pool.h"
+#include "zlib.h"
+#include <limits>
+#include <stdio.h>
+using namespace std;
+
+namespace
+{
+#include "fs_archive_structs.h"
+
+  //! A directory of the archive being written. Directories are numbered breadth-first, so that
+  //! the children of each are contiguous.
+  struct pending_dir_t
+  {
+    string name; //!< Full path within the archive, as is stored in the archive.
+    uint32_t first_directory;
+    uint32_t last_directory;
+    uint32_t first_file;
+    uint32_t last_file;
+  };
+
+  struct pending_file_t
+  {
+    string name; //!< Name within its directory, as is stored in the archive.
+    string source_path;
+    uint64_t data_offset;
+    uint32_t data_length_compressed;
+    uint32_t data_length;
+    uint32_t crc;
+    uint8_t storage_type; //!< internal::storage_type_t
+  };
+
+  //! A file of the current batch, between being opened and being written out.
+  struct batch_entry_t
+  {
+    unique_ptr<MappableFile> file;
+    MappedMemory contents;
+    vector<uint8_t> deflated; //!< Empty if the file is to be stored.
+    uint8_t storage_type;     //!< internal::storage_type_t
+  };
+
+  string JoinPath(const string& dir, const string& name)
+  {
+    return dir.empty() ? name : dir + '\\' + name;
+  }
+
+  void SortedUnique(vector<string>& names)
+  {
+    sort(names.begin(), names.end());
+    names.erase(unique(names.begin(), names.end()), names.end());
+  }
+
+  void GatherTree(Essence::FileSource* source, const string& root, vector<pending_dir_t>& dirs, vector<pending_file_t>& files)
+  {
+    pending_dir_t top = {string(), 0, 0, 0, 0};
+    dirs.push_back(top);
+    vector<string> names;
+    for(size_t i = 0; i < dirs.size(); ++i)
+    {
+      auto source_dir = JoinPath(root, dirs[i].name);
+
+      names.clear();
+      source->getFiles(source_dir, names);
+      SortedUnique(names);
+      dirs[i].first_file = static_cast<uint32_t>(files.size());
+      for(auto& name : names)
+      {
+        pending_file_t file = {name, JoinPath(source_dir, name), 0, 0, 0, 0, internal::StorageStored};
+        files.push_back(move(file));
+      }
+      dirs[i].last_file = static_cast<uint32_t>(files.size());
+
+      names.clear();
+      source->getDirs(source_dir, names);
+      SortedUnique(names);
+      dirs[i].first_directory = static_cast<uint32_t>(dirs.size());
+      for(auto& name : names)
+      {
+        pending_dir_t dir = {JoinPath(dirs[i].name, name), 0, 0, 0, 0};
+        dirs.push_back(move(dir));
+      }
+      dirs[i].last_directory = static_cast<uint32_t>(dirs.size());
+    }
+  }
+
+  //! The archive being written, which only replaces whatever is at path once close succeeds.
+  /*!
+    Everything is written to a temporary file alongside path, so that a failure partway through
+    (an unreadable source file, a full disk, ...) neither leaves a truncated archive behind nor
+    clobbers a good one. If close is never reached, the temporary file is removed.
+  */
+  class OutputFile
+  {
+  public:
+    OutputFile(const string& path)
+      : m_path(path)
+      , m_temp_path(path + ".tmp")
+      , m_committed(false)
+    {
+      m_file = fopen(m_temp_path.c_str(), "w+b");
+      if(!m_file)
+        throw runtime_error("Cannot create file `" + m_temp_path + "'");
+    }
+
+    ~OutputFile()
+    {
+      if(m_file)
+        fclose(m_file);
+      if(!m_committed)
+        remove(m_temp_path.c_str());
+    }
+
+    void write(const void* data, size_t size)
+    {
+      if(size && fwrite(data, 1, size, m_file) != size)
+        throw runtime_error("Cannot write file `" + m_path + "'");
+    }
+
+    void read(void* data, size_t size)
+    {
+      if(size && fread(data, 1, size, m_file) != size)
+        throw runtime_error("Cannot read back file `" + m_path + "'");
+    }
+
+    void seek(uint32_t offset)
+    {
+      if(fseek(m_file, static_cast<long>(offset), SEEK_SET) != 0)
+        throw runtime_error("Cannot seek within file `" + m_path + "'");
+    }
+
+    void close()
+    {
+      auto file = m_file;
+      m_file = nullptr;
+      if(fclose(file) != 0)
+        throw runtime_error("Cannot write file `" + m_path + "'");
+#ifdef _WIN32
+      if(!MoveFileExA(m_temp_path.c_str(), m_path.c_str(), MOVEFILE_REPLACE_EXISTING))
+#else
+      if(rename(m_temp_path.c_str(), m_path.c_str()) != 0)
+#endif
+        throw runtime_error("Cannot replace file `" + m_path + "'");
+      m_committed = true;
+    }
+
+  private:
+    OutputFile(const OutputFile& cannot_copy);
+    OutputFile& operator= (const OutputFile& cannot_copy);
+
+    FILE* m_file;
+    string m_path;
+    string m_temp_path;
+    bool m_committed;
+  };
+
+  template <typename T>
+  void Append(vector<uint8_t>& out, const T& value)
+  {
+    auto bytes = reinterpret_cast<const uint8_t*>(&value);
+    out.insert(out.end(), bytes, bytes + sizeof(T));
+  }
+
+  // Versions 4 and 6 leave readers to compare lengths to tell stored files from deflated ones.
+  void SetStorage(file_t<4>&, const pending_file_t&) {}
+  void SetStorage(file_t<6>& file, const pending_file_t& pending) { file.hash = pending.crc; }
+
+  template <typename File>
+  void SetStorage(File& file, const pending_file_t& pending)
+  {
+    file.verification_type = 1; // CRC
+    file.storage_type = pending.storage_type;
+    file.crc = pending.crc;
+  }
+
+  // Version 9 moves the data header to after its (larger) file header, and gives the block size.
+  template <typename FileHeader, typename DataHeader>
+  void SetLayout(FileHeader&, DataHeader&, uint32_t) {}
+
+  void SetLayout(file_header_t<9>& file_header, data_header_t<9>& data_header, uint32_t block_size)
+  {
+    file_header.data_header_offset = sizeof(file_header);
+    data_header.block_size = block_size;
+  }
+
+  template <typename FileHeader>
+  void SetDataSize(FileHeader&, uint64_t) {}
+  void SetDataSize(file_header_t<9>& file_header, uint64_t data_size) { file_header.data_size = data_size; }
+
+  // Version 4 archives checksum the data header, and everything from the data header onwards.
+  void SetMD5s(file_header_t<4>& header, const vector<uint8_t>& data_header, OutputFile& out, uint64_t data_size)
+  {
+    {
+      MD5 md5;
+      md5.update("DFC9AF62-FC1B-4180-BC27-11CCE87D3EFF", 36);
+      md5.update(data_header.data(), data_header.size());
+      md5.finish(reinterpret_cast<uint8_t*>(header.header_md5));
+    }
+    {
+      MD5 md5;
+      md5.update("E01519D6-2DB7-4640-AF54-0A23319C56C3", 36);
+      md5.update(data_header.data(), data_header.size());
+      out.seek(header.data_offset);
+      vector<uint8_t> buffer(1024 * 1024);
+      for(uint64_t remaining = data_size; remaining; )
+      {
+        auto size = static_cast<size_t>((min)(remaining, static_cast<uint64_t>(buffer.size())));
+        out.read(buffer.data(), size);
+        md5.update(buffer.data(), size);
+        remaining -= size;
+      }
+      md5.finish(reinterpret_cast<uint8_t*>(header.contents_md5));
+    }
+  }
+
+  template <typename FileHeader>
+  void SetMD5s(FileHeader&, const vector<uint8_t>&, OutputFile&, uint64_t) {}
+
+  //! Deflates a batch of files across a pool, with one zlib stream per worker.
+  /*!
+    \param block_size If non-zero, files larger than this are deflated as independent blocks of
+                      this size (internal::StorageBlocks), rather than as a single stream.
+  */
+  class BatchCompressor
+  {
+  public:
+    BatchCompressor(unsigned num_threads, int level, uint32_t block_size)
+      : m_pool(num_threads)
+      , m_streams(m_pool.getThreadCount())
+      , m_level(level)
+      , m_block_size(block_size)
+    {
+      for(auto& stream : m_streams)
+        stream.opened = false;
+    }
+
+    ~BatchCompressor()
+    {
+      for(auto& stream : m_streams)
+      {
+        if(stream.opened)
+          deflateEnd(&stream.z);
+      }
+    }
+
+    void run(batch_entry_t* batch, size_t count)
+    {
+      // Largest first, as in Archive::extractAll. This only affects scheduling; each entry's
+      // output is kept with the entry, and written out in the original order.
+      vector<size_t> order(count);
+      for(size_t i = 0; i < order.size(); ++i)
+        order[i] = i;
+      sort(order.begin(), order.end(), [&](size_t lhs, size_t rhs) {
+        return batch[lhs].file->getSize() > batch[rhs].file->getSize();
+      });
+
+      m_pool.run(order.size(), [&](size_t task_index, unsigned worker_index) {
+        auto& entry = batch[order[task_index]];
+        entry.contents = entry.file->mapAll();
+        entry.storage_type = internal::StorageStored;
+        if(m_level != 0 && entry.contents.size() != 0)
+          deflateEntry(entry, m_streams[worker_index]);
+      });
+    }
+
+  private:
+    BatchCompressor(const BatchCompressor& cannot_copy);
+    BatchCompressor& operator= (const BatchCompressor& cannot_copy);
+
+    struct stream_t
+    {
+      z_stream z;
+      bool opened;
+    };
+
+    //! Deflate data as one zlib stream, appended to out.
+    void deflateAppend(stream_t& stream, const uint8_t* data, uint32_t size, vector<uint8_t>& out)
+    {
+      if(!stream.opened)
+      {
+        memset(&stream.z, 0, sizeof(stream.z));
+        if(deflateInit(&stream.z, m_level) != Z_OK)
+          throw runtime_error("Could not initialise zlib.");
+        stream.opened = true;
+      }
+      else if(deflateReset(&stream.z) != Z_OK)
+        throw runtime_error("Could not reset zlib.");
+
+      auto out_begin = out.size();
+      out.resize(out_begin + deflateBound(&stream.z, size));
+      stream.z.next_in = const_cast<uint8_t*>(data);
+      stream.z.avail_in = static_cast<uInt>(size);
+      stream.z.next_out = out.data() + out_begin;
+      stream.z.avail_out = static_cast<uInt>(out.size() - out_begin);
+      if(deflate(&stream.z, Z_FINISH) != Z_STREAM_END)
+        throw runtime_error("Could not deflate file.");
+      out.resize(out_begin + stream.z.total_out);
+    }
+
+    void deflateEntry(batch_entry_t& entry, stream_t& stream)
+    {
+      auto size = static_cast<uint32_t>(entry.contents.size());
+      if(m_block_size != 0 && size > m_block_size)
+      {
+        // A table of block end offsets, and then the blocks; see internal::storage_type_t.
+        uint32_t num_blocks = size / m_block_size + (size % m_block_size != 0);
+        size_t table_size = num_blocks * sizeof(uint32_t);
+        entry.deflated.resize(table_size);
+        for(uint32_t i = 0; i < num_blocks; ++i)
+        {
+          uint32_t block_begin = i * m_block_size;
+          deflateAppend(stream, entry.contents.begin + block_begin, (min)(m_block_size, size - block_begin), entry.deflated);
+          auto block_end = static_cast<uint32_t>(entry.deflated.size() - table_size);
+          memcpy(entry.deflated.data() + i * sizeof(uint32_t), &block_end, sizeof(block_end));
+        }
+        entry.storage_type = internal::StorageBlocks;
+      }
+      else
+      {
+        deflateAppend(stream, entry.contents.begin, size, entry.deflated);
+        entry.storage_type = internal::StorageStream;
+      }
+
+      // Older readers treat an entry whose two lengths are equal as stored, so deflating must
+      // actually make the file smaller for it to be kept.
+      if(entry.deflated.size() < size)
+      {
+        entry.deflated.shrink_to_fit();
+      }
+      else
+      {
+        vector<uint8_t>().swap(entry.deflated);
+        entry.storage_type = internal::StorageStored;
+      }
+    }
+
+    WorkStealingPool m_pool;
+    vector<stream_t> m_streams;
+    int m_level;
+    uint32_t m_block_size;
+  };
+
+  template <int version>
+  void WriteArchiveVersion(Essence::FileSource* source, const string& root, const string& archive_path, const Essence::ArchiveWriteOptions& options, Essence::ArchiveWriteReport& report)
+  {
+    typedef decltype(static_cast<directory_t<version>*>(nullptr)->first_file) index_t;
+    typedef decltype(static_cast<file_t<version>*>(nullptr)->data_offset) data_offset_t;
+    const uint32_t block_size = version >= 9 ? options.block_size : 0;
+
+    vector<pending_dir_t> dirs;
+    vector<pending_file_t> files;
+    GatherTree(source, root, dirs, files);
+    if(dirs.size() > (numeric_limits<index_t>::max)() || files.size() > (numeric_limits<index_t>::max)())
+      throw runtime_error("Too many files for an SGA archive of this version.");
+
+    // The data header's size depends only upon names and counts, so file data can be written
+    // straight after it, and the header itself written once the data offsets are known.
+    vector<uint8_t> strings;
+    vector<uint32_t> dir_name_offsets, file_name_offsets;
+    for(auto& dir : dirs)
+    {
+      dir_name_offsets.push_back(static_cast<uint32_t>(strings.size()));
+      strings.insert(strings.end(), dir.name.c_str(), dir.name.c_str() + dir.name.size() + 1);
+    }
+    for(auto& file : files)
+    {
+      file_name_offsets.push_back(static_cast<uint32_t>(strings.size()));
+      strings.insert(strings.end(), file.name.c_str(), file.name.c_str() + file.name.size() + 1);
+    }
+
+    data_header_t<version> data_header;
+    memset(&data_header, 0, sizeof(data_header));
+    data_header.entry_point_offset = sizeof(data_header);
+    data_header.entry_point_count = 1;
+    data_header.directory_offset = data_header.entry_point_offset + sizeof(entry_point_t<version>);
+    data_header.directory_count = static_cast<index_t>(dirs.size());
+    data_header.file_offset = data_header.directory_offset + static_cast<uint32_t>(dirs.size() * sizeof(directory_t<version>));
+    data_header.file_count = static_cast<index_t>(files.size());
+    data_header.strings_offset = data_header.file_offset + static_cast<uint32_t>(files.size() * sizeof(file_t<version>));
+    data_header.strings_count = static_cast<index_t>(dirs.size() + files.size());
+
+    file_header_t<version> file_header;
+    memset(&file_header, 0, sizeof(file_header));
+    memcpy(file_header.signature, "_ARCHIVE", 8);
+    file_header.version = version;
+    for(size_t i = 0; i < options.archive_name.size() && i + 1 < sizeof(file_header.archive_name) / sizeof(file_header.archive_name[0]); ++i)
+      file_header.archive_name[i] = static_cast<uint8_t>(options.archive_name[i]);
+    file_header.data_header_size = data_header.strings_offset + static_cast<uint32_t>(strings.size());
+    SetLayout(file_header, data_header, block_size);
+    file_header.data_offset = static_cast<decltype(file_header.data_offset)>(file_header.getDataHeaderOffset() + file_header.data_header_size);
+    file_header.platform = 1;
+
+    OutputFile out(archive_path);
+    out.write(vector<uint8_t>(static_cast<size_t>(file_header.data_offset)).data(), static_cast<size_t>(file_header.data_offset));
+
+    // Files are opened, deflated and written in batches, so that memory use is bounded by the
+    // batch size rather than by the size of the archive.
+    const uint64_t max_batch_bytes = 64 * 1024 * 1024;
+    const size_t max_batch_files = 4096;
+    BatchCompressor compressor(options.num_threads, options.compression_level, block_size);
+    unique_ptr<batch_entry_t[]> batch(new batch_entry_t[max_batch_files]);
+    uint64_t data_size = 0;
+    for(size_t first = 0; first < files.size(); )
+    {
+      uint64_t batch_bytes = 0;
+      size_t end = first;
+      for(; end < files.size() && end - first < max_batch_files && batch_bytes < max_batch_bytes; ++end)
+      {
+        auto& entry = batch[end - first];
+        entry.file = source->readFile(files[end].source_path);
+        if(!entry.file)
+          throw runtime_error("Cannot read file `" + files[end].source_path + "'");
+        if(entry.file->getSize() > 0xFFFFFFFFU)
+          throw runtime_error("File `" + files[end].source_path + "' is too large for an SGA archive.");
+        batch_bytes += entry.file->getSize();
+      }
+      compressor.run(batch.get(), end - first);
+
+      for(size_t i = first; i < end; ++i)
+      {
+        auto& entry = batch[i - first];
+        auto& file = files[i];
+        const uint8_t* stored = entry.deflated.empty() ? entry.contents.begin : entry.deflated.data();
+        size_t stored_size = entry.deflated.empty() ? entry.contents.size() : entry.deflated.size();
+        if(file_header.data_offset + data_size + stored_size > (numeric_limits<data_offset_t>::max)())
+          throw runtime_error("Too much data for an SGA archive of this version.");
+        file.data_offset = data_size;
+        file.data_length_compressed = static_cast<uint32_t>(stored_size);
+        file.data_length = static_cast<uint32_t>(entry.contents.size());
+        file.storage_type = entry.storage_type;
+        if(file_t<version>::hasCRC())
+          file.crc = static_cast<uint32_t>(crc32(0, stored, static_cast<uInt>(stored_size)));
+        out.write(stored, stored_size);
+        data_size += stored_size;
+        report.num_bytes_in += file.data_length;
+        if(entry.deflated.empty())
+          ++report.num_files_stored;
+        if(entry.storage_type == internal::StorageBlocks)
+          ++report.num_files_blocked;
+
+        entry.contents = nullptr;
+        entry.file.reset();
+        vector<uint8_t>().swap(entry.deflated);
+      }
+      first = end;
+    }
+
+    vector<uint8_t> data_header_mem;
+    data_header_mem.reserve(file_header.data_header_size);
+    Append(data_header_mem, data_header);
+    {
+      entry_point_t<version> entry_point;
+      memset(&entry_point, 0, sizeof(entry_point));
+      strncpy(entry_point.directory_name, options.entry_point.c_str(), sizeof(entry_point.directory_name) - 1);
+      strncpy(entry_point.alias, options.entry_point.c_str(), sizeof(entry_point.alias) - 1);
+      entry_point.last_directory = static_cast<index_t>(dirs.size());
+      entry_point.last_file = static_cast<index_t>(files.size());
+      Append(data_header_mem, entry_point);
+    }
+    for(size_t i = 0; i < dirs.size(); ++i)
+    {
+      directory_t<version> dir;
+      dir.name_offset = dir_name_offsets[i];
+      dir.first_directory = static_cast<index_t>(dirs[i].first_directory);
+      dir.last_directory = static_cast<index_t>(dirs[i].last_directory);
+      dir.first_file = static_cast<index_t>(dirs[i].first_file);
+      dir.last_file = static_cast<index_t>(dirs[i].last_file);
+      Append(data_header_mem, dir);
+    }
+    for(size_t i = 0; i < files.size(); ++i)
+    {
+      // Neither a modification time nor any flags are recorded.
+      file_t<version> file;
+      memset(&file, 0, sizeof(file));
+      file.name_offset = file_name_offsets[i];
+      file.data_offset = static_cast<data_offset_t>(files[i].data_offset);
+      file.data_length_compressed = files[i].data_length_compressed;
+      file.data_length = files[i].data_length;
+      SetStorage(file, files[i]);
+      Append(data_header_mem, file);
+    }
+    data_header_mem.insert(data_header_mem.end(), strings.begin(), strings.end());
+
+    SetDataSize(file_header, data_size);
+    SetMD5s(file_header, data_header_mem, out, data_size);
+    out.seek(0);
+    out.write(&file_header, sizeof(file_header));
+    out.write(data_header_mem.data(), data_header_mem.size());
+    out.close();
+
+    report.num_dirs = dirs.size();
+    report.num_files = files.size();
+    report.num_bytes_out = file_header.data_offset + data_size;
+  }
+}
+
+namespace Essence
+{
+  void WriteArchive(FileSource* source, const string& root, const string& archive_path, const ArchiveWriteOptions& options, ArchiveWriteReport* report)
+  {
+    Stopwatch timer;
+    ArchiveWriteReport local_report;
+    switch(options.version)
+    {
+    case 4:
+      WriteArchiveVersion<4>(source, root, archive_path, options, local_report);
+      break;
+    case 6:
+      WriteArchiveVersion<6>(source, root, archive_path, options, local_report);
+      break;
+    case 7:
+      WriteArchiveVersion<7>(source, root, archive_path, options, local_report);
+      break;
+    case 9:
+      WriteArchiveVersion<9>(source, root, archive_path, options, local_report);
+      break;
+    default:
+      throw runtime_error("Unsupported archive version for writing.");
+    }
+    local_report.seconds = timer.elapsedSeconds();
+    if(report)
+      *report = local_report;
+  }
+}
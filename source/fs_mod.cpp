@@ -2,6 +2,7 @@
 #include "fs.h"
 #include "mappable.h"
 #include "arena.h"
+#include <stdio.h>
 using namespace std;
 
 namespace
@@ -24,34 +25,106 @@ namespace
     names.erase(unique(names.begin(), names.end()), names.end());
   }
 
+  //! Union of several FileSources, where earlier sources shadow files in later ones.
+  /*!
+    The merged directory tree is built once, by buildNamespace(), after all the sources have been
+    appended. From then on, reading a file is a single lookup followed by a call to the source which
+    owns it, and directory listings are copied from precomputed sorted lists. As a consequence, files
+    added to loose folders after mounting are not visible.
+  */
   class AggregateFileSource : public Essence::FileSource
   {
   public:
     unique_ptr<MappableFile> readFile(const string& path) override
     {
       auto norm_path = normalise_path(path);
-      for(auto itr = m_sources.cbegin(), end = m_sources.cend(); itr != end; ++itr)
+      auto owner = m_file_owners.find(norm_path);
+      if(owner != m_file_owners.end())
       {
-        if(auto file = (**itr).readFile(norm_path))
+        if(auto file = m_sources[owner->second]->readFile(norm_path))
           return move(file);
       }
+#ifdef _WIN32
       throw C6::CreateFileException(path.c_str());
+#else
+      throw runtime_error("Cannot open file `" + path + "'");
+#endif
+    }
+
+    vector<unique_ptr<MappableFile>> readFiles(const vector<string>& paths) override
+    {
+      // Each source is given every path which it owns as one batch, so that it can order them.
+      vector<vector<size_t>> owned(m_sources.size());
+      vector<string> norm_paths(paths.size());
+      vector<unique_ptr<MappableFile>> files(paths.size());
+      for(size_t i = 0; i < paths.size(); ++i)
+      {
+        norm_paths[i] = normalise_path(paths[i]);
+        auto owner = m_file_owners.find(norm_paths[i]);
+        if(owner == m_file_owners.end())
+          files[i] = readFile(paths[i]); // Throws.
+        else
+          owned[owner->second].push_back(i);
+      }
+
+      vector<string> batch;
+      for(size_t source = 0; source < m_sources.size(); ++source)
+      {
+        if(owned[source].empty())
+          continue;
+        batch.clear();
+        for(auto i : owned[source])
+          batch.push_back(norm_paths[i]);
+        auto batch_files = m_sources[source]->readFiles(batch);
+        for(size_t j = 0; j < batch_files.size(); ++j)
+        {
+          auto i = owned[source][j];
+          files[i] = batch_files[j] ? move(batch_files[j]) : readFile(paths[i]);
+        }
+      }
+      return files;
     }
 
     void getFiles(const string& path, vector<string>& files) override
     {
-      auto norm_path = normalise_path(path);
-      for(auto itr = m_sources.cbegin(), end = m_sources.cend(); itr != end; ++itr)
-        (**itr).getFiles(norm_path, files);
-      uniqify(files);
+      if(auto listing = getListing(path))
+        files.insert(files.end(), listing->files.begin(), listing->files.end());
     }
 
     void getDirs(const string& path, vector<string>& dirs) override
     {
-      auto norm_path = normalise_path(path);
+      if(auto listing = getListing(path))
+        dirs.insert(dirs.end(), listing->dirs.begin(), listing->dirs.end());
+    }
+
+    bool getIndexStats(Essence::IndexStats& stats) override
+    {
+      bool any = false;
+      stats = Essence::IndexStats();
+      for(auto itr = m_sources.cbegin(), end = m_sources.cend(); itr != end; ++itr)
+      {
+        Essence::IndexStats source_stats;
+        if((**itr).getIndexStats(source_stats))
+        {
+          stats.num_entries += source_stats.num_entries;
+          stats.num_entries_reused += source_stats.num_entries_reused;
+          stats.num_bytes += source_stats.num_bytes;
+          stats.build_seconds += source_stats.build_seconds;
+          any = true;
+        }
+      }
+      return any;
+    }
+
+    bool verify(Essence::VerifyReport& report, unsigned num_threads) override
+    {
+      bool any = false;
       for(auto itr = m_sources.cbegin(), end = m_sources.cend(); itr != end; ++itr)
-        (**itr).getDirs(norm_path, dirs);
-      uniqify(dirs);
+      {
+        if((**itr).verify(report, num_threads))
+          any = true;
+      }
+      return any;
     }
 
     void appendSource(FileSource* fs)
@@ -59,8 +132,66 @@ namespace
       m_sources.push_back(fs);
     }
 
+    //! Merge the directory trees of all the sources which have been appended.
+    void buildNamespace()
+    {
+      m_file_owners.clear();
+      m_listings.clear();
+      m_listings[string()];
+      for(uint32_t i = 0; i < static_cast<uint32_t>(m_sources.size()); ++i)
+        mergeDirectory(i, string());
+      for(auto itr = m_listings.begin(), end = m_listings.end(); itr != end; ++itr)
+      {
+        uniqify(itr->second.dirs);
+        sort(itr->second.files.begin(), itr->second.files.end());
+      }
+    }
+
   private:
+    struct listing_t
+    {
+      vector<string> dirs;
+      vector<string> files;
+    };
+
+    const listing_t* getListing(const string& path)
+    {
+      auto listing = m_listings.find(normalise_path(path));
+      return listing == m_listings.end() ? nullptr : &listing->second;
+    }
+
+    void mergeDirectory(uint32_t source_index, const string& dir)
+    {
+      auto source = m_sources[source_index];
+      const string prefix = dir.empty() ? string() : dir + '\\';
+      vector<string> names;
+
+      source->getFiles(dir, names);
+      if(!names.empty())
+      {
+        auto& files = m_listings[dir].files;
+        for(auto itr = names.begin(), end = names.end(); itr != end; ++itr)
+        {
+          // The first source to provide a path owns it; later sources are shadowed.
+          if(m_file_owners.insert(make_pair(prefix + *itr, source_index)).second)
+            files.push_back(move(*itr));
+        }
+      }
+
+      names.clear();
+      source->getDirs(dir, names);
+      for(auto itr = names.begin(), end = names.end(); itr != end; ++itr)
+      {
+        auto path = prefix + *itr;
+        m_listings[dir].dirs.push_back(move(*itr));
+        m_listings[path];
+        mergeDirectory(source_index, path);
+      }
+    }
+
     vector<FileSource*> m_sources;
+    unordered_map<string, uint32_t> m_file_owners;
+    unordered_map<string, listing_t> m_listings;
   };
 
   class ChRootFileSource : public Essence::FileSource
@@ -77,6 +208,15 @@ namespace
       return m_base->readFile(m_root + path);
     }
 
+    vector<unique_ptr<MappableFile>> readFiles(const vector<string>& paths) override
+    {
+      vector<string> rooted_paths;
+      rooted_paths.reserve(paths.size());
+      for(auto& path : paths)
+        rooted_paths.push_back(m_root + path);
+      return m_base->readFiles(rooted_paths);
+    }
+
     void getFiles(const string& path, vector<string>& files) override
     {
       return m_base->getFiles(m_root + path, files);
@@ -157,8 +297,8 @@ namespace
   {
     T* try_find(IniKey k)
     {
-      auto itr = find(k);
-      return (itr == end()) ? nullptr : &itr->second;
+      auto itr = this->find(k);
+      return (itr == this->end()) ? nullptr : &itr->second;
     }
   };
 
@@ -197,7 +337,15 @@ namespace
     }
   };
 
-  void AddFileSources(Arena* arena, const string& base_dir, IniParser& ini, AggregateFileSource* afs)
+  struct mod_source_t
+  {
+    mod_source_t(string path_, bool is_archive_) : path(move(path_)), is_archive(is_archive_) {}
+
+    string path;
+    bool is_archive;
+  };
+
+  void FindFileSources(const string& base_dir, IniParser& ini, vector<mod_source_t>& sources)
   {
     const char* sections[] = {"data:english", "data:common", "attrib:common", "data:art_high", "data:sound_high"};
     for(auto itr = begin(sections); itr != end(sections); ++itr)
@@ -207,25 +355,222 @@ namespace
         if(auto folder = section->try_find(IniKey("folder", 1)))
         {
           auto path = base_dir + *folder + "\\";
-          if(GetFileAttributesA(path.c_str()) != INVALID_FILE_ATTRIBUTES)
-            afs->appendSource(arena->alloc<ChRootFileSource>(Essence::CreatePhysicalFileSource(arena), move(path)));
+          if(Essence::PhysicalPathExists(path))
+            sources.push_back(mod_source_t(move(path), false));
         }
 
         for(int archive_index = 1; auto archive = section->try_find(IniKey("archive", archive_index)); ++archive_index)
         {
           auto path = base_dir + *archive + ".sga";
-          if(GetFileAttributesA(path.c_str()) == INVALID_FILE_ATTRIBUTES)
-            continue;
-          afs->appendSource(Essence::CreateArchiveFileSource(arena, MapPhysicalFileA(path.c_str())));
+          if(Essence::PhysicalPathExists(path))
+            sources.push_back(mod_source_t(move(path), true));
         }
       }
     }
   }
 }
 
+namespace
+{
+#pragma pack(push)
+#pragma pack(1)
+  struct index_cache_header_t
+  {
+    char signature[8];
+    uint32_t version;
+    uint32_t index_format_version; //!< Essence::ArchiveIndex::format_version of every index.
+    uint32_t archive_count;
+  };
+
+  struct index_cache_entry_t
+  {
+    uint64_t archive_size;
+    uint64_t archive_mtime;
+    uint32_t path_offset;
+    uint32_t path_length;
+    uint32_t index_offset;
+    uint32_t index_size;
+  };
+#pragma pack(pop)
+
+  const uint32_t index_cache_version = 2;
+
+  //! The lookup tables of every archive in a mod, saved in a single file.
+  /*!
+    The cache is all-or-nothing: it is only used if it lists exactly the same archives, in the
+    same order, with the same sizes and modification times, as the mod being mounted. In that case,
+    mounting the archives needs a single mapping of the cache and no hashing at all. Otherwise, every
+    archive's tables are built from scratch, and the cache is rewritten.
+  */
+  class IndexCache
+  {
+  public:
+    IndexCache(const string& path)
+      : m_path(Essence::NativePhysicalPath(path))
+      , m_dirty(false)
+    {
+    }
+
+    void load(const vector<mod_source_t>& sources)
+    {
+      for(auto itr = sources.cbegin(), end = sources.cend(); itr != end; ++itr)
+      {
+        if(!itr->is_archive)
+          continue;
+        record_t record;
+        record.path = itr->path;
+        if(!Essence::GetPhysicalFileStamp(record.path, record.size, record.mtime))
+          return;
+        m_records.push_back(move(record));
+      }
+
+      if(!Essence::PhysicalPathExists(m_path))
+        return;
+      m_file = MapPhysicalFileA(m_path.c_str());
+      m_contents = m_file->mapAll();
+      if(!matchContents())
+      {
+        m_contents = nullptr;
+        m_file.reset();
+        for(auto itr = m_records.begin(), end = m_records.end(); itr != end; ++itr)
+          itr->index = Essence::ArchiveIndex();
+      }
+    }
+
+    Essence::FileSource* mountArchive(Arena* arena, size_t archive_number, const string& path)
+    {
+      if(archive_number >= m_records.size() || m_records[archive_number].path != path)
+      {
+        // The archive could not be stat'ed, so the cache cannot describe it.
+        m_dirty = true;
+        return Essence::CreateArchiveFileSource(arena, MapPhysicalFileA(Essence::NativePhysicalPath(path).c_str()));
+      }
+
+      auto& record = m_records[archive_number];
+      auto cached_data = record.index.data;
+      auto fs = Essence::CreateArchiveFileSource(arena, MapPhysicalFileA(Essence::NativePhysicalPath(path).c_str()), &record.index);
+      if(!cached_data || record.index.data != cached_data)
+        m_dirty = true;
+      return fs;
+    }
+
+    void save()
+    {
+      if(!m_dirty)
+        return;
+
+      index_cache_header_t header;
+      memcpy(header.signature, "SGAICACH", 8);
+      header.version = index_cache_version;
+      header.index_format_version = Essence::ArchiveIndex::format_version;
+      header.archive_count = static_cast<uint32_t>(m_records.size());
+
+      vector<index_cache_entry_t> entries(m_records.size());
+      size_t offset = sizeof(header) + entries.size() * sizeof(index_cache_entry_t);
+      for(size_t i = 0; i < entries.size(); ++i)
+      {
+        entries[i].archive_size = m_records[i].size;
+        entries[i].archive_mtime = m_records[i].mtime;
+        entries[i].path_offset = static_cast<uint32_t>(offset);
+        entries[i].path_length = static_cast<uint32_t>(m_records[i].path.size());
+        offset += m_records[i].path.size();
+      }
+      for(size_t i = 0; i < entries.size(); ++i)
+      {
+        // Index blocks contain 32-bit fields, so keep them aligned when the cache is mapped back in.
+        offset = (offset + 7) & ~static_cast<size_t>(7);
+        entries[i].index_offset = static_cast<uint32_t>(offset);
+        entries[i].index_size = static_cast<uint32_t>(m_records[i].index.size);
+        offset += m_records[i].index.size;
+      }
+
+      // Write to a temporary file and then swap it into place, so that a failed or concurrent write
+      // never leaves a truncated cache behind. Failures are otherwise ignored, as the cache is only
+      // an optimisation.
+      auto temp_path = m_path + ".tmp";
+      FILE* f = fopen(temp_path.c_str(), "wb");
+      if(!f)
+        return;
+      bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+      ok = ok && fwrite(entries.data(), sizeof(index_cache_entry_t), entries.size(), f) == entries.size();
+      for(size_t i = 0; ok && i < entries.size(); ++i)
+        ok = fwrite(m_records[i].path.data(), 1, m_records[i].path.size(), f) == m_records[i].path.size();
+      for(size_t i = 0; ok && i < entries.size(); ++i)
+      {
+        static const char padding[8] = {0};
+        auto pos = static_cast<size_t>(ftell(f));
+        ok = fwrite(padding, 1, entries[i].index_offset - pos, f) == entries[i].index_offset - pos
+          && fwrite(m_records[i].index.data, 1, m_records[i].index.size, f) == m_records[i].index.size;
+      }
+      ok = (fclose(f) == 0) && ok;
+#ifdef _WIN32
+      // If the old cache is still mapped (as some archives may be using it), it cannot be replaced,
+      // but it can be renamed (see MapPhysicalFileA), so move it aside first. Deleting it then only
+      // takes effect once the last view of it is closed.
+      if(ok && m_file)
+      {
+        auto old_path = m_path + ".old";
+        DeleteFileA(old_path.c_str());
+        ok = MoveFileExA(m_path.c_str(), old_path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+        DeleteFileA(old_path.c_str());
+      }
+      if(!ok || !MoveFileExA(temp_path.c_str(), m_path.c_str(), MOVEFILE_REPLACE_EXISTING))
+        DeleteFileA(temp_path.c_str());
+#else
+      if(!ok || rename(temp_path.c_str(), m_path.c_str()) != 0)
+        remove(temp_path.c_str());
+#endif
+    }
+
+  private:
+    bool matchContents()
+    {
+      auto begin = m_contents.begin;
+      auto size = m_contents.size();
+      auto header = reinterpret_cast<const index_cache_header_t*>(begin);
+      if(size < sizeof(*header) || memcmp(header->signature, "SGAICACH", 8) || header->version != index_cache_version)
+        return false;
+      if(header->index_format_version != Essence::ArchiveIndex::format_version)
+        return false;
+      if(header->archive_count != m_records.size() || size < sizeof(*header) + m_records.size() * sizeof(index_cache_entry_t))
+        return false;
+
+      auto entries = reinterpret_cast<const index_cache_entry_t*>(header + 1);
+      for(size_t i = 0; i < m_records.size(); ++i)
+      {
+        auto& entry = entries[i];
+        auto& record = m_records[i];
+        if(static_cast<uint64_t>(entry.path_offset) + entry.path_length > size || static_cast<uint64_t>(entry.index_offset) + entry.index_size > size)
+          return false;
+        if(entry.archive_size != record.size || entry.archive_mtime != record.mtime)
+          return false;
+        if(entry.path_length != record.path.size() || memcmp(begin + entry.path_offset, record.path.data(), entry.path_length))
+          return false;
+        record.index.data = begin + entry.index_offset;
+        record.index.size = entry.index_size;
+      }
+      return true;
+    }
+
+    struct record_t
+    {
+      string path;
+      uint64_t size;
+      uint64_t mtime;
+      Essence::ArchiveIndex index;
+    };
+
+    string m_path;
+    unique_ptr<MappableFile> m_file;
+    MappedMemory m_contents;
+    vector<record_t> m_records;
+    bool m_dirty;
+  };
+}
+
 namespace Essence
 {
-  FileSource* CreateModFileSource(Arena* arena, const string& module_file_path)
+  FileSource* CreateModFileSource(Arena* arena, const string& module_file_path, const string& index_cache_path)
   {
     string dir;
     {
@@ -236,11 +581,35 @@ namespace Essence
 
     IniParser ini;
     {
-      auto module_file = MapPhysicalFileA(module_file_path.c_str());
+      auto module_file = MapPhysicalFileA(NativePhysicalPath(module_file_path).c_str());
       ini.parse(arena, module_file->mapAll());
     }
+    vector<mod_source_t> sources;
+    FindFileSources(dir, ini, sources);
+
+    // The cache must outlive the archives, as they may refer directly to its mapped contents.
+    IndexCache* cache = nullptr;
+    if(!index_cache_path.empty())
+    {
+      cache = arena->alloc<IndexCache>(index_cache_path);
+      cache->load(sources);
+    }
+
     AggregateFileSource* afs = arena->alloc<AggregateFileSource>();
-    AddFileSources(arena, dir, ini, afs);
+    size_t archive_number = 0;
+    for(auto itr = sources.begin(), end = sources.end(); itr != end; ++itr)
+    {
+      if(!itr->is_archive)
+        afs->appendSource(arena->alloc<ChRootFileSource>(CreatePhysicalFileSource(arena), move(itr->path)));
+      else if(cache)
+        afs->appendSource(cache->mountArchive(arena, archive_number++, itr->path));
+      else
+        afs->appendSource(CreateArchiveFileSource(arena, MapPhysicalFileA(NativePhysicalPath(itr->path).c_str())));
+    }
+
+    if(cache)
+      cache->save();
+    afs->buildNamespace();
     return afs;
   }
 }
@@ -2,6 +2,17 @@
 // The algorithm in this file is public domain.
 // See http://burtleburtle.net/bob/c/lookup2.c for more details.
 #include "hash.h"
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define ESSENCE_HASH_X86
+#ifdef _MSC_VER
+#include <intrin.h>
+#define ESSENCE_TARGET_AVX2
+#else
+#include <cpuid.h>
+#define ESSENCE_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#include <immintrin.h>
+#endif
 
 namespace Essence
 {
@@ -63,4 +74,250 @@ namespace Essence
   {
     return Hash(reinterpret_cast<const uint8_t*>(data), data_len, initial_value);
   }
+
+#ifdef ESSENCE_CONSTEXPR_HASH
+  // Values from the runtime Hash(), covering the empty key, the tail-only path, exact and partial
+  // 12-byte blocks, several blocks, and a non-zero initial value.
+  static_assert(ConstHash("", 0) == 0xBD49D10D, "ConstHash differs from Hash");
+  static_assert(ConstHash("a", 1) == 0x29EEC818, "ConstHash differs from Hash");
+  static_assert(ConstHash("teamcolour", 10) == 0xD5A1EF93, "ConstHash differs from Hash");
+  static_assert(ConstHash("g_desaturation", 14) == 0x9C0CEA32, "ConstHash differs from Hash");
+  static_assert(ConstHash("exposure_control", 16) == 0x6CDE3680, "ConstHash differs from Hash");
+  static_assert(ConstHash("(c6ui_background)", 17) == 0x498DD76B, "ConstHash differs from Hash");
+  static_assert(ConstHash("unadjustedshadowviewmatrix", 26) == 0xAFAAD282, "ConstHash differs from Hash");
+  static_assert(ConstHash("shadowvpmatrix", 14, 0x5EED) == 0x2B0C1B3F, "ConstHash differs from Hash");
+  static_assert(Hashable("g_desaturation").getHash() == 0x9C0CEA32, "Hashable literals should be hashed at compile time");
+#endif
+
+  namespace
+  {
+    //! Fetch the next 12 bytes of lookup2 input for each of width keys, as three columns of words.
+    /*!
+      Round r of a key of length len reads bytes [12r, 12r + 12) while r < len / 12, and then the
+      final partial block (with the length added to the third word, as Hash() does) when
+      r == len / 12. Lanes beyond that have nothing left to read, and get a zero mask.
+      \return true if any lane is still active.
+    */
+    bool GatherRound(const uint8_t* const* keys, const uint32_t* lengths, uint32_t width, uint32_t r, uint32_t* words, uint32_t* mask)
+    {
+      bool any_active = false;
+      for(uint32_t lane = 0; lane < width; ++lane)
+      {
+        auto len = lengths[lane];
+        auto full_blocks = len / 12;
+        uint32_t block[3] = {0, 0, 0};
+        mask[lane] = 0;
+        if(r < full_blocks)
+        {
+          memcpy(block, keys[lane] + r * 12, 12);
+          mask[lane] = 0xFFFFFFFF;
+        }
+        else if(r == full_blocks)
+        {
+          // The tail bytes are added little-endian, with the first byte of c reserved for the length.
+          memcpy(block, keys[lane] + r * 12, len % 12);
+          block[2] = (block[2] << 8) + len;
+          mask[lane] = 0xFFFFFFFF;
+        }
+        words[lane] = block[0];
+        words[width + lane] = block[1];
+        words[width * 2 + lane] = block[2];
+        any_active |= (mask[lane] != 0);
+      }
+      return any_active;
+    }
+
+    inline uint32_t Load32(const uint8_t* k)
+    {
+      uint32_t word;
+      memcpy(&word, k, sizeof(word));
+      return word;
+    }
+
+    //! The number of leading rounds in which every one of width keys still has a full block.
+    inline uint32_t CommonFullBlocks(const uint32_t* lengths, uint32_t width)
+    {
+      auto shortest = lengths[0];
+      for(uint32_t lane = 1; lane < width; ++lane)
+        shortest = std::min(shortest, lengths[lane]);
+      return shortest / 12;
+    }
+
+    void HashBatchScalar(const uint8_t* const* keys, const uint32_t* lengths, uint32_t* hashes, size_t count, uint32_t initial_value)
+    {
+      for(size_t i = 0; i < count; ++i)
+        hashes[i] = Hash(keys[i], lengths[i], initial_value);
+    }
+
+#define LOOKUP2_MIX(a, b, c, SUB, XOR, SHL, SHR) \
+    a = SUB(a, b); a = SUB(a, c); a = XOR(a, SHR(c, 13)); \
+    b = SUB(b, c); b = SUB(b, a); b = XOR(b, SHL(a, 8)); \
+    c = SUB(c, a); c = SUB(c, b); c = XOR(c, SHR(b, 13)); \
+    a = SUB(a, b); a = SUB(a, c); a = XOR(a, SHR(c, 12)); \
+    b = SUB(b, c); b = SUB(b, a); b = XOR(b, SHL(a, 16)); \
+    c = SUB(c, a); c = SUB(c, b); c = XOR(c, SHR(b, 5)); \
+    a = SUB(a, b); a = SUB(a, c); a = XOR(a, SHR(c, 3)); \
+    b = SUB(b, c); b = SUB(b, a); b = XOR(b, SHL(a, 10)); \
+    c = SUB(c, a); c = SUB(c, b); c = XOR(c, SHR(b, 15))
+
+#ifdef ESSENCE_HASH_X86
+    void HashBatchSSE2(const uint8_t* const* keys, const uint32_t* lengths, uint32_t* hashes, size_t count, uint32_t initial_value)
+    {
+      for(; count >= 4; keys += 4, lengths += 4, hashes += 4, count -= 4)
+      {
+        auto a = _mm_set1_epi32(0x9e3779b9), b = a, c = _mm_set1_epi32(static_cast<int>(initial_value));
+        uint32_t r = 0;
+        // While every lane has a full block, words can be loaded straight into the vectors.
+        for(auto common = CommonFullBlocks(lengths, 4); r < common; ++r)
+        {
+#define LANES(i) Load32(keys[3] + r * 12 + i), Load32(keys[2] + r * 12 + i), Load32(keys[1] + r * 12 + i), Load32(keys[0] + r * 12 + i)
+          a = _mm_add_epi32(a, _mm_set_epi32(LANES(0)));
+          b = _mm_add_epi32(b, _mm_set_epi32(LANES(4)));
+          c = _mm_add_epi32(c, _mm_set_epi32(LANES(8)));
+#undef LANES
+          LOOKUP2_MIX(a, b, c, _mm_sub_epi32, _mm_xor_si128, _mm_slli_epi32, _mm_srli_epi32);
+        }
+        uint32_t words[12], mask[4];
+        for(; GatherRound(keys, lengths, 4, r, words, mask); ++r)
+        {
+          auto keep = _mm_loadu_si128(reinterpret_cast<const __m128i*>(mask));
+          auto a2 = _mm_add_epi32(a, _mm_loadu_si128(reinterpret_cast<const __m128i*>(words)));
+          auto b2 = _mm_add_epi32(b, _mm_loadu_si128(reinterpret_cast<const __m128i*>(words + 4)));
+          auto c2 = _mm_add_epi32(c, _mm_loadu_si128(reinterpret_cast<const __m128i*>(words + 8)));
+          LOOKUP2_MIX(a2, b2, c2, _mm_sub_epi32, _mm_xor_si128, _mm_slli_epi32, _mm_srli_epi32);
+          a = _mm_or_si128(_mm_and_si128(keep, a2), _mm_andnot_si128(keep, a));
+          b = _mm_or_si128(_mm_and_si128(keep, b2), _mm_andnot_si128(keep, b));
+          c = _mm_or_si128(_mm_and_si128(keep, c2), _mm_andnot_si128(keep, c));
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(hashes), c);
+      }
+      HashBatchScalar(keys, lengths, hashes, count, initial_value);
+    }
+
+    ESSENCE_TARGET_AVX2 void HashBatchAVX2(const uint8_t* const* keys, const uint32_t* lengths, uint32_t* hashes, size_t count, uint32_t initial_value)
+    {
+      for(; count >= 8; keys += 8, lengths += 8, hashes += 8, count -= 8)
+      {
+        auto a = _mm256_set1_epi32(0x9e3779b9), b = a, c = _mm256_set1_epi32(static_cast<int>(initial_value));
+        uint32_t r = 0;
+        for(auto common = CommonFullBlocks(lengths, 8); r < common; ++r)
+        {
+#define LANES(i) Load32(keys[7] + r * 12 + i), Load32(keys[6] + r * 12 + i), Load32(keys[5] + r * 12 + i), Load32(keys[4] + r * 12 + i), \
+                 Load32(keys[3] + r * 12 + i), Load32(keys[2] + r * 12 + i), Load32(keys[1] + r * 12 + i), Load32(keys[0] + r * 12 + i)
+          a = _mm256_add_epi32(a, _mm256_set_epi32(LANES(0)));
+          b = _mm256_add_epi32(b, _mm256_set_epi32(LANES(4)));
+          c = _mm256_add_epi32(c, _mm256_set_epi32(LANES(8)));
+#undef LANES
+          LOOKUP2_MIX(a, b, c, _mm256_sub_epi32, _mm256_xor_si256, _mm256_slli_epi32, _mm256_srli_epi32);
+        }
+        uint32_t words[24], mask[8];
+        for(; GatherRound(keys, lengths, 8, r, words, mask); ++r)
+        {
+          auto keep = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(mask));
+          auto a2 = _mm256_add_epi32(a, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(words)));
+          auto b2 = _mm256_add_epi32(b, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(words + 8)));
+          auto c2 = _mm256_add_epi32(c, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(words + 16)));
+          LOOKUP2_MIX(a2, b2, c2, _mm256_sub_epi32, _mm256_xor_si256, _mm256_slli_epi32, _mm256_srli_epi32);
+          a = _mm256_blendv_epi8(a, a2, keep);
+          b = _mm256_blendv_epi8(b, b2, keep);
+          c = _mm256_blendv_epi8(c, c2, keep);
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(hashes), c);
+      }
+      HashBatchSSE2(keys, lengths, hashes, count, initial_value);
+    }
+#endif
+#undef LOOKUP2_MIX
+
+    class CpuId
+    {
+    public:
+      CpuId()
+        : has_sse2(false)
+        , has_avx2(false)
+      {
+#ifdef ESSENCE_HASH_X86
+        int info[4] = {0};
+        cpuid(info, 0);
+        auto max_leaf = info[0];
+        cpuid(info, 1);
+        has_sse2 = (info[3] & (1 << 26)) != 0;
+        // AVX2 also needs the OS to save the upper halves of the YMM registers.
+        bool os_saves_ymm = (info[2] & (1 << 27)) != 0 && (xgetbv0() & 6) == 6;
+        if(max_leaf >= 7 && os_saves_ymm)
+        {
+          cpuid(info, 7);
+          has_avx2 = (info[1] & (1 << 5)) != 0;
+        }
+#endif
+      }
+
+      bool has_sse2;
+      bool has_avx2;
+
+    private:
+#ifdef ESSENCE_HASH_X86
+      static void cpuid(int* info, int leaf)
+      {
+#ifdef _MSC_VER
+        __cpuidex(info, leaf, 0);
+#else
+        __cpuid_count(leaf, 0, info[0], info[1], info[2], info[3]);
+#endif
+      }
+
+      static uint64_t xgetbv0()
+      {
+#ifdef _MSC_VER
+        return _xgetbv(0);
+#else
+        uint32_t eax, edx;
+        __asm__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+        return (static_cast<uint64_t>(edx) << 32) | eax;
+#endif
+      }
+#endif
+    } const cpuid;
+  }
+
+  bool IsHashBatchBackendSupported(HashBatchBackend::E backend)
+  {
+    switch(backend)
+    {
+    case HashBatchBackend::Auto:
+    case HashBatchBackend::Scalar: return true;
+    case HashBatchBackend::SSE2: return cpuid.has_sse2;
+    case HashBatchBackend::AVX2: return cpuid.has_avx2;
+    default: return false;
+    }
+  }
+
+  const char* GetHashBatchBackendName(HashBatchBackend::E backend)
+  {
+    switch(backend)
+    {
+    case HashBatchBackend::Auto: return "auto";
+    case HashBatchBackend::Scalar: return "scalar";
+    case HashBatchBackend::SSE2: return "sse2";
+    case HashBatchBackend::AVX2: return "avx2";
+    default: return "unknown";
+    }
+  }
+
+  void HashBatch(const uint8_t* const* keys, const uint32_t* lengths, uint32_t* hashes, size_t count, uint32_t initial_value, HashBatchBackend::E backend)
+  {
+    if(backend == HashBatchBackend::Auto)
+      backend = cpuid.has_avx2 ? HashBatchBackend::AVX2 : cpuid.has_sse2 ? HashBatchBackend::SSE2 : HashBatchBackend::Scalar;
+    else if(!IsHashBatchBackendSupported(backend))
+      throw std::runtime_error(std::string("Cannot use hash backend `") + GetHashBatchBackendName(backend) + "' on this CPU");
+
+    switch(backend)
+    {
+#ifdef ESSENCE_HASH_X86
+    case HashBatchBackend::AVX2: HashBatchAVX2(keys, lengths, hashes, count, initial_value); break;
+    case HashBatchBackend::SSE2: HashBatchSSE2(keys, lengths, hashes, count, initial_value); break;
+#endif
+    default: HashBatchScalar(keys, lengths, hashes, count, initial_value); break;
+    }
+  }
 }
@@ -1,22 +1,108 @@
 #pragma once
+#include <stddef.h>
 #include <stdint.h>
 
+// constexpr functions (and hence compile-time hashing of string literals) need VS2015 or any
+// C++11 compiler; VS2012 hashes literals at runtime instead.
+#if !defined(ESSENCE_CONSTEXPR_HASH) && ((defined(_MSC_VER) && _MSC_VER >= 1900) || (!defined(_MSC_VER) && __cplusplus >= 201103L))
+#define ESSENCE_CONSTEXPR_HASH
+#endif
+
 namespace Essence
 {
   uint32_t Hash(const uint8_t* data, uint32_t data_len, uint32_t initial_value = 0);
   uint32_t Hash(const char* data, uint32_t data_len, uint32_t initial_value = 0);
 
+  namespace HashBatchBackend
+  {
+    enum E
+    {
+      Auto,   //!< The widest backend which the CPU supports.
+      Scalar, //!< One key at a time, exactly as Hash().
+      SSE2,   //!< Four keys at a time.
+      AVX2,   //!< Eight keys at a time.
+    };
+  }
+
+  //! Compute hashes[i] = Hash(keys[i], lengths[i], initial_value) for every i in [0, count).
+  /*!
+    The SIMD backends give bit-identical results to Hash(), and are fastest when keys of similar
+    length are adjacent, as lanes sit idle once their key is finished.
+    \throws std::runtime_error if backend is not supported by this CPU or build.
+  */
+  void HashBatch(const uint8_t* const* keys, const uint32_t* lengths, uint32_t* hashes, size_t count, uint32_t initial_value = 0, HashBatchBackend::E backend = HashBatchBackend::Auto);
+
+  bool IsHashBatchBackendSupported(HashBatchBackend::E backend);
+  const char* GetHashBatchBackendName(HashBatchBackend::E backend);
+
+#ifdef ESSENCE_CONSTEXPR_HASH
+  namespace ConstHashDetail
+  {
+    struct state_t
+    {
+      uint32_t a, b, c;
+    };
+
+    // lookup2's mix(), unrolled into a chain of single-expression functions so that it is a valid
+    // C++11 constant expression.
+    constexpr state_t MixC3(uint32_t a, uint32_t b, uint32_t c) { return state_t{a, b, (c - a - b) ^ (b >> 15)}; }
+    constexpr state_t MixB3(uint32_t a, uint32_t b, uint32_t c) { return MixC3(a, (b - c - a) ^ (a << 10), c); }
+    constexpr state_t MixA3(uint32_t a, uint32_t b, uint32_t c) { return MixB3((a - b - c) ^ (c >> 3), b, c); }
+    constexpr state_t MixC2(uint32_t a, uint32_t b, uint32_t c) { return MixA3(a, b, (c - a - b) ^ (b >> 5)); }
+    constexpr state_t MixB2(uint32_t a, uint32_t b, uint32_t c) { return MixC2(a, (b - c - a) ^ (a << 16), c); }
+    constexpr state_t MixA2(uint32_t a, uint32_t b, uint32_t c) { return MixB2((a - b - c) ^ (c >> 12), b, c); }
+    constexpr state_t MixC1(uint32_t a, uint32_t b, uint32_t c) { return MixA2(a, b, (c - a - b) ^ (b >> 13)); }
+    constexpr state_t MixB1(uint32_t a, uint32_t b, uint32_t c) { return MixC1(a, (b - c - a) ^ (a << 8), c); }
+    constexpr state_t Mix(uint32_t a, uint32_t b, uint32_t c) { return MixB1((a - b - c) ^ (c >> 13), b, c); }
+
+    constexpr uint32_t Byte(const char* k, uint32_t i, uint32_t len)
+    {
+      return i < len ? static_cast<uint32_t>(static_cast<uint8_t>(k[i])) : 0;
+    }
+
+    constexpr uint32_t Word(const char* k, uint32_t i, uint32_t len)
+    {
+      return Byte(k, i, len) | (Byte(k, i + 1, len) << 8) | (Byte(k, i + 2, len) << 16) | (Byte(k, i + 3, len) << 24);
+    }
+
+    constexpr uint32_t Tail(const char* k, uint32_t len, uint32_t data_len, state_t s)
+    {
+      // The first byte of c is reserved for the length, so the last word is shifted up by one byte.
+      return Mix(s.a + Word(k, 0, len), s.b + Word(k, 4, len), s.c + data_len + (Word(k, 8, len) << 8)).c;
+    }
+
+    constexpr uint32_t Blocks(const char* k, uint32_t len, uint32_t data_len, state_t s)
+    {
+      return len >= 12
+        ? Blocks(k + 12, len - 12, data_len, Mix(s.a + Word(k, 0, 12), s.b + Word(k, 4, 12), s.c + Word(k, 8, 12)))
+        : Tail(k, len, data_len, s);
+    }
+  }
+
+  //! A constexpr equivalent of Hash(), so that names known at compile time become constants.
+  constexpr uint32_t ConstHash(const char* data, uint32_t data_len, uint32_t initial_value = 0)
+  {
+    return ConstHashDetail::Blocks(data, data_len, data_len, ConstHashDetail::state_t{0x9e3779b9, 0x9e3779b9, initial_value});
+  }
+
+#define ESSENCE_CONSTEXPR constexpr
+#define ESSENCE_LITERAL_HASH ConstHash
+#else
+#define ESSENCE_CONSTEXPR
+#define ESSENCE_LITERAL_HASH Hash
+#endif
+
   struct Hashable
   {
   public:
-    inline Hashable(uint32_t hash)
+    inline ESSENCE_CONSTEXPR Hashable(uint32_t hash)
       : m_hash(hash)
     {
     }
 
     template <uint32_t N>
-    inline Hashable(const char (&str)[N])
-      : m_hash(Hash(str, N - 1))
+    inline ESSENCE_CONSTEXPR Hashable(const char (&str)[N])
+      : m_hash(ESSENCE_LITERAL_HASH(str, N - 1))
     {
     }
 
@@ -27,7 +113,7 @@ namespace Essence
       static_assert(sizeof(*container.data()) == 1, "Implicit hashing should only be done for strings.");
     }
 
-    uint32_t getHash() const { return m_hash; }
+    ESSENCE_CONSTEXPR uint32_t getHash() const { return m_hash; }
 
   private:
     const uint32_t m_hash;
@@ -1,6 +1,7 @@
 #include "stdafx.h"
 #include "main_window.h"
 #include "fs.h"
+#include "hash.h"
 #include "shader_db.h"
 #include "model.h"
 #include "file_tree.h"
@@ -15,8 +16,22 @@
 #include "c6ui/app.h"
 using namespace C6::UI;
 
+// Archive lookup tables are cached in the temp directory, as the game's own directory may not be writable.
+static std::string GetIndexCachePath(const char* module_file)
+{
+  char temp_dir[MAX_PATH + 1];
+  auto temp_dir_length = GetTempPathA(sizeof(temp_dir), temp_dir);
+  if(temp_dir_length == 0 || temp_dir_length > MAX_PATH)
+    return std::string();
+
+  char name[32];
+  sprintf(name, "coh2explorer_%08x.idx", Essence::Hash(module_file, static_cast<uint32_t>(strlen(module_file))));
+  return std::string(temp_dir, temp_dir_length) + name;
+}
+
 MainWindow::MainWindow(C6::UI::Factories& factories, const char* module_file, const char* rgm_path)
   : Frame("CoH2 Explorer", factories)
+  , m_arena("main_window")
   , m_wic_factory(factories.wic)
   , m_essence(nullptr)
 {
@@ -25,7 +40,7 @@ MainWindow::MainWindow(C6::UI::Factories& factories, const char* module_file, co
   m_layout = m_arena.allocTrivial<ColumnLayout>();
   appendChild(m_layout);
 
-  m_mod_fs = Essence::CreateModFileSource(&m_arena, module_file);
+  m_mod_fs = Essence::CreateModFileSource(&m_arena, module_file, GetIndexCachePath(module_file));
   auto tree = m_arena.allocTrivial<FileTree>(m_arena, getDC(), m_mod_fs);
   tree->addListener(this);
   auto tree_tab = m_arena.allocTrivial<TabControl>();
@@ -58,7 +73,7 @@ void MainWindow::resized()
 void MainWindow::setContentTexture(C6::D3::Texture2D texture)
 {
   auto srv = m_essence->getDevice().createShaderResourceView(std::move(texture));
-  std::unique_ptr<Arena> a(new Arena);
+  std::unique_ptr<Arena> a(new Arena("content"));
   auto panel = a->alloc<TexturePanel>(std::move(srv), m_essence_lighting_properties->getExposure())->wrapInScrollingContainer(*a);
   panel->setAlignment(.5f);
   m_property_tabs->removeAllTabs();
@@ -91,7 +106,7 @@ void MainWindow::onFileTreeActivation(std::string path)
     }
     else
     {
-      std::unique_ptr<Arena> arena(new Arena);
+      std::unique_ptr<Arena> arena(new Arena("content"));
       m_essence->setModel(m_mod_fs, path);
       createModelPropertiesUI(*arena);
       setContent(m_essence, move(arena));
@@ -128,7 +143,7 @@ void MainWindow::createModelPropertiesUI(Arena& arena)
   m_property_tabs->removeAllTabs();
 
   auto model = m_essence->getModel();
-  auto object_visibility = arena.mallocArray<bool>(model->getObjects().size());
+  auto object_visibility = arena.mallocArray<bool>(model->getObjectCount());
   auto objects_tab = arena.alloc<ObjectTree>(arena, getDC(), *m_essence->getModel(), object_visibility);
   objects_tab->addListener(arena.allocTrivial<PListener>(*m_essence));
   m_essence->setObjectVisibility(object_visibility);
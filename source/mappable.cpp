@@ -1,5 +1,11 @@
 #include "stdafx.h"
 #include "mappable.h"
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 static void NullaryDeleter(MappedMemory&)
 {
@@ -39,7 +45,7 @@ MappedMemory::MappedMemory(MappedMemory&& move_from)
   new (&move_from) MappedMemory;
 }
 
-MappedMemory& MappedMemory::operator= (nullptr_t)
+MappedMemory& MappedMemory::operator= (std::nullptr_t)
 {
   this->~MappedMemory();
   new (this) MappedMemory;
@@ -66,11 +72,35 @@ void MappableFile::expand(uint64_t& offset_begin, uint64_t& offset_end)
 
 MappedMemory MappableFile::mapAll()
 {
-  return map(0, getSize());
+  return map(0, getSize(), AccessPattern::Sequential);
+}
+
+void MappableFile::prefetch(uint64_t, uint64_t)
+{
+}
+
+int MappableFile::getFileDescriptor()
+{
+  return -1;
 }
 
 namespace
 {
+#ifdef _WIN32
+  // PrefetchVirtualMemory only exists from Windows 8 onwards, so is looked up at runtime.
+  struct memory_range_entry_t
+  {
+    PVOID VirtualAddress;
+    SIZE_T NumberOfBytes;
+  };
+  typedef BOOL (WINAPI *PrefetchVirtualMemory_t)(HANDLE, ULONG_PTR, memory_range_entry_t*, ULONG);
+
+  PrefetchVirtualMemory_t GetPrefetchVirtualMemory()
+  {
+    static const auto function = reinterpret_cast<PrefetchVirtualMemory_t>(GetProcAddress(GetModuleHandleA("kernel32.dll"), "PrefetchVirtualMemory"));
+    return function;
+  }
+
   class MappedPhysicalFile : public MappableFile
   {
   public:
@@ -82,7 +112,7 @@ namespace
 
     void initialise(const char* path)
     {
-      m_file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_NO_BUFFERING, nullptr);
+      m_file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_NO_BUFFERING, nullptr);
       if(m_file == INVALID_HANDLE_VALUE)
         throw C6::CreateFileException(path);
       initialiseWithFile();
@@ -90,7 +120,7 @@ namespace
 
     void initialise(const wchar_t* path)
     {
-      m_file = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_NO_BUFFERING, nullptr);
+      m_file = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_NO_BUFFERING, nullptr);
       if(m_file == INVALID_HANDLE_VALUE)
         throw C6::CreateFileException(path);
       initialiseWithFile();
@@ -115,8 +145,9 @@ namespace
       }
     }
 
-    MappedMemory map(uint64_t offset_begin, uint64_t offset_end) override
+    MappedMemory map(uint64_t offset_begin, uint64_t offset_end, AccessPattern::E) override
     {
+      // NB: Views of a file mapping have no per-view read-ahead control, so the hint is ignored.
       if(offset_end > m_size) throw std::out_of_range("Cannot map beyond end of file.");
       if(offset_end == offset_begin) return MappedMemory();
       if(offset_end < offset_begin) throw std::runtime_error("Cannot map backwards range.");
@@ -137,6 +168,17 @@ namespace
         throw C6::COMException(HRESULT_FROM_WIN32(GetLastError()), "MapViewOfFile");
     }
 
+    void prefetch(uint64_t offset_begin, uint64_t offset_end) override
+    {
+      // The pages outlive the temporary view, as they belong to the file mapping.
+      auto prefetch_virtual_memory = GetPrefetchVirtualMemory();
+      if(!prefetch_virtual_memory || offset_end > m_size || offset_end <= offset_begin)
+        return;
+      auto view = map(offset_begin, offset_end, AccessPattern::Sequential);
+      memory_range_entry_t range = {const_cast<uint8_t*>(view.begin), view.size()};
+      prefetch_virtual_memory(GetCurrentProcess(), 1, &range, 0);
+    }
+
     static void UnmapPhysical(MappedMemory& mm)
     {
       UnmapViewOfFile((LPCVOID)((uintptr_t)(mm.begin) &~ static_cast<uintptr_t>(granularity_mask)));
@@ -162,6 +204,117 @@ namespace
     HANDLE m_map;
     static const uint64_t granularity_mask = 0xffff;
   };
+#else
+  void ThrowErrno(const char* function_name)
+  {
+    throw std::runtime_error(std::string(function_name) + ": " + strerror(errno));
+  }
+
+  uint64_t PageMask()
+  {
+    static const uint64_t mask = static_cast<uint64_t>(sysconf(_SC_PAGESIZE)) - 1;
+    return mask;
+  }
+
+  class MappedPhysicalFile : public MappableFile
+  {
+  public:
+    MappedPhysicalFile()
+      : m_fd(-1)
+      , m_granularity_mask(PageMask())
+    {
+    }
+
+    void initialise(const char* path)
+    {
+      m_fd = open(path, O_RDONLY | O_CLOEXEC);
+      if(m_fd < 0)
+        throw std::runtime_error(std::string("Cannot open file `") + path + "': " + strerror(errno));
+
+      struct stat st;
+      if(fstat(m_fd, &st) != 0)
+        ThrowErrno("fstat");
+      m_size = static_cast<uint64_t>(st.st_size);
+    }
+
+    void initialise(const wchar_t* path)
+    {
+      auto len = wcstombs(nullptr, path, 0);
+      if(len == static_cast<size_t>(-1))
+        throw std::runtime_error("Cannot convert file name to the native encoding.");
+      std::string narrow(len, '\0');
+      wcstombs(&narrow[0], path, len);
+      initialise(narrow.c_str());
+    }
+
+    ~MappedPhysicalFile()
+    {
+      if(m_fd >= 0)
+        close(m_fd);
+    }
+
+    void expand(uint64_t& offset_begin, uint64_t& offset_end) override
+    {
+      offset_begin &=~ m_granularity_mask;
+      if(offset_end < m_size)
+      {
+        offset_end = (offset_end + m_granularity_mask) &~ m_granularity_mask;
+        if(offset_end > m_size)
+          offset_end = m_size;
+      }
+    }
+
+    MappedMemory map(uint64_t offset_begin, uint64_t offset_end, AccessPattern::E pattern) override
+    {
+      if(offset_end > m_size) throw std::out_of_range("Cannot map beyond end of file.");
+      if(offset_end == offset_begin) return MappedMemory();
+      if(offset_end < offset_begin) throw std::runtime_error("Cannot map backwards range.");
+
+      auto orig_size = offset_end - offset_begin;
+      auto padding = offset_begin & m_granularity_mask;
+      expand(offset_begin, offset_end);
+      auto size = offset_end - offset_begin;
+      if(static_cast<size_t>(size) != size)
+        throw std::runtime_error("Range is too large to map as a single block.");
+
+      auto mapped_ = mmap(nullptr, static_cast<size_t>(size), PROT_READ, MAP_SHARED, m_fd, static_cast<off_t>(offset_begin));
+      if(mapped_ == MAP_FAILED)
+        ThrowErrno("mmap");
+
+      switch(pattern)
+      {
+      case AccessPattern::Sequential: madvise(mapped_, static_cast<size_t>(size), MADV_SEQUENTIAL); break;
+      case AccessPattern::Random:     madvise(mapped_, static_cast<size_t>(size), MADV_RANDOM); break;
+      default: break;
+      }
+
+      auto mapped = static_cast<const uint8_t*>(mapped_) + padding;
+      return MappedMemory(mapped, mapped + orig_size, &UnmapPhysical);
+    }
+
+    void prefetch(uint64_t offset_begin, uint64_t offset_end) override
+    {
+      if(offset_end > m_size || offset_end <= offset_begin)
+        return;
+      posix_fadvise(m_fd, static_cast<off_t>(offset_begin), static_cast<off_t>(offset_end - offset_begin), POSIX_FADV_WILLNEED);
+    }
+
+    int getFileDescriptor() override
+    {
+      return m_fd;
+    }
+
+    static void UnmapPhysical(MappedMemory& mm)
+    {
+      auto base = reinterpret_cast<uintptr_t>(mm.begin) &~ static_cast<uintptr_t>(PageMask());
+      munmap(reinterpret_cast<void*>(base), static_cast<size_t>(reinterpret_cast<uintptr_t>(mm.end) - base));
+    }
+
+  private:
+    int m_fd;
+    const uint64_t m_granularity_mask;
+  };
+#endif
 
   class SmallPhysicalFile : public MappableFile
   {
@@ -180,12 +333,12 @@ namespace
         offset_end = m_size;
     }
 
-    MappedMemory map(uint64_t offset_begin, uint64_t offset_end) override
+    MappedMemory map(uint64_t offset_begin, uint64_t offset_end, AccessPattern::E pattern) override
     {
       if(offset_begin < offset_end && offset_end <= m_size)
         return MappedMemory(m_contents.begin + offset_begin, m_contents.begin + offset_end);
       else
-        return m_file->map(offset_begin, offset_end);
+        return m_file->map(offset_begin, offset_end, pattern);
     }
 
   private:
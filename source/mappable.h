@@ -1,5 +1,6 @@
 #pragma once
 #include <stdint.h>
+#include <cstddef>
 #include <memory>
 
 class MappedMemory
@@ -10,7 +11,7 @@ public:
   MappedMemory(const uint8_t* begin, const uint8_t* end, void (*deleter)(MappedMemory&));
   MappedMemory(MappedMemory&& move_from);
   MappedMemory& operator= (MappedMemory&& move_from);
-  MappedMemory& operator= (nullptr_t);
+  MappedMemory& operator= (std::nullptr_t);
   ~MappedMemory();
 
   size_t size() const { return static_cast<size_t>(end - begin); }
@@ -26,6 +27,17 @@ private:
   void (*m_deleter)(MappedMemory& mm);
 };
 
+//! How a caller intends to read from a mapped range, so that the OS can tune read-ahead.
+namespace AccessPattern
+{
+  enum E
+  {
+    Normal,
+    Sequential, //!< A single front-to-back pass, e.g. reading or inflating a whole file.
+    Random,     //!< Scattered small reads, e.g. table of contents lookups.
+  };
+}
+
 //! Interface for reading from files in a memory-mapped fashion.
 class MappableFile
 {
@@ -33,13 +45,32 @@ public:
   virtual ~MappableFile();
 
   uint64_t getSize() const {return m_size;}
+
+  //! Widen a range to the granularity at which this file can actually be mapped.
   virtual void expand(uint64_t& offset_begin, uint64_t& offset_end);
-  virtual MappedMemory map(uint64_t offset_begin, uint64_t offset_end) = 0;
+
+  //! Map a range of the file into memory.
+  /*!
+    \param pattern A hint as to how the mapped memory will be read. Implementations are free to
+                   ignore it.
+  */
+  virtual MappedMemory map(uint64_t offset_begin, uint64_t offset_end, AccessPattern::E pattern = AccessPattern::Normal) = 0;
   MappedMemory mapAll();
 
+  //! Hint that a range will be read soon, so that the OS can start reading it in the background.
+  /*!
+    Returns without waiting for the read. Files which are already in memory ignore the hint.
+  */
+  virtual void prefetch(uint64_t offset_begin, uint64_t offset_end);
+
+  //! The POSIX file descriptor which the file is read from, or -1 if there is no such descriptor
+  //! (e.g. because the file is held in memory, or on Windows).
+  virtual int getFileDescriptor();
+
 protected:
   uint64_t m_size;
 };
 
+//! Open a file for reading. As on POSIX, the file may be renamed or deleted while it is open.
 std::unique_ptr<MappableFile> MapPhysicalFileA(const char* path);
 std::unique_ptr<MappableFile> MapPhysicalFileW(const wchar_t* path);
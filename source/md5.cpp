@@ -0,0 +1,124 @@
+#include "stdafx.h"
+// The algorithm in this file is public domain.
+// See RFC 1321 for more details.
+#include "md5.h"
+
+namespace
+{
+  inline uint32_t rotl(uint32_t x, int n)
+  {
+    return (x << n) | (x >> (32 - n));
+  }
+
+  inline uint32_t load_le32(const uint8_t* p)
+  {
+    return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) | (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
+  }
+
+#define MD5_STEP(f, a, b, c, d, x, t, s) \
+  a += f(b, c, d) + x + t; \
+  a = rotl(a, s) + b
+
+#define MD5_F(x, y, z) (z ^ (x & (y ^ z)))
+#define MD5_G(x, y, z) (y ^ (z & (x ^ y)))
+#define MD5_H(x, y, z) (x ^ y ^ z)
+#define MD5_I(x, y, z) (y ^ (x | ~z))
+}
+
+MD5::MD5()
+  : m_num_bytes(0)
+{
+  m_state[0] = 0x67452301;
+  m_state[1] = 0xefcdab89;
+  m_state[2] = 0x98badcfe;
+  m_state[3] = 0x10325476;
+}
+
+void MD5::update(const void* data, size_t size)
+{
+  auto bytes = static_cast<const uint8_t*>(data);
+  auto buffered = static_cast<size_t>(m_num_bytes & 63);
+  m_num_bytes += size;
+
+  if(buffered)
+  {
+    auto n = 64 - buffered;
+    if(size < n)
+    {
+      memcpy(m_buffer + buffered, bytes, size);
+      return;
+    }
+    memcpy(m_buffer + buffered, bytes, n);
+    transform(m_buffer);
+    bytes += n;
+    size -= n;
+  }
+  for(; size >= 64; bytes += 64, size -= 64)
+    transform(bytes);
+  memcpy(m_buffer, bytes, size);
+}
+
+void MD5::finish(uint8_t digest[16])
+{
+  uint8_t length[8];
+  auto num_bits = m_num_bytes * 8;
+  for(int i = 0; i < 8; ++i)
+    length[i] = static_cast<uint8_t>(num_bits >> (i * 8));
+
+  static const uint8_t padding[64] = {0x80};
+  update(padding, 1 + ((119 - (m_num_bytes & 63)) & 63));
+  update(length, 8);
+
+  for(int i = 0; i < 16; ++i)
+    digest[i] = static_cast<uint8_t>(m_state[i / 4] >> ((i % 4) * 8));
+}
+
+void MD5::transform(const uint8_t* block)
+{
+  uint32_t w[16];
+  for(int i = 0; i < 16; ++i)
+    w[i] = load_le32(block + i * 4);
+
+  auto a = m_state[0], b = m_state[1], c = m_state[2], d = m_state[3];
+
+  MD5_STEP(MD5_F, a, b, c, d, w[ 0], 0xd76aa478,  7); MD5_STEP(MD5_F, d, a, b, c, w[ 1], 0xe8c7b756, 12);
+  MD5_STEP(MD5_F, c, d, a, b, w[ 2], 0x242070db, 17); MD5_STEP(MD5_F, b, c, d, a, w[ 3], 0xc1bdceee, 22);
+  MD5_STEP(MD5_F, a, b, c, d, w[ 4], 0xf57c0faf,  7); MD5_STEP(MD5_F, d, a, b, c, w[ 5], 0x4787c62a, 12);
+  MD5_STEP(MD5_F, c, d, a, b, w[ 6], 0xa8304613, 17); MD5_STEP(MD5_F, b, c, d, a, w[ 7], 0xfd469501, 22);
+  MD5_STEP(MD5_F, a, b, c, d, w[ 8], 0x698098d8,  7); MD5_STEP(MD5_F, d, a, b, c, w[ 9], 0x8b44f7af, 12);
+  MD5_STEP(MD5_F, c, d, a, b, w[10], 0xffff5bb1, 17); MD5_STEP(MD5_F, b, c, d, a, w[11], 0x895cd7be, 22);
+  MD5_STEP(MD5_F, a, b, c, d, w[12], 0x6b901122,  7); MD5_STEP(MD5_F, d, a, b, c, w[13], 0xfd987193, 12);
+  MD5_STEP(MD5_F, c, d, a, b, w[14], 0xa679438e, 17); MD5_STEP(MD5_F, b, c, d, a, w[15], 0x49b40821, 22);
+
+  MD5_STEP(MD5_G, a, b, c, d, w[ 1], 0xf61e2562,  5); MD5_STEP(MD5_G, d, a, b, c, w[ 6], 0xc040b340,  9);
+  MD5_STEP(MD5_G, c, d, a, b, w[11], 0x265e5a51, 14); MD5_STEP(MD5_G, b, c, d, a, w[ 0], 0xe9b6c7aa, 20);
+  MD5_STEP(MD5_G, a, b, c, d, w[ 5], 0xd62f105d,  5); MD5_STEP(MD5_G, d, a, b, c, w[10], 0x02441453,  9);
+  MD5_STEP(MD5_G, c, d, a, b, w[15], 0xd8a1e681, 14); MD5_STEP(MD5_G, b, c, d, a, w[ 4], 0xe7d3fbc8, 20);
+  MD5_STEP(MD5_G, a, b, c, d, w[ 9], 0x21e1cde6,  5); MD5_STEP(MD5_G, d, a, b, c, w[14], 0xc33707d6,  9);
+  MD5_STEP(MD5_G, c, d, a, b, w[ 3], 0xf4d50d87, 14); MD5_STEP(MD5_G, b, c, d, a, w[ 8], 0x455a14ed, 20);
+  MD5_STEP(MD5_G, a, b, c, d, w[13], 0xa9e3e905,  5); MD5_STEP(MD5_G, d, a, b, c, w[ 2], 0xfcefa3f8,  9);
+  MD5_STEP(MD5_G, c, d, a, b, w[ 7], 0x676f02d9, 14); MD5_STEP(MD5_G, b, c, d, a, w[12], 0x8d2a4c8a, 20);
+
+  MD5_STEP(MD5_H, a, b, c, d, w[ 5], 0xfffa3942,  4); MD5_STEP(MD5_H, d, a, b, c, w[ 8], 0x8771f681, 11);
+  MD5_STEP(MD5_H, c, d, a, b, w[11], 0x6d9d6122, 16); MD5_STEP(MD5_H, b, c, d, a, w[14], 0xfde5380c, 23);
+  MD5_STEP(MD5_H, a, b, c, d, w[ 1], 0xa4beea44,  4); MD5_STEP(MD5_H, d, a, b, c, w[ 4], 0x4bdecfa9, 11);
+  MD5_STEP(MD5_H, c, d, a, b, w[ 7], 0xf6bb4b60, 16); MD5_STEP(MD5_H, b, c, d, a, w[10], 0xbebfbc70, 23);
+  MD5_STEP(MD5_H, a, b, c, d, w[13], 0x289b7ec6,  4); MD5_STEP(MD5_H, d, a, b, c, w[ 0], 0xeaa127fa, 11);
+  MD5_STEP(MD5_H, c, d, a, b, w[ 3], 0xd4ef3085, 16); MD5_STEP(MD5_H, b, c, d, a, w[ 6], 0x04881d05, 23);
+  MD5_STEP(MD5_H, a, b, c, d, w[ 9], 0xd9d4d039,  4); MD5_STEP(MD5_H, d, a, b, c, w[12], 0xe6db99e5, 11);
+  MD5_STEP(MD5_H, c, d, a, b, w[15], 0x1fa27cf8, 16); MD5_STEP(MD5_H, b, c, d, a, w[ 2], 0xc4ac5665, 23);
+
+  MD5_STEP(MD5_I, a, b, c, d, w[ 0], 0xf4292244,  6); MD5_STEP(MD5_I, d, a, b, c, w[ 7], 0x432aff97, 10);
+  MD5_STEP(MD5_I, c, d, a, b, w[14], 0xab9423a7, 15); MD5_STEP(MD5_I, b, c, d, a, w[ 5], 0xfc93a039, 21);
+  MD5_STEP(MD5_I, a, b, c, d, w[12], 0x655b59c3,  6); MD5_STEP(MD5_I, d, a, b, c, w[ 3], 0x8f0ccc92, 10);
+  MD5_STEP(MD5_I, c, d, a, b, w[10], 0xffeff47d, 15); MD5_STEP(MD5_I, b, c, d, a, w[ 1], 0x85845dd1, 21);
+  MD5_STEP(MD5_I, a, b, c, d, w[ 8], 0x6fa87e4f,  6); MD5_STEP(MD5_I, d, a, b, c, w[15], 0xfe2ce6e0, 10);
+  MD5_STEP(MD5_I, c, d, a, b, w[ 6], 0xa3014314, 15); MD5_STEP(MD5_I, b, c, d, a, w[13], 0x4e0811a1, 21);
+  MD5_STEP(MD5_I, a, b, c, d, w[ 4], 0xf7537e82,  6); MD5_STEP(MD5_I, d, a, b, c, w[11], 0xbd3af235, 10);
+  MD5_STEP(MD5_I, c, d, a, b, w[ 2], 0x2ad7d2bb, 15); MD5_STEP(MD5_I, b, c, d, a, w[ 9], 0xeb86d391, 21);
+
+  m_state[0] += a;
+  m_state[1] += b;
+  m_state[2] += c;
+  m_state[3] += d;
+}
@@ -0,0 +1,22 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+//! Incremental MD5 (RFC 1321), as used for the header and contents checksums of SGA archives.
+class MD5
+{
+public:
+  MD5();
+
+  void update(const void* data, size_t size);
+
+  //! Finish the hash, after which the object must not be updated again.
+  void finish(uint8_t digest[16]);
+
+private:
+  void transform(const uint8_t* block);
+
+  uint32_t m_state[4];
+  uint64_t m_num_bytes;
+  uint8_t m_buffer[64];
+};
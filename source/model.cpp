@@ -13,9 +13,11 @@ namespace Essence { namespace Graphics
   struct ModelLoadContext
   {
     Arena& arena;
+    Arena& scratch; //!< For temporaries, which should be allocated within an Arena::Scope.
     Device1& d3;
     ShaderDatabase& shaders;
     TextureCache& textures;
+    const ChunkIndex* index; //!< Of the file currently being loaded.
     map<string, Material*> materials;
   };
 
@@ -301,6 +303,30 @@ namespace Essence { namespace Graphics
 
   namespace
   {
+    string TexturePath(const ChunkyString* value)
+    {
+      return string(value->begin(), value->end() - 1) + ".rgt";
+    }
+
+    //! Append the paths of the textures which Model's constructor will load for a file.
+    void GatherTexturePaths(const ChunkyFile* file, vector<string>& paths)
+    {
+      auto index = file->getIndex();
+      auto modl = index->findFirst(file, "FOLDMODL");
+      if(!modl || !index->findFirst(modl, "FOLDMESH"))
+        return;
+      for(auto foldmtrl : index->children(modl, "FOLDMTRL v1"))
+      {
+        for(auto datavar : index->children(foldmtrl, "DATAVAR v1"))
+        {
+          ChunkReader r(datavar);
+          r.readString();
+          if(r.read<uint32_t>() == 9)
+            paths.push_back(TexturePath(r.readString()));
+        }
+      }
+    }
+
     class TextureVariable : public MaterialVariable
     {
     public:
@@ -311,8 +337,7 @@ namespace Essence { namespace Graphics
         if(slot_info == nullptr)
           throw runtime_error("Missing input slot binding for texture " + getName().as<string>() + ".");
         m_slot = slot_info->slot;
-        auto path = string(m_value->begin(), m_value->end() - 1) + ".rgt";
-        m_srv = ctx.textures.load(path);
+        m_srv = ctx.textures.load(TexturePath(m_value));
       }
 
       void apply(C6::D3::Device1& d3, uint32_t pass) override
@@ -326,39 +351,37 @@ namespace Essence { namespace Graphics
     };
   }
 
-  template <typename TA, typename TV, typename F>
-  static void transform(Arena& arena, ArenaArray<TA>& arr_out, const vector<TV>& vec_in, F&& functor)
+  template <typename TA, typename TC, typename F>
+  static void transform(Arena& arena, ArenaArray<TA>& arr_out, const TC& range_in, F&& functor)
   {
-    const auto size = vec_in.size();
+    const auto size = distance(range_in.begin(), range_in.end());
     arr_out.recreate(&arena, static_cast<uint32_t>(size));
-    for(size_t i = 0; i < size; ++i)
-      arr_out[i] = functor(vec_in[i]);
+    auto in = range_in.begin();
+    for(uint32_t i = 0; i < static_cast<uint32_t>(size); ++i, ++in)
+      arr_out[i] = functor(*in);
   }
 
   Material::Material(const Chunk* foldmtrl, ModelLoadContext& ctx)
     : m_material_variables(&ctx.arena, 0)
   {
     {
-      auto datainfo = foldmtrl->findFirst("DATAINFO v1");
+      auto datainfo = ctx.index->findFirst(foldmtrl, "DATAINFO v1");
       if(!datainfo)
         throw runtime_error("Material missing shader name");
       ChunkReader r(datainfo);
       m_effect = &ctx.shaders.load(r.readString());
     }
+    transform(ctx.arena, m_material_variables, ctx.index->children(foldmtrl, "DATAVAR v1"), [&](const Chunk* chunk) -> MaterialVariable*
     {
-      auto vars = foldmtrl->findAll("DATAVAR v1");
-      transform(ctx.arena, m_material_variables, vars, [&](const Chunk* chunk) -> MaterialVariable*
+      ChunkReader r(chunk);
+      r.readString();
+      auto data_type = r.read<uint32_t>();
+      switch(data_type)
       {
-        ChunkReader r(chunk);
-        r.readString();
-        auto data_type = r.read<uint32_t>();
-        switch(data_type)
-        {
-        case 9: return ctx.arena.alloc<TextureVariable>(chunk, ctx, m_effect);
-        default: return ctx.arena.allocTrivial<MaterialVariable>(chunk);
-        }
-      });
-    }
+      case 9: return ctx.arena.alloc<TextureVariable>(chunk, ctx, m_effect);
+      default: return ctx.arena.allocTrivial<MaterialVariable>(chunk);
+      }
+    });
   }
 
   Technique& Material::apply(C6::D3::Device1& d3)
@@ -395,16 +418,9 @@ namespace Essence { namespace Graphics
   {
   }
 
-  void Object::readIndices(ChunkReader& r, uint16_t*& destination)
+  void Object::copyIndices(const uint8_t* source, uint16_t* destination) const
   {
-    auto index_count = r.read<uint32_t>();
-    auto source = r.tell();
-    auto size = 2 * index_count;
-    r.seek(size);
-    r.seek(sizeof(float) * 3 + 1);
-    r.readString();
-    memcpy(destination, source, size);
-    destination += index_count;
+    memcpy(destination + m_first_index, source, 2 * m_index_count);
   }
 
   static D3D10_INPUT_ELEMENT_DESC ReadInputLayoutElement(ChunkReader& r, UINT& offset)
@@ -498,9 +514,14 @@ namespace Essence { namespace Graphics
     auto num_objects = r.read<uint32_t>();
     m_objects.recreate(&ctx.arena, num_objects);
 
-    auto start = r.tell();
+    // Remember where each object's indices are, so that they can be copied without parsing the objects again.
+    Arena::Scope scratch_scope(ctx.scratch);
+    auto index_data = ctx.scratch.mallocArray<const uint8_t*>(num_objects);
     for(uint32_t i = 0; i < num_objects; ++i)
+    {
+      index_data[i] = r.tell() + sizeof(uint32_t);
       m_objects[i] = ctx.arena.allocTrivial<Object>(r, ctx, index_count);
+    }
 
     D3D10_BUFFER_DESC ib;
     ib.ByteWidth = index_count * 2;
@@ -511,9 +532,8 @@ namespace Essence { namespace Graphics
     m_indices = ctx.d3.createBuffer(ib);
 
     auto mapped = reinterpret_cast<uint16_t*>(m_indices.map(D3D10_MAP_WRITE_DISCARD, 0));
-    r.seek(start);
     for(uint32_t i = 0; i < num_objects; ++i)
-      Object::readIndices(r, mapped);
+      m_objects[i]->copyIndices(index_data[i], mapped);
     m_indices.unmap();
   }
 
@@ -563,7 +583,7 @@ namespace Essence { namespace Graphics
     , m_objects(&ctx.arena, 0)
   {
     m_name = foldmrgm->getName();
-    auto datadata = foldmrgm->findFirst("DATADATA");
+    auto datadata = ctx.index->findFirst(foldmrgm, "DATADATA");
     if(!datadata)
       throw runtime_error("Mesh missing data");
 
@@ -575,7 +595,7 @@ namespace Essence { namespace Graphics
     }
     SetDebugObjectName(m_indices, m_name + " indices");
 
-    auto databvol = foldmrgm->findFirst("DATABVOL v2");
+    auto databvol = ctx.index->findFirst(foldmrgm, "DATABVOL v2");
     if(databvol && databvol->getSize() >= 61)
       m_bvol = reinterpret_cast<const bounding_volume_t*>(databvol->getContents() + 1);
   }
@@ -587,16 +607,16 @@ namespace Essence { namespace Graphics
 
   void Model::loadMeshes(const Chunk* foldmesh, ModelLoadContext& ctx)
   {
-    if(auto mgrp = foldmesh->findFirst("FOLDMGRP"))
+    if(auto mgrp = ctx.index->findFirst(foldmesh, "FOLDMGRP"))
     {
-      for(auto child : mgrp->findAll("FOLDMESH"))
+      for(auto child : ctx.index->children(mgrp, "FOLDMESH"))
         loadMeshes(child, ctx);
     }
-    else if(auto mrgm = foldmesh->findFirst("FOLDMRGM"))
+    else if(auto mrgm = ctx.index->findFirst(foldmesh, "FOLDMRGM"))
     {
       m_meshes.push_back(m_arena.alloc<Mesh>(mrgm, ctx));
     }
-    else if(auto trim = foldmesh->findFirst("FOLDTRIM"))
+    else if(auto trim = ctx.index->findFirst(foldmesh, "FOLDTRIM"))
     {
       m_meshes.push_back(m_arena.alloc<Mesh>(trim, ctx));
     }
@@ -625,19 +645,31 @@ namespace Essence { namespace Graphics
   }
 
   Model::Model(FileSource* mod_fs, ShaderDatabase* shaders, std::vector<std::unique_ptr<const ChunkyFile>> files, Device1& d3)
-    : m_shaders(shaders)
+    : m_arena("model")
+    , m_shaders(shaders)
     , m_files(move(files))
   {
     TextureCache textures(mod_fs, d3);
-    ModelLoadContext ctx = {m_arena, d3, *m_shaders, textures};
+    Arena scratch("model_load_scratch");
+    ModelLoadContext ctx = {m_arena, scratch, d3, *m_shaders, textures, nullptr};
+
+    // Textures are read as one batch, in archive order, rather than one by one in material order.
+    vector<string> texture_paths;
+    for(auto& file : m_files)
+    {
+      runtime_assert(file->getIndex() != nullptr, "Model files must be opened with ChunkyFile::OpenIndexed.");
+      GatherTexturePaths(file.get(), texture_paths);
+    }
+    textures.preload(texture_paths);
 
     for(auto& file : m_files)
     {
-      auto modl = file->findFirst("FOLDMODL");
+      ctx.index = file->getIndex();
+      auto modl = ctx.index->findFirst(file.get(), "FOLDMODL");
 
-      if(auto foldmesh = modl->findFirst("FOLDMESH"))
+      if(auto foldmesh = ctx.index->findFirst(modl, "FOLDMESH"))
       {
-        for(auto foldmtrl : modl->findAll("FOLDMTRL v1"))
+        for(auto foldmtrl : ctx.index->children(modl, "FOLDMTRL v1"))
         {
           auto name = foldmtrl->getName();
           name.resize(name.size() - 1);
@@ -646,7 +678,7 @@ namespace Essence { namespace Graphics
         loadMeshes(foldmesh, ctx);
         ctx.materials.clear();
       }
-      if(auto datadtbp = modl->findFirst("DATADTBP v3"))
+      if(auto datadtbp = ctx.index->findFirst(modl, "DATADTBP v3"))
       {
         defineVariables(datadtbp);
       }
@@ -699,9 +731,9 @@ namespace Essence { namespace Graphics
     d3.drawIndexed(m_index_count, m_first_index, 0);
   }
 
-  vector<Object*> Model::getObjects()
+  ArenaVector<Object*> Model::getObjects(Arena& arena)
   {
-    vector<Object*> result;
+    ArenaVector<Object*> result(&arena, getObjectCount());
     for(auto mesh : m_meshes)
     {
       for(auto object : mesh->getObjects())
@@ -710,6 +742,14 @@ namespace Essence { namespace Graphics
     return result;
   }
 
+  uint32_t Model::getObjectCount()
+  {
+    uint32_t count = 0;
+    for(auto mesh : m_meshes)
+      count += mesh->getObjects().size();
+    return count;
+  }
+
   namespace
   {
     class ObjectVisibilityBinding : public ConditionListener
@@ -717,38 +757,25 @@ namespace Essence { namespace Graphics
     public:
       ObjectVisibilityBinding(ConditionLoadContext& ctx, const Chunk* datamsd, Condition* condition, ConditionListener* downstream)
         : m_condition(condition)
-        , m_objects(&ctx.arena, 0)
+        , m_objects(&ctx.arena)
         , m_downstream(downstream)
       {
-        uint32_t num_states = 0;
-        {
-          ChunkReader r(datamsd);
-          r.readString();
-        
-          auto num_objects = r.read<uint32_t>();
-          while(num_objects --> 0)
-          {
-            auto name = r.readString();
-            auto count = ctx.objects.count(name->as<string>());
-            if(count == 0)
-              throw runtime_error("DATAMSD references non-existent object `" + name->as<string>() + "'");
-            num_states += static_cast<uint32_t>(count);
-          }
-        }
-        {
-          ChunkReader r(datamsd);
-          r.readString();
-          r.read<uint32_t>();
+        ChunkReader r(datamsd);
+        r.readString();
 
-          bool state = m_condition->isTrue();
-          for(auto ptr = m_objects.recreate(&ctx.arena, num_states).begin(), end = m_objects.end(); ptr != end; )
+        auto num_objects = r.read<uint32_t>();
+        m_objects.reserve(num_objects);
+        bool state = m_condition->isTrue();
+        while(num_objects --> 0)
+        {
+          auto name = r.readString()->as<string>();
+          auto objects = ctx.objects.equal_range(name);
+          if(objects.first == objects.second)
+            throw runtime_error("DATAMSD references non-existent object `" + name + "'");
+          for(auto& object : objects)
           {
-            auto name = r.readString();
-            for(auto& object : ctx.objects.equal_range(name->as<string>()))
-            {
-              *object.second = state;
-              *ptr++ = object.second;
-            }
+            *object.second = state;
+            m_objects.push_back(object.second);
           }
         }
         condition->addListener(this);
@@ -765,7 +792,7 @@ namespace Essence { namespace Graphics
 
     private:
       Condition* m_condition;
-      ArenaArray<bool*> m_objects;
+      ArenaVector<bool*> m_objects;
       ConditionListener* m_downstream;
     };
   }
@@ -776,7 +803,8 @@ namespace Essence { namespace Graphics
     for(auto variable : m_variables)
       ctx.dependent_clause_head[variable.first] = &variable.second->m_first_dependent_clause;
 
-    for(auto object : getObjects())
+    Arena scratch("model_bind_scratch");
+    for(auto object : getObjects(scratch))
     {
       string name(object->getName()->begin(), find(object->getName()->begin(), object->getName()->end(), ':'));
       for(auto& c : name)
@@ -787,16 +815,16 @@ namespace Essence { namespace Graphics
     
     for(auto& file : m_files)
     {
-      if(auto foldmsbp = file->findFirst("FOLDMODL")->findFirst("FOLDMSBP v1"))
+      auto index = file->getIndex();
+      if(auto foldmsbp = index->findFirst(index->findFirst(file.get(), "FOLDMODL"), "FOLDMSBP v1"))
       {
-        auto msds = foldmsbp->findAll("DATAMSD? v2");
-        auto cnbps = foldmsbp->findAll("DATACNBP");
-        auto count = (min)(msds.size(), cnbps.size());
-        runtime_assert(cnbps.size() == msds.size(), "Mismatch between number of DATAMSDs and number of DATACNBPs");
-        for(size_t i = 0; i < count; ++i)
+        auto msds = index->children(foldmsbp, "DATAMSD? v2");
+        auto cnbps = index->children(foldmsbp, "DATACNBP");
+        runtime_assert(distance(cnbps.begin(), cnbps.end()) == distance(msds.begin(), msds.end()), "Mismatch between number of DATAMSDs and number of DATACNBPs");
+        for(auto msd = msds.begin(), cnbp = cnbps.begin(); msd != msds.end(); ++msd, ++cnbp)
         {
-          auto condition = m_arena.allocTrivial<Condition>(ctx, cnbps[i]);
-          m_arena.allocTrivial<ObjectVisibilityBinding>(ctx, msds[i], condition, listener);
+          auto condition = m_arena.allocTrivial<Condition>(ctx, *cnbp);
+          m_arena.allocTrivial<ObjectVisibilityBinding>(ctx, *msd, condition, listener);
         }
       }
     }
@@ -138,7 +138,7 @@ namespace Essence { namespace Graphics
   public:
     Object(ChunkReader& r, ModelLoadContext& ctx, unsigned int& first_index);
     Object(const ChunkyString* name, unsigned int index_count);
-    static void readIndices(ChunkReader& r, uint16_t*& destination);
+    void copyIndices(const uint8_t* source, uint16_t* destination) const;
 
     auto getName() const -> const ChunkyString* { return m_name; }
     void render(C6::D3::Device1& d3);
@@ -186,7 +186,8 @@ namespace Essence { namespace Graphics
 
     void render(C6::D3::Device1& d3, const bool* object_visibility = nullptr);
     auto getMeshes() -> const std::vector<Mesh*>& { return m_meshes; }
-    auto getObjects() -> std::vector<Object*>;
+    auto getObjects(Arena& arena) -> ArenaVector<Object*>;
+    uint32_t getObjectCount();
     auto getVariables() -> const std::map<std::string, ModelVariable*>& { return m_variables; }
 
     void bindVariablesToObjectVisibility(bool* object_visibility, ConditionListener* listener);
@@ -2,17 +2,23 @@
 #include "presized_arena.h"
 #include "arena.h"
 
-PresizedArena::PresizedArena(size_t allocation_limit)
+PresizedArena::PresizedArena(size_t allocation_limit, const char* name)
   : m_base(static_cast<char*>(VirtualAlloc(nullptr, allocation_limit, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE)))
   , m_bump(m_base)
-#ifndef ASSUME_ASSERTIONS_ARE_TRUE
   , m_end(m_base + allocation_limit)
-#endif
 {
+  memset(&m_stats, 0, sizeof(m_stats));
+  m_stats.num_blocks = 1;
+  m_stats.bytes_reserved = allocation_limit;
+  m_stats.peak_bytes_reserved = allocation_limit;
+  ArenaTelemetry::Register(m_registration, name, &m_stats);
 }
 
 PresizedArena::~PresizedArena()
 {
+  // Whatever was never handed out was reserved for nothing.
+  m_stats.bytes_wasted += m_end - m_bump;
+  ArenaTelemetry::Unregister(m_registration);
   VirtualFree(m_base, 0, MEM_RELEASE);
 }
 
@@ -22,6 +28,8 @@ void* PresizedArena::malloc(size_t size)
   runtime_assert(static_cast<size_t>(m_end - m_bump) >= size, "Pre-sized arena is too small.");
 #endif
 
+  m_stats.num_allocations += 1;
+  m_stats.bytes_requested += size;
   auto result = static_cast<void*>(m_bump);
   m_bump += size;
   return result;
@@ -1,5 +1,6 @@
 #pragma once
 #include <new>
+#include "arena.h"
 
 //! An arena-based memory allocator with a fixed upper bound on the amount of allocated memory.
 /*!
@@ -11,9 +12,12 @@
 class PresizedArena
 {
 public:
-  PresizedArena(size_t allocation_limit);
+  //! \param name Identifies the arena in ArenaTelemetry; must be a string literal.
+  PresizedArena(size_t allocation_limit, const char* name = "presized");
   ~PresizedArena();
 
+  const ArenaStats& getStats() const { return m_stats; }
+
   //! Allocate a single object in the arena.
   /*!
     Note that objects allocated with this method will not have their destructor called when the arena
@@ -42,7 +46,7 @@ public:
 private:
   char* m_base;
   char* m_bump;
-#ifndef ASSUME_ASSERTIONS_ARE_TRUE
   char* m_end;
-#endif
+  ArenaStats m_stats;
+  ArenaTelemetry::Registration m_registration;
 };
@@ -0,0 +1,597 @@
+#include "stdafx.h"
+#include "range_reader.h"
+#include "mappable.h"
+#include "thread_pool.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+// io_uring is built whenever the headers are new enough (Linux 5.4, for io_uring_params::features),
+// as the running kernel is still checked before it is used. Define WITHOUT_IO_URING to opt out.
+#if defined(__linux__) && !defined(WITHOUT_IO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#if defined(IORING_FEAT_SINGLE_MMAP) && defined(__NR_io_uring_setup) && !defined(WITH_IO_URING)
+#define WITH_IO_URING
+#endif
+#endif
+#endif
+#ifdef WITH_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+using namespace std;
+
+namespace
+{
+  unsigned ResolveThreadCount(unsigned num_threads)
+  {
+    if(num_threads == 0)
+      num_threads = thread::hardware_concurrency();
+    return num_threads == 0 ? 1 : num_threads;
+  }
+
+  //! Maps each range on a pool worker, and consumes it in place.
+  class MappingRangeReader : public RangeReader
+  {
+  public:
+    MappingRangeReader(MappableFile* file, unsigned num_threads)
+      : m_file(file)
+      , m_pool(num_threads)
+    {
+    }
+
+    const char* getName() const override { return "mmap"; }
+    unsigned getThreadCount() const override { return m_pool.getThreadCount(); }
+    bool wantsFileOrder() const override { return false; }
+
+    void run(const range_t* ranges, size_t count, const consumer_t& consumer) override
+    {
+      m_pool.run(count, [&](size_t range_index, unsigned worker_index) {
+        auto& range = ranges[range_index];
+        if(range.size == 0)
+        {
+          consumer(range_index, nullptr, 0, worker_index);
+          return;
+        }
+        auto mapped = m_file->map(range.offset, range.offset + range.size, AccessPattern::Sequential);
+        consumer(range_index, mapped.begin, mapped.size(), worker_index);
+      });
+    }
+
+  private:
+    MappableFile* m_file;
+    WorkStealingPool m_pool;
+  };
+
+#ifndef _WIN32
+  //! How a StreamingRangeReader gets bytes from a file descriptor into its buffers.
+  class ReadEngine
+  {
+  public:
+    virtual ~ReadEngine() {}
+
+    //! The most reads which may be submitted but not yet completed.
+    virtual unsigned getQueueDepth() const = 0;
+
+    //! Start reading into dest; the read may finish early, in which case the rest is resubmitted.
+    virtual void submit(int fd, uint64_t offset, uint8_t* dest, uint32_t size, unsigned token) = 0;
+
+    //! Wait for any submitted read to finish.
+    /*!
+      \param result The number of bytes read, or a negated errno value.
+      \return The token which the read was submitted with.
+    */
+    virtual unsigned complete(int64_t& result) = 0;
+  };
+
+  //! Blocking pread, one read at a time; the baseline which io_uring is measured against.
+  class PreadEngine : public ReadEngine
+  {
+  public:
+    unsigned getQueueDepth() const override { return 1; }
+
+    void submit(int fd, uint64_t offset, uint8_t* dest, uint32_t size, unsigned token) override
+    {
+      m_fd = fd;
+      m_offset = offset;
+      m_dest = dest;
+      m_size = size;
+      m_token = token;
+    }
+
+    unsigned complete(int64_t& result) override
+    {
+      ssize_t num_read;
+      do
+        num_read = pread(m_fd, m_dest, m_size, static_cast<off_t>(m_offset));
+      while(num_read < 0 && errno == EINTR);
+      result = num_read < 0 ? -static_cast<int64_t>(errno) : num_read;
+      return m_token;
+    }
+
+  private:
+    int m_fd;
+    uint64_t m_offset;
+    uint8_t* m_dest;
+    uint32_t m_size;
+    unsigned m_token;
+  };
+
+#ifdef WITH_IO_URING
+  //! Reads through an io_uring instance, driven directly through its system calls and rings.
+  /*!
+    IORING_OP_READV is used rather than IORING_OP_READ, as the latter needs Linux 5.6.
+  */
+  class IoUringEngine : public ReadEngine
+  {
+  public:
+    //! \return nullptr if the kernel does not support (or does not permit) io_uring.
+    static unique_ptr<IoUringEngine> create(unsigned queue_depth)
+    {
+      unique_ptr<IoUringEngine> engine(new IoUringEngine);
+      return engine->initialise(queue_depth) ? move(engine) : nullptr;
+    }
+
+    ~IoUringEngine()
+    {
+      if(m_sqes)
+        munmap(m_sqes, m_sqes_size);
+      if(m_cq_ring && m_cq_ring != m_sq_ring)
+        munmap(m_cq_ring, m_cq_ring_size);
+      if(m_sq_ring)
+        munmap(m_sq_ring, m_sq_ring_size);
+      if(m_ring_fd >= 0)
+        close(m_ring_fd);
+    }
+
+    unsigned getQueueDepth() const override { return m_queue_depth; }
+
+    void submit(int fd, uint64_t offset, uint8_t* dest, uint32_t size, unsigned token) override
+    {
+      while(m_iovecs.size() <= token)
+        m_iovecs.push_back(iovec());
+      auto& iov = m_iovecs[token];
+      iov.iov_base = dest;
+      iov.iov_len = size;
+
+      // Submissions are only handed to the kernel by the next call to complete(), so that several
+      // of them go in one system call.
+      auto tail = *m_sq_tail;
+      auto index = tail & *m_sq_mask;
+      auto& sqe = m_sqes[index];
+      memset(&sqe, 0, sizeof(sqe));
+      sqe.opcode = IORING_OP_READV;
+      sqe.fd = fd;
+      sqe.off = offset;
+      sqe.addr = reinterpret_cast<uint64_t>(&iov);
+      sqe.len = 1;
+      sqe.user_data = token;
+      m_sq_array[index] = index;
+      __atomic_store_n(m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+      ++m_num_unsubmitted;
+    }
+
+    unsigned complete(int64_t& result) override
+    {
+      for(;;)
+      {
+        auto head = *m_cq_head;
+        if(head != __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE))
+        {
+          auto& cqe = m_cqes[head & *m_cq_mask];
+          auto token = static_cast<unsigned>(cqe.user_data);
+          result = cqe.res;
+          __atomic_store_n(m_cq_head, head + 1, __ATOMIC_RELEASE);
+          return token;
+        }
+
+        auto num_submitted = syscall(__NR_io_uring_enter, m_ring_fd, m_num_unsubmitted, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+        if(num_submitted < 0)
+        {
+          if(errno == EINTR)
+            continue;
+          throw runtime_error(string("io_uring_enter: ") + strerror(errno));
+        }
+        m_num_unsubmitted -= static_cast<unsigned>(num_submitted);
+      }
+    }
+
+  private:
+    IoUringEngine()
+      : m_ring_fd(-1)
+      , m_sq_ring(nullptr)
+      , m_cq_ring(nullptr)
+      , m_sqes(nullptr)
+      , m_num_unsubmitted(0)
+    {
+    }
+
+    IoUringEngine(const IoUringEngine& cannot_copy);
+    IoUringEngine& operator= (const IoUringEngine& cannot_copy);
+
+    bool initialise(unsigned queue_depth)
+    {
+      io_uring_params params;
+      memset(&params, 0, sizeof(params));
+      m_ring_fd = static_cast<int>(syscall(__NR_io_uring_setup, queue_depth, &params));
+      if(m_ring_fd < 0)
+        return false;
+
+      m_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+      m_cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+      bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+      if(single_mmap)
+        m_sq_ring_size = m_cq_ring_size = max(m_sq_ring_size, m_cq_ring_size);
+      m_sq_ring = MapRing(m_ring_fd, m_sq_ring_size, IORING_OFF_SQ_RING);
+      if(!m_sq_ring)
+        return false;
+      m_cq_ring = single_mmap ? m_sq_ring : MapRing(m_ring_fd, m_cq_ring_size, IORING_OFF_CQ_RING);
+      if(!m_cq_ring)
+        return false;
+      m_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+      m_sqes = static_cast<io_uring_sqe*>(MapRing(m_ring_fd, m_sqes_size, IORING_OFF_SQES));
+      if(!m_sqes)
+        return false;
+
+      auto sq = static_cast<uint8_t*>(m_sq_ring);
+      m_sq_tail = reinterpret_cast<uint32_t*>(sq + params.sq_off.tail);
+      m_sq_mask = reinterpret_cast<uint32_t*>(sq + params.sq_off.ring_mask);
+      m_sq_array = reinterpret_cast<uint32_t*>(sq + params.sq_off.array);
+      auto cq = static_cast<uint8_t*>(m_cq_ring);
+      m_cq_head = reinterpret_cast<uint32_t*>(cq + params.cq_off.head);
+      m_cq_tail = reinterpret_cast<uint32_t*>(cq + params.cq_off.tail);
+      m_cq_mask = reinterpret_cast<uint32_t*>(cq + params.cq_off.ring_mask);
+      m_cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+      m_queue_depth = params.sq_entries;
+      return true;
+    }
+
+    static void* MapRing(int ring_fd, size_t size, off_t offset)
+    {
+      auto mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, offset);
+      return mapped == MAP_FAILED ? nullptr : mapped;
+    }
+
+    int m_ring_fd;
+    void* m_sq_ring;
+    void* m_cq_ring;
+    io_uring_sqe* m_sqes;
+    size_t m_sq_ring_size;
+    size_t m_cq_ring_size;
+    size_t m_sqes_size;
+    uint32_t* m_sq_tail;
+    uint32_t* m_sq_mask;
+    uint32_t* m_sq_array;
+    uint32_t* m_cq_head;
+    uint32_t* m_cq_tail;
+    uint32_t* m_cq_mask;
+    io_uring_cqe* m_cqes;
+    unsigned m_queue_depth;
+    unsigned m_num_unsubmitted;
+    deque<iovec> m_iovecs; //!< One per token; a deque, as a READV points at its iovec until it completes.
+  };
+#endif
+
+  //! Keeps up to a ReadEngine's queue depth of reads in flight into pooled buffers, from the
+  //! calling thread, and hands each buffer to a worker thread once its read completes.
+  /*!
+    Large ranges (such as the runs which verify reads) would fill the queue with hundreds of
+    megabytes of buffers, so reads beyond the first also stop once max_bytes_in_flight is reached.
+  */
+  class StreamingRangeReader : public RangeReader
+  {
+  public:
+    StreamingRangeReader(const char* name, int fd, unique_ptr<ReadEngine> engine, unsigned num_threads)
+      : m_name(name)
+      , m_fd(fd)
+      , m_engine(move(engine))
+      , m_num_workers(ResolveThreadCount(num_threads))
+      , m_finished(false)
+      , m_failed(false)
+    {
+    }
+
+    const char* getName() const override { return m_name; }
+    unsigned getThreadCount() const override { return m_num_workers; }
+    bool wantsFileOrder() const override { return true; }
+
+    void run(const range_t* ranges, size_t count, const consumer_t& consumer) override
+    {
+      if(count == 0)
+        return;
+
+      // Enough buffers to keep the queue full while every worker is busy with one.
+      const unsigned queue_depth = m_engine->getQueueDepth();
+      const unsigned num_buffers = queue_depth + m_num_workers;
+      if(m_buffers.size() < num_buffers)
+        m_buffers.resize(num_buffers);
+      m_free.clear();
+      for(unsigned i = 0; i < num_buffers; ++i)
+        m_free.push_back(i);
+      m_ready.clear();
+      m_finished = false;
+      m_failed = false;
+      m_error = nullptr;
+
+      vector<thread> workers;
+      workers.reserve(m_num_workers);
+      for(unsigned i = 0; i < m_num_workers; ++i)
+        workers.push_back(thread(&StreamingRangeReader::workerMain, this, ranges, &consumer, i));
+
+      const uint64_t max_bytes_in_flight = 32 * 1024 * 1024;
+      unsigned num_in_flight = 0;
+      uint64_t num_bytes_in_flight = 0;
+      try
+      {
+        size_t next = 0;
+        while(!m_failed)
+        {
+          while(next < count && num_in_flight < queue_depth && (num_in_flight == 0 || num_bytes_in_flight + ranges[next].size <= max_bytes_in_flight))
+          {
+            unsigned token;
+            {
+              unique_lock<mutex> lock(m_lock);
+              if(m_free.empty())
+                break;
+              token = m_free.back();
+              m_free.pop_back();
+            }
+            auto& buffer = m_buffers[token];
+            buffer.range_index = next++;
+            buffer.num_read = 0;
+            auto size = ranges[buffer.range_index].size;
+            if(static_cast<size_t>(size) != size)
+              throw runtime_error("Range is too large to read as a single block.");
+            if(buffer.data.size() < size)
+              buffer.data.resize(static_cast<size_t>(size));
+            if(size == 0)
+              makeReady(token);
+            else
+            {
+              submitRemainder(ranges, token);
+              ++num_in_flight;
+              num_bytes_in_flight += size;
+            }
+          }
+
+          if(num_in_flight == 0)
+          {
+            if(next == count)
+              break;
+            unique_lock<mutex> lock(m_lock);
+            m_buffer_freed.wait(lock, [&] { return !m_free.empty() || m_failed; });
+            continue;
+          }
+
+          int64_t result;
+          auto token = m_engine->complete(result);
+          auto& buffer = m_buffers[token];
+          if(result < 0)
+            throw runtime_error(string("read: ") + strerror(static_cast<int>(-result)));
+          if(result == 0)
+            throw runtime_error("Cannot read beyond end of file.");
+          buffer.num_read += static_cast<uint64_t>(result);
+          if(buffer.num_read < ranges[buffer.range_index].size)
+            submitRemainder(ranges, token);
+          else
+          {
+            --num_in_flight;
+            num_bytes_in_flight -= buffer.num_read;
+            makeReady(token);
+          }
+        }
+      }
+      catch(...)
+      {
+        fail(current_exception());
+      }
+
+      // The kernel may still be writing into buffers, so they must outlive every read in flight.
+      for(; num_in_flight; --num_in_flight)
+      {
+        int64_t result;
+        m_engine->complete(result);
+      }
+      {
+        lock_guard<mutex> lock(m_lock);
+        m_finished = true;
+      }
+      m_buffer_ready.notify_all();
+      for(auto& worker : workers)
+        worker.join();
+
+      if(m_error)
+        rethrow_exception(m_error);
+    }
+
+  private:
+    StreamingRangeReader(const StreamingRangeReader& cannot_copy);
+    StreamingRangeReader& operator= (const StreamingRangeReader& cannot_copy);
+
+    struct buffer_t
+    {
+      vector<uint8_t> data;
+      size_t range_index;
+      uint64_t num_read;
+    };
+
+    void submitRemainder(const range_t* ranges, unsigned token)
+    {
+      // Linux transfers at most a little under 2GB per read, so larger ranges take several.
+      const uint64_t max_read_size = 1 << 30;
+      auto& buffer = m_buffers[token];
+      auto& range = ranges[buffer.range_index];
+      auto size = min(range.size - buffer.num_read, max_read_size);
+      m_engine->submit(m_fd, range.offset + buffer.num_read, buffer.data.data() + buffer.num_read, static_cast<uint32_t>(size), token);
+    }
+
+    void makeReady(unsigned token)
+    {
+      {
+        lock_guard<mutex> lock(m_lock);
+        m_ready.push_back(token);
+      }
+      m_buffer_ready.notify_one();
+    }
+
+    void fail(exception_ptr error)
+    {
+      {
+        lock_guard<mutex> lock(m_lock);
+        if(!m_error)
+          m_error = error;
+        m_failed = true;
+      }
+      m_buffer_freed.notify_all();
+    }
+
+    void workerMain(const range_t* ranges, const consumer_t* consumer, unsigned worker_index)
+    {
+      for(;;)
+      {
+        unsigned token;
+        {
+          unique_lock<mutex> lock(m_lock);
+          m_buffer_ready.wait(lock, [&] { return !m_ready.empty() || m_finished; });
+          if(m_ready.empty())
+            return;
+          token = m_ready.front();
+          m_ready.pop_front();
+        }
+
+        if(!m_failed)
+        {
+          auto& buffer = m_buffers[token];
+          try
+          {
+            (*consumer)(buffer.range_index, buffer.data.data(), static_cast<size_t>(ranges[buffer.range_index].size), worker_index);
+          }
+          catch(...)
+          {
+            fail(current_exception());
+          }
+        }
+
+        {
+          lock_guard<mutex> lock(m_lock);
+          m_free.push_back(token);
+        }
+        m_buffer_freed.notify_one();
+      }
+    }
+
+    const char* m_name;
+    int m_fd;
+    unique_ptr<ReadEngine> m_engine;
+    unsigned m_num_workers;
+    vector<buffer_t> m_buffers; //!< Kept between calls to run, so that their memory is reused.
+
+    mutex m_lock;
+    condition_variable m_buffer_ready;
+    condition_variable m_buffer_freed;
+    vector<unsigned> m_free;
+    deque<unsigned> m_ready;
+    bool m_finished;
+    atomic<bool> m_failed;
+    exception_ptr m_error;
+  };
+
+  unique_ptr<RangeReader> CreatePreadReader(MappableFile* file, unsigned num_threads)
+  {
+    auto fd = file->getFileDescriptor();
+    if(fd < 0)
+      return nullptr;
+    return unique_ptr<RangeReader>(new StreamingRangeReader("pread", fd, unique_ptr<ReadEngine>(new PreadEngine), num_threads));
+  }
+
+#ifdef WITH_IO_URING
+  unique_ptr<RangeReader> CreateIoUringReader(MappableFile* file, unsigned num_threads)
+  {
+    const unsigned queue_depth = 32;
+    auto fd = file->getFileDescriptor();
+    if(fd < 0)
+      return nullptr;
+    auto engine = IoUringEngine::create(queue_depth);
+    if(!engine)
+      return nullptr;
+    return unique_ptr<RangeReader>(new StreamingRangeReader("io_uring", fd, move(engine), num_threads));
+  }
+#endif
+#endif
+
+  unique_ptr<RangeReader> CreateMappingReader(MappableFile* file, unsigned num_threads)
+  {
+    return unique_ptr<RangeReader>(new MappingRangeReader(file, num_threads));
+  }
+
+  struct backend_t
+  {
+    const char* name;
+    unique_ptr<RangeReader> (*create)(MappableFile* file, unsigned num_threads);
+  };
+
+  // pread is never worth falling back to, as it gives up mmap's zero-copy reads of cached data
+  // without gaining io_uring's queue depth, so it comes last.
+  const backend_t g_backends[] = {
+#ifdef WITH_IO_URING
+    {"io_uring", CreateIoUringReader},
+#endif
+    {"mmap", CreateMappingReader},
+#ifndef _WIN32
+    {"pread", CreatePreadReader},
+#endif
+  };
+
+  const backend_t* g_preferred_backend = g_backends;
+}
+
+unique_ptr<RangeReader> RangeReader::create(MappableFile* file, unsigned num_threads)
+{
+  if(auto reader = g_preferred_backend->create(file, num_threads))
+    return reader;
+  for(auto& backend : g_backends)
+  {
+    if(auto reader = backend.create(file, num_threads))
+      return reader;
+  }
+  throw runtime_error("No backend can read this file.");
+}
+
+unique_ptr<RangeReader> RangeReader::create(const char* backend_name, MappableFile* file, unsigned num_threads)
+{
+  for(auto& backend : g_backends)
+  {
+    if(strcmp(backend.name, backend_name) == 0)
+      return backend.create(file, num_threads);
+  }
+  return nullptr;
+}
+
+void RangeReader::getBackendNames(vector<const char*>& names)
+{
+  for(auto& backend : g_backends)
+    names.push_back(backend.name);
+}
+
+bool RangeReader::setPreferredBackend(const char* backend_name)
+{
+  for(auto& backend : g_backends)
+  {
+    if(strcmp(backend.name, backend_name) == 0)
+    {
+      g_preferred_backend = &backend;
+      return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,73 @@
+#pragma once
+#include <stdint.h>
+#include <functional>
+#include <memory>
+#include <vector>
+
+class MappableFile;
+
+//! Reads many ranges of a file in bulk, and hands each one to a consumer on a worker thread.
+/*!
+  This is for pipelines which sweep through much of an archive at once (extraction, verification).
+  Mapping each range and consuming it in place, as the "mmap" backend does, leaves every worker
+  blocked on page faults one page at a time whenever the file is not already in memory. Streaming
+  backends instead have the calling thread keep a bounded number of reads in flight into a pool of
+  buffers, and pass each buffer to the workers once its read completes, so that reading from disk
+  and consuming (e.g. inflating) overlap.
+
+  Streaming backends are only available for physical files on POSIX systems, and the "io_uring"
+  backend only on Linux, if it was built (which happens automatically given Linux 5.4 or later
+  headers, unless WITHOUT_IO_URING is defined) and if the running kernel allows it. Otherwise,
+  create() falls back to "mmap".
+*/
+class RangeReader
+{
+public:
+  struct range_t
+  {
+    uint64_t offset;
+    uint64_t size;
+  };
+
+  //! Called once per range; data is only valid for the duration of the call.
+  typedef std::function<void(size_t range_index, const uint8_t* data, size_t size, unsigned worker_index)> consumer_t;
+
+  virtual ~RangeReader() {}
+
+  virtual const char* getName() const = 0;
+
+  //! The number of workers which run the consumer; worker_index is always below this.
+  virtual unsigned getThreadCount() const = 0;
+
+  //! Whether ranges should be given in file order (true for streaming backends), or with the most
+  //! expensive to consume first (as for a WorkStealingPool).
+  virtual bool wantsFileOrder() const = 0;
+
+  //! Read every range, and call consumer for each one as it becomes available.
+  /*!
+    No two calls with the same worker_index run at the same time, so it can be used to index
+    per-thread scratch state.
+    \throws If a read fails or the consumer throws, the remaining ranges are skipped, and the first
+            exception is rethrown on the calling thread once any reads in flight have finished.
+  */
+  virtual void run(const range_t* ranges, size_t count, const consumer_t& consumer) = 0;
+
+  //! Create a reader of the preferred backend, or of the next available one if the preferred
+  //! backend cannot read this file.
+  /*!
+    \param num_threads An upper bound on the number of workers, or zero for one per hardware thread.
+  */
+  static std::unique_ptr<RangeReader> create(MappableFile* file, unsigned num_threads = 0);
+
+  //! Create a reader of a named backend, or nullptr if it is not available for this file.
+  static std::unique_ptr<RangeReader> create(const char* backend_name, MappableFile* file, unsigned num_threads = 0);
+
+  //! Get the names of all the backends available in this build, from most to least preferred.
+  static void getBackendNames(std::vector<const char*>& names);
+
+  //! Change which backend create() tries first (e.g. for benchmarking). Not thread-safe.
+  /*!
+    \return false if the named backend is not available in this build.
+  */
+  static bool setPreferredBackend(const char* backend_name);
+};
@@ -506,7 +506,8 @@ namespace Essence { namespace Graphics
   {
     auto mod_fs = db.getModFs();
 
-    m_fxinfo_file = ChunkyFile::Open(mod_fs->readFile(DB_ROOT + name + ".fxinfo"));
+    m_fxinfo_file = ChunkyFile::OpenIndexed(mod_fs->readFile(DB_ROOT + name + ".fxinfo"));
+    runtime_assert(m_fxinfo_file != nullptr, "Invalid fxinfo file.");
     readFxinfo();
 
     m_fxo_file = ChunkyFile::Open(mod_fs->readFile(DB_ROOT + name + ".fxo"));
@@ -531,9 +532,11 @@ namespace Essence { namespace Graphics
   {
     const auto arena = m_db.getArena();
     const uint32_t* num_variables;
+    const auto index = m_fxinfo_file->getIndex();
+    const auto foldspfi = index->findFirst(m_fxinfo_file.get(), "FOLDSPFI");
 
     {
-      auto datadesc = m_fxinfo_file->findFirst("FOLDSPFI")->findFirst("DATADESC");
+      auto datadesc = index->findFirst(foldspfi, "DATADESC");
       runtime_assert(datadesc != nullptr, "No DATADESC found in fxinfo file.");
 
       ChunkReader r(datadesc);
@@ -545,7 +548,7 @@ namespace Essence { namespace Graphics
     }
 
     {
-      auto dataspus = m_fxinfo_file->findFirst("FOLDSPFI")->findFirst("DATASPUS");
+      auto dataspus = index->findFirst(foldspfi, "DATASPUS");
       runtime_assert(dataspus != nullptr, "No DATASPUS found in fxinfo file.");
       runtime_assert(dataspus->getVersion() == 1, "Unsupported DATASPUS version in fxinfo file.");
 
@@ -557,7 +560,7 @@ namespace Essence { namespace Graphics
     }
 
     {
-      auto datatech = m_fxinfo_file->findFirst("FOLDSPFI")->findFirst("DATATECH");
+      auto datatech = index->findFirst(foldspfi, "DATATECH");
       runtime_assert(datatech != nullptr, "No DATATECH found in fxinfo file.");
       const auto version = datatech->getVersion();
       runtime_assert(version == 7 || version == 8, "Unsupported DATATECH version in fxinfo file.");
@@ -575,7 +578,8 @@ namespace Essence { namespace Graphics
 
   void Effect::readFxinfoParameters(const uint32_t* num_variables, const uint32_t datatech_version)
   {
-    auto dataparm = m_fxinfo_file->findFirst("FOLDSPFI")->findFirst("DATAPARM");
+    const auto index = m_fxinfo_file->getIndex();
+    auto dataparm = index->findFirst(index->findFirst(m_fxinfo_file.get(), "FOLDSPFI"), "DATAPARM");
     runtime_assert(dataparm != nullptr, "No DATAPARM found in fxinfo file.");
     runtime_assert(dataparm->getVersion() == 1, "Unsupported DATAPARM version in fxinfo file.");
 
@@ -5,13 +5,19 @@
 #include <memory>
 #include <map>
 #include <new>
+#include <stdexcept>
 #include <string>
 #include <unordered_map>
 #include <vector>
 
+#ifdef _WIN32
 #include <Windows.h>
 
 #include <nice/com.h>
 #include <nice/d2.h>
 #include <nice/d3.h>
 #include <nice/dw.h>
+#else
+#include <errno.h>
+#include <string.h>
+#endif
@@ -0,0 +1,54 @@
+#pragma once
+#include <stdint.h>
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <time.h>
+#endif
+
+//! Measures elapsed wall-clock time with the best resolution the platform offers.
+class Stopwatch
+{
+public:
+  Stopwatch()
+  {
+    restart();
+  }
+
+  void restart()
+  {
+    m_start = now();
+  }
+
+  double elapsedSeconds() const
+  {
+    return static_cast<double>(now() - m_start) / static_cast<double>(frequency());
+  }
+
+private:
+  static uint64_t now()
+  {
+#ifdef _WIN32
+    LARGE_INTEGER ticks;
+    QueryPerformanceCounter(&ticks);
+    return static_cast<uint64_t>(ticks.QuadPart);
+#else
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + static_cast<uint64_t>(ts.tv_nsec);
+#endif
+  }
+
+  static uint64_t frequency()
+  {
+#ifdef _WIN32
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    return static_cast<uint64_t>(freq.QuadPart);
+#else
+    return 1000000000ULL;
+#endif
+  }
+
+  uint64_t m_start;
+};
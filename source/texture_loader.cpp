@@ -5,7 +5,7 @@
 #include "chunky.h"
 #include "arena.h"
 #include "presized_arena.h"
-#include "zlib.h"
+#include "decompressor.h"
 using namespace std;
 using namespace C6::D3;
 using namespace Essence;
@@ -88,43 +88,6 @@ namespace
     return d3.createTexture2D(desc, contents);
   }
 
-  class Inflater
-  {
-  public:
-    Inflater()
-    {
-      m_z.zalloc = nullptr;
-      m_z.zfree = nullptr;
-      m_z.opaque = nullptr;
-      z_assert(inflateInit(&m_z), Z_OK);
-    }
-
-    void uncompress(uint8_t* dest, uint32_t dest_len, const uint8_t* src, uint32_t src_len)
-    {
-      m_z.next_out = dest;
-      m_z.avail_out = dest_len;
-      m_z.next_in = const_cast<Bytef*>(src);
-      m_z.avail_in = src_len;
-      z_assert(inflate(&m_z, Z_FINISH), Z_STREAM_END);
-      runtime_assert(m_z.avail_out == 0 && m_z.avail_in == 0, "Compressed data size mismatch.");
-      z_assert(inflateReset(&m_z), Z_OK);
-    }
-
-    ~Inflater()
-    {
-      inflateEnd(&m_z);
-    }
-
-  private:
-    void z_assert(int result, int expected)
-    {
-      if(result != expected)
-        throw std::runtime_error(m_z.msg);
-    }
-
-    z_stream m_z;
-  };
-
   Texture2D LoadChunkyDXTC(Device1& d3, const Chunk* dxtc)
   {
     auto tfmt_chunk = dxtc->findFirst("DATATFMT");
@@ -197,18 +160,20 @@ namespace
     size_t img_data_capacity = sizeof(D3D10_SUBRESOURCE_DATA) * tman->mip_count;
     for(uint32_t level = 0; level < tman->mip_count; ++level)
       img_data_capacity += tman->mips[level].data_length;
-    PresizedArena img_data(img_data_capacity);
+    PresizedArena img_data(img_data_capacity, "texture_upload");
 
     uint32_t level = 0;
     auto resources = img_data.mallocArray<D3D10_SUBRESOURCE_DATA>(tman->mip_count);
-    for(Inflater inflater; level < tman->mip_count; ++level)
+    for(auto decompressor = Decompressor::create(); level < tman->mip_count; ++level)
     {
       auto& mip = tman->mips[level];
       auto src = tdat_reader.reinterpret<uint8_t>(mip.data_length_compressed);
       if(mip.data_length != mip.data_length_compressed)
       {
         auto uncompressed = img_data.mallocArray<uint8_t>(mip.data_length);
-        inflater.uncompress(uncompressed, mip.data_length, src, mip.data_length_compressed);
+        size_t consumed;
+        auto length = decompressor->decompress(uncompressed, mip.data_length, src, mip.data_length_compressed, &consumed);
+        runtime_assert(length == mip.data_length && consumed == mip.data_length_compressed, "Compressed data size mismatch.");
         src = uncompressed;
       }
 
@@ -470,6 +435,26 @@ namespace Essence { namespace Graphics
       return srv;
     }
 
+    void preload(const std::vector<std::string>& paths)
+    {
+      vector<string> missing;
+      for(auto& path : paths)
+      {
+        if(!m_textures.count(path))
+          missing.push_back(path);
+      }
+      sort(missing.begin(), missing.end());
+      missing.erase(unique(missing.begin(), missing.end()), missing.end());
+
+      auto files = m_mod_fs->readFiles(missing);
+      for(size_t i = 0; i < missing.size(); ++i)
+      {
+        auto tex = LoadTexture(m_d3, move(files[i]));
+        SetDebugObjectName(tex, missing[i]);
+        m_textures[missing[i]] = m_d3.createShaderResourceView(tex);
+      }
+    }
+
   private:
     ShaderResourceView& addBuiltin(C6::D3::Device1& d3, string name, float r, float g, float b, float a)
     {
@@ -496,4 +481,9 @@ namespace Essence { namespace Graphics
   {
     return m_impl->load(path);
   }
+
+  void TextureCache::preload(const std::vector<std::string>& paths)
+  {
+    m_impl->preload(paths);
+  }
 }}
@@ -1,6 +1,7 @@
 #pragma once
 #include <memory>
 #include <string>
+#include <vector>
 
 class MappableFile;
 namespace Essence { class FileSource; }
@@ -23,6 +24,9 @@ namespace Essence { namespace Graphics
 
     C6::D3::ShaderResourceView load(const std::string& path);
 
+    //! Load every texture which is not yet loaded, reading the files as one batch.
+    void preload(const std::vector<std::string>& paths);
+
   private:
     std::unique_ptr<TextureCacheImpl> m_impl;
   };
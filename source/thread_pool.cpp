@@ -0,0 +1,150 @@
+#include "stdafx.h"
+#include "thread_pool.h"
+using namespace std;
+
+WorkStealingPool::WorkStealingPool(unsigned num_threads)
+  : m_task(nullptr)
+  , m_batch_id(0)
+  , m_num_busy(0)
+  , m_shutting_down(false)
+  , m_failed(false)
+{
+  if(num_threads == 0)
+    num_threads = thread::hardware_concurrency();
+  if(num_threads == 0)
+    num_threads = 1;
+  m_num_workers = num_threads;
+  m_workers.reset(new Worker[num_threads]);
+
+  m_threads.reserve(num_threads - 1);
+  for(unsigned i = 1; i < num_threads; ++i)
+    m_threads.push_back(thread(&WorkStealingPool::threadMain, this, i));
+}
+
+WorkStealingPool::~WorkStealingPool()
+{
+  {
+    lock_guard<mutex> lock(m_lock);
+    m_shutting_down = true;
+  }
+  m_batch_started.notify_all();
+  for(auto& t : m_threads)
+    t.join();
+}
+
+void WorkStealingPool::run(size_t num_tasks, const task_t& task)
+{
+  if(num_tasks == 0)
+    return;
+
+  for(size_t i = 0; i < num_tasks; ++i)
+    m_workers[i % m_num_workers].tasks.push_back(i);
+
+  m_failed = false;
+  m_error = nullptr;
+  if(m_num_workers > 1)
+  {
+    {
+      lock_guard<mutex> lock(m_lock);
+      m_task = &task;
+      m_num_busy = m_num_workers - 1;
+      ++m_batch_id;
+    }
+    m_batch_started.notify_all();
+  }
+  else
+  {
+    m_task = &task;
+  }
+
+  runWorker(0);
+
+  {
+    unique_lock<mutex> lock(m_lock);
+    while(m_num_busy != 0)
+      m_batch_finished.wait(lock);
+    m_task = nullptr;
+  }
+
+  if(m_error)
+  {
+    // Tasks which were never started are still sitting in the deques.
+    for(unsigned i = 0; i < m_num_workers; ++i)
+      m_workers[i].tasks.clear();
+    rethrow_exception(m_error);
+  }
+}
+
+void WorkStealingPool::threadMain(unsigned worker_index)
+{
+  uint64_t last_batch_id = 0;
+  for(;;)
+  {
+    {
+      unique_lock<mutex> lock(m_lock);
+      while(!m_shutting_down && m_batch_id == last_batch_id)
+        m_batch_started.wait(lock);
+      if(m_shutting_down)
+        return;
+      last_batch_id = m_batch_id;
+    }
+
+    runWorker(worker_index);
+
+    bool last_to_finish;
+    {
+      lock_guard<mutex> lock(m_lock);
+      last_to_finish = (--m_num_busy == 0);
+    }
+    if(last_to_finish)
+      m_batch_finished.notify_one();
+  }
+}
+
+void WorkStealingPool::runWorker(unsigned worker_index)
+{
+  size_t task_index;
+  while(!m_failed && (popOwn(worker_index, task_index) || steal(worker_index, task_index)))
+  {
+    try
+    {
+      (*m_task)(task_index, worker_index);
+    }
+    catch(...)
+    {
+      lock_guard<mutex> lock(m_lock);
+      if(!m_error)
+        m_error = current_exception();
+      m_failed = true;
+    }
+  }
+}
+
+bool WorkStealingPool::popOwn(unsigned worker_index, size_t& task_index)
+{
+  auto& worker = m_workers[worker_index];
+  lock_guard<mutex> lock(worker.lock);
+  if(worker.tasks.empty())
+    return false;
+  task_index = worker.tasks.front();
+  worker.tasks.pop_front();
+  return true;
+}
+
+bool WorkStealingPool::steal(unsigned worker_index, size_t& task_index)
+{
+  // No tasks are added part-way through a batch, so a single sweep which finds every deque empty
+  // means that there is nothing left to do.
+  for(unsigned i = 1; i < m_num_workers; ++i)
+  {
+    auto& victim = m_workers[(worker_index + i) % m_num_workers];
+    lock_guard<mutex> lock(victim.lock);
+    if(!victim.tasks.empty())
+    {
+      task_index = victim.tasks.back();
+      victim.tasks.pop_back();
+      return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,75 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//! Runs batches of independent tasks across a fixed set of threads, with work stealing.
+/*!
+  Each batch is dealt out round-robin into per-worker deques in the order given, so callers
+  should put the most expensive tasks first. A worker takes tasks from the front of its own
+  deque, and once that runs dry, steals from the back of the other deques (where the cheapest
+  tasks are). This keeps every worker busy until the very end of the batch, even when task
+  costs vary by orders of magnitude.
+
+  The thread which calls run() acts as worker 0, so a pool of one thread runs everything inline.
+*/
+class WorkStealingPool
+{
+public:
+  typedef std::function<void(size_t task_index, unsigned worker_index)> task_t;
+
+  //! Create a pool.
+  /*!
+    \param num_threads The total number of threads (including the calling thread) which will
+                       run tasks, or zero to use one per hardware thread.
+  */
+  WorkStealingPool(unsigned num_threads = 0);
+  ~WorkStealingPool();
+
+  unsigned getThreadCount() const { return m_num_workers; }
+
+  //! Call task(i, worker) for every i in [0, num_tasks), and wait for all of them to finish.
+  /*!
+    worker is in [0, getThreadCount()), and no two tasks with the same worker index run at the
+    same time, so it can be used to index per-thread scratch state.
+    \throws If any task throws, the remaining tasks are skipped, and the first exception is
+            rethrown on the calling thread once the other workers have stopped.
+  */
+  void run(size_t num_tasks, const task_t& task);
+
+private:
+  WorkStealingPool(const WorkStealingPool& cannot_copy);
+  WorkStealingPool& operator= (const WorkStealingPool& cannot_copy);
+
+  struct Worker
+  {
+    std::mutex lock;
+    std::deque<size_t> tasks;
+  };
+
+  void threadMain(unsigned worker_index);
+  void runWorker(unsigned worker_index);
+  bool popOwn(unsigned worker_index, size_t& task_index);
+  bool steal(unsigned worker_index, size_t& task_index);
+
+  unsigned m_num_workers;
+  std::unique_ptr<Worker[]> m_workers;
+  std::vector<std::thread> m_threads;
+
+  std::mutex m_lock;
+  std::condition_variable m_batch_started;
+  std::condition_variable m_batch_finished;
+  const task_t* m_task;
+  uint64_t m_batch_id;
+  unsigned m_num_busy;
+  bool m_shutting_down;
+  std::atomic<bool> m_failed;
+  std::exception_ptr m_error;
+};
@@ -1,78 +1,200 @@
 #include "chunky_writer.h"
+#include <stdexcept>
+#include <string>
+#include <string.h>
+#ifdef _WIN32
 #include <nice/com.h>
 #include <Windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#endif
 
 namespace Essence
 {
+  namespace
+  {
+    // Larger writes are split, as neither WriteFile nor write accept arbitrarily large lengths.
+    const size_t max_write_size = 1 << 30;
+
+#ifdef _WIN32
+    class FileSink : public ChunkySink
+    {
+    public:
+      FileSink(const wchar_t* filename)
+      {
+        m_file = CreateFileW(filename, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, 0, nullptr);
+        if(m_file == INVALID_HANDLE_VALUE)
+          throw C6::CreateFileException(filename);
+      }
+
+      FileSink(const char* filename)
+      {
+        m_file = CreateFileA(filename, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, 0, nullptr);
+        if(m_file == INVALID_HANDLE_VALUE)
+          throw C6::COMException(HRESULT_FROM_WIN32(GetLastError()), "CreateFile");
+      }
+
+      ~FileSink()
+      {
+        CloseHandle(m_file);
+      }
+
+      void write(const uint8_t* data, size_t length) override
+      {
+        while(length)
+        {
+          DWORD piece = static_cast<DWORD>(length < max_write_size ? length : max_write_size);
+          DWORD num_written;
+          if(!WriteFile(m_file, data, piece, &num_written, nullptr) || num_written != piece)
+            throw C6::COMException(HRESULT_FROM_WIN32(GetLastError()), "WriteFile");
+          data += piece;
+          length -= piece;
+        }
+      }
+
+    private:
+      HANDLE m_file;
+    };
+#else
+    class FileSink : public ChunkySink
+    {
+    public:
+      FileSink(const char* filename)
+      {
+        m_fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if(m_fd < 0)
+          throw std::runtime_error(std::string("Cannot create file `") + filename + "': " + strerror(errno));
+      }
+
+      ~FileSink()
+      {
+        close(m_fd);
+      }
+
+      void write(const uint8_t* data, size_t length) override
+      {
+        while(length)
+        {
+          auto num_written = ::write(m_fd, data, length < max_write_size ? length : max_write_size);
+          if(num_written < 0)
+          {
+            if(errno == EINTR)
+              continue;
+            throw std::runtime_error(std::string("write: ") + strerror(errno));
+          }
+          data += num_written;
+          length -= static_cast<size_t>(num_written);
+        }
+      }
+
+    private:
+      int m_fd;
+    };
+#endif
+  }
+
+  std::unique_ptr<ChunkySink> CreateFileSinkA(const char* filename)
+  {
+    return std::unique_ptr<ChunkySink>(new FileSink(filename));
+  }
+
+  std::unique_ptr<ChunkySink> CreateFileSinkW(const wchar_t* filename)
+  {
+#ifdef _WIN32
+    return std::unique_ptr<ChunkySink>(new FileSink(filename));
+#else
+    auto len = wcstombs(nullptr, filename, 0);
+    if(len == static_cast<size_t>(-1))
+      throw std::runtime_error("Cannot convert file name to the native encoding.");
+    std::string narrow(len, '\0');
+    wcstombs(&narrow[0], filename, len);
+    return std::unique_ptr<ChunkySink>(new FileSink(narrow.c_str()));
+#endif
+  }
+
   ChunkyWriter::ChunkyWriter(const wchar_t* filename)
+    : m_sink(CreateFileSinkW(filename))
   {
-    m_file = CreateFileW(filename, GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, 0, nullptr);
-    if(m_file == INVALID_HANDLE_VALUE)
-      throw C6::CreateFileException(filename);
+    writeFileHeader();
+  }
+
+  ChunkyWriter::ChunkyWriter(const char* filename)
+    : m_sink(CreateFileSinkA(filename))
+  {
+    writeFileHeader();
+  }
+
+  ChunkyWriter::ChunkyWriter(std::unique_ptr<ChunkySink> sink)
+    : m_sink(std::move(sink))
+  {
+    writeFileHeader();
+  }
+
+  void ChunkyWriter::writeFileHeader()
+  {
+    m_position = 0;
     m_innermost_chunk_length_field_offset = 0;
 
     const char header[] = "Relic Chunky\x0D\x0A\x1A\x00\x03\x00\x00\x00\x01\x00\x00\x00\x24\x00\x00\x00\x1C\x00\x00\x00\x01\x00\x00";
-    DWORD num_written;
-    if(!WriteFile(m_file, header, sizeof(header), &num_written, nullptr) || num_written != sizeof(header))
-    {
-      CloseHandle(m_file);
-      throw C6::COMException(HRESULT_FROM_WIN32(GetLastError()), "WriteFile");
-    }
+    payload(reinterpret_cast<const uint8_t*>(header), sizeof(header));
   }
 
-  ChunkyWriter::~ChunkyWriter()
+  void ChunkyWriter::finish()
   {
     while(m_innermost_chunk_length_field_offset)
       endChunk();
 
-    CloseHandle(m_file);
+    auto sink = std::move(m_sink);
+    if(sink && !m_buffer.empty())
+      sink->write(m_buffer.data(), m_buffer.size());
   }
 
   void ChunkyWriter::beginChunk(const char (&kind_type)[9], uint32_t version, const char* name)
   {
     payload(reinterpret_cast<const uint8_t*>(kind_type), 8);
     uint32_t name_len = name ? static_cast<uint32_t>(strlen(name) + 1) : 0;
+    // Until endChunk, the length field holds the length field offset of the enclosing chunk.
     const uint32_t fields[] = {version, m_innermost_chunk_length_field_offset, name_len, ~static_cast<uint32_t>(0), 0};
     m_innermost_chunk_length_field_offset = tell() + 4;
     payload(reinterpret_cast<const uint8_t*>(fields), sizeof(fields));
+    if(name_len)
+      payload(reinterpret_cast<const uint8_t*>(name), name_len);
   }
 
   void ChunkyWriter::payload(const uint8_t* data, uint32_t length)
   {
-    DWORD num_written;
-    if(!WriteFile(m_file, data, length, &num_written, nullptr) || length != num_written)
-      throw C6::COMException(HRESULT_FROM_WIN32(GetLastError()), "WriteFile");
-  }
-
-  uint32_t ChunkyWriter::tell()
-  {
-    return SetFilePointer(m_file, 0, nullptr, FILE_CURRENT);
+    if(m_position == m_buffer.size())
+    {
+      m_buffer.insert(m_buffer.end(), data, data + length);
+    }
+    else
+    {
+      if(m_position + length > m_buffer.size())
+        m_buffer.resize(m_position + length);
+      memcpy(m_buffer.data() + m_position, data, length);
+    }
+    m_position += length;
   }
 
   void ChunkyWriter::seekTo(uint32_t position)
   {
-    SetFilePointer(m_file, position, nullptr, FILE_BEGIN);
-  }
-
-  void ChunkyWriter::seekToEnd()
-  {
-    SetFilePointer(m_file, 0, nullptr, FILE_END);
+    if(position > m_buffer.size())
+      throw std::runtime_error("Cannot seek past the end of a chunky file.");
+    m_position = position;
   }
 
   void ChunkyWriter::endChunk()
   {
-    DWORD end_of_data = tell();
-
+    auto field = m_buffer.data() + m_innermost_chunk_length_field_offset;
     uint32_t fields[2];
-    DWORD num_read;
-    seekTo(m_innermost_chunk_length_field_offset);
-    if(!ReadFile(m_file, fields, sizeof(fields), &num_read, nullptr) || sizeof(fields) != num_read)
-      throw C6::COMException(HRESULT_FROM_WIN32(GetLastError()), "ReadFile");
+    memcpy(fields, field, sizeof(fields));
 
     uint32_t start_of_data = m_innermost_chunk_length_field_offset + fields[1] + 16;
-    uint32_t length = end_of_data - start_of_data;
-    seekTo(m_innermost_chunk_length_field_offset);
-    payload(reinterpret_cast<const uint8_t*>(&length), 4);
+    uint32_t length = static_cast<uint32_t>(m_buffer.size()) - start_of_data;
+    memcpy(field, &length, sizeof(length));
 
     m_innermost_chunk_length_field_offset = fields[0];
     seekToEnd();
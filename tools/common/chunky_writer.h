@@ -1,21 +1,50 @@
 #pragma once
 #include <stdint.h>
+#include <stddef.h>
+#include <memory>
+#include <vector>
 
 namespace Essence
 {
+  //! Destination for the bytes of a ChunkyWriter.
+  class ChunkySink
+  {
+  public:
+    virtual ~ChunkySink() {}
+
+    //! Append the next piece of the file; pieces are delivered in order, and are usually large.
+    virtual void write(const uint8_t* data, size_t length) = 0;
+  };
+
+  //! A sink which creates (or truncates) the named file, and writes straight to it.
+  std::unique_ptr<ChunkySink> CreateFileSinkA(const char* filename);
+  std::unique_ptr<ChunkySink> CreateFileSinkW(const wchar_t* filename);
+
+  //! Utility class for writing a Relic Chunky file.
+  /*!
+    The file is assembled in memory: endChunk patches the length of the chunk in place, and
+    seekTo merely moves the write position, so none of the methods below make any system calls.
+    The finished file is given to the sink by finish in as few writes as possible. finish must
+    be called explicitly: if it is not (e.g. because an exception is propagating), the half-built
+    file is discarded, as it is of no use to anyone, and destructors cannot report write errors.
+  */
   class ChunkyWriter
   {
   public:
     ChunkyWriter(const wchar_t* filename);
-    ~ChunkyWriter();
+    ChunkyWriter(const char* filename);
+    ChunkyWriter(std::unique_ptr<ChunkySink> sink);
 
     void beginChunk(const char (&kind_type)[9], uint32_t version, const char* name = nullptr);
     void payload(const uint8_t* data, uint32_t length);
-    uint32_t tell();
+    uint32_t tell() const { return static_cast<uint32_t>(m_position); }
     void seekTo(uint32_t position);
-    void seekToEnd();
+    void seekToEnd() { m_position = m_buffer.size(); }
     void endChunk();
 
+    //! End every open chunk, and write the file to the sink.
+    void finish();
+
     template <typename T, size_t N>
     void payload(const T (&data)[N])
     {
@@ -31,7 +60,14 @@ namespace Essence
     }
 
   private:
-    void* m_file;
+    ChunkyWriter(const ChunkyWriter& cannot_copy);
+    ChunkyWriter& operator= (const ChunkyWriter& cannot_copy);
+
+    void writeFileHeader();
+
+    std::unique_ptr<ChunkySink> m_sink; //!< nullptr once finished.
+    std::vector<uint8_t> m_buffer;
+    size_t m_position;
     uint32_t m_innermost_chunk_length_field_offset;
   };
 }
@@ -0,0 +1,1144 @@
+﻿#include "../../../source/arena.h"
+#include "../../../source/chunky.h"
+#include "../../../source/concurrent_arena.h"
+#include "../../../source/entry_cache.h"
+#include "../../../source/fs.h"
+#include "../../../source/hash.h"
+#include "../../../source/mappable.h"
+#include "../../../source/range_reader.h"
+#include "../../../source/stopwatch.h"
+#include "../../../source/thread_pool.h"
+#include "../../../source/zlib.h"
+#include "../../common/chunky_writer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if defined(__has_include)
+#if __has_include(<memory_resource>) && (__cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L))
+#include <memory_resource>
+#define HAVE_MEMORY_RESOURCE
+#endif
+#endif
+
+using namespace std;
+
+namespace
+{
+#include "../../../source/fs_archive_structs.h"
+}
+
+////////// Harness //////////
+
+struct BenchOptions
+{
+  BenchOptions()
+    : filter(nullptr)
+    , min_seconds(0.25)
+  {
+  }
+
+  const char* filter;
+  double min_seconds;
+};
+
+// Results are accumulated here so that the optimiser cannot discard the work being measured.
+static volatile uint32_t g_sink;
+
+//! Run op repeatedly for at least opts.min_seconds, and print one tab-separated result line.
+static void Run(const BenchOptions& opts, const char* name, const string& param, uint64_t bytes_per_op, const function<void()>& op)
+{
+  if(opts.filter && !strstr(name, opts.filter))
+    return;
+
+  op(); // Warm up caches and lazily-initialised state.
+  uint64_t iterations = 0;
+  uint64_t batch = 1;
+  double seconds;
+  Stopwatch timer;
+  do
+  {
+    for(uint64_t i = 0; i < batch; ++i)
+      op();
+    iterations += batch;
+    batch *= 2;
+    seconds = timer.elapsedSeconds();
+  } while(seconds < opts.min_seconds);
+
+  double ns_per_op = seconds * 1e9 / static_cast<double>(iterations);
+  double mb_per_second = bytes_per_op ? (static_cast<double>(bytes_per_op) * iterations) / (seconds * 1024. * 1024.) : 0.;
+  printf("%s\t%s\t%llu\t%.2f\t%.1f\n", name, param.c_str(), static_cast<unsigned long long>(iterations), ns_per_op, mb_per_second);
+  fflush(stdout);
+}
+
+static string Format(const char* format, unsigned value)
+{
+  char buffer[64];
+  sprintf(buffer, format, value);
+  return buffer;
+}
+
+////////// Fixtures //////////
+
+//! A MappableFile over a buffer in memory.
+class MemoryFile : public MappableFile
+{
+public:
+  MemoryFile(shared_ptr<const vector<uint8_t>> contents)
+    : m_contents(move(contents))
+  {
+    m_size = m_contents->size();
+  }
+
+  MappedMemory map(uint64_t offset_begin, uint64_t offset_end, AccessPattern::E) override
+  {
+    if(offset_begin > offset_end || offset_end > m_size)
+      throw runtime_error("Invalid range for mapping.");
+    auto base = m_contents->data();
+    return MappedMemory(base + offset_begin, base + offset_end);
+  }
+
+private:
+  shared_ptr<const vector<uint8_t>> m_contents;
+};
+
+//! A FileSource holding a single directory of files in memory.
+class MemoryFileSource : public Essence::FileSource
+{
+public:
+  MemoryFileSource(string dir)
+    : m_dir(move(dir))
+  {
+  }
+
+  void add(const string& name, vector<uint8_t> contents)
+  {
+    m_files.push_back(make_pair(name, make_shared<const vector<uint8_t>>(move(contents))));
+  }
+
+  unique_ptr<MappableFile> readFile(const string& path) override
+  {
+    for(auto& file : m_files)
+    {
+      if(path == m_dir + '\\' + file.first)
+        return unique_ptr<MappableFile>(new MemoryFile(file.second));
+    }
+    return nullptr;
+  }
+
+  void getFiles(const string& path, vector<string>& files) override
+  {
+    if(path == m_dir)
+    {
+      for(auto& file : m_files)
+        files.push_back(file.first);
+    }
+  }
+
+  void getDirs(const string& path, vector<string>& dirs) override
+  {
+    if(path.empty())
+      dirs.push_back(m_dir);
+  }
+
+private:
+  string m_dir;
+  vector<pair<string, shared_ptr<const vector<uint8_t>>>> m_files;
+};
+
+//! Ask the OS to drop a file from its page cache, so that the next read of it comes from disk.
+/*!
+  This is best-effort: pages which are mapped at the time are kept, and Windows only purges the
+  cache of a file when it is opened unbuffered with no other handles open.
+*/
+static void EvictFromPageCache(const char* path)
+{
+#ifdef _WIN32
+  auto file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_NO_BUFFERING, nullptr);
+  if(file != INVALID_HANDLE_VALUE)
+    CloseHandle(file);
+#else
+  auto fd = open(path, O_RDONLY | O_CLOEXEC);
+  if(fd >= 0)
+  {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+  }
+#endif
+}
+
+template <typename T>
+static void Append(vector<uint8_t>& out, const T& value)
+{
+  auto bytes = reinterpret_cast<const uint8_t*>(&value);
+  out.insert(out.end(), bytes, bytes + sizeof(T));
+}
+
+static vector<uint8_t> MakeCompressibleData(size_t size)
+{
+  vector<uint8_t> data(size);
+  for(size_t i = 0; i < size; ++i)
+    data[i] = static_cast<uint8_t>("The quick brown fox jumps over the lazy dog. "[i % 45] ^ ((i / 4096) & 1));
+  return data;
+}
+
+static vector<uint8_t> MakeRandomData(size_t size, uint32_t seed)
+{
+  vector<uint8_t> data(size);
+  for(size_t i = 0; i < size; ++i)
+  {
+    seed = seed * 1664525U + 1013904223U;
+    data[i] = static_cast<uint8_t>(seed >> 24);
+  }
+  return data;
+}
+
+//! Generate a version 6 SGA archive.
+/*!
+  The layout is:
+    data\\f00000.dat ... data\\f<num_files - 1>.dat   (16 bytes each, stored)
+    data\\stored.bin                                  (payload_size random bytes, stored)
+    data\\compressed.bin                              (payload_size compressible bytes, deflated)
+    data\\sub000\\ ... data\\sub<num_subdirs - 1>\\     (empty)
+*/
+static shared_ptr<const vector<uint8_t>> BuildArchive(unsigned num_files, unsigned num_subdirs, uint32_t payload_size)
+{
+  struct pending_file_t
+  {
+    string name;
+    vector<uint8_t> stored;
+    uint32_t data_length;
+  };
+  vector<pending_file_t> files;
+  for(unsigned i = 0; i < num_files; ++i)
+  {
+    pending_file_t file = {Format("f%05u.dat", i), MakeRandomData(16, i), 16};
+    files.push_back(move(file));
+  }
+  {
+    pending_file_t file = {"stored.bin", MakeRandomData(payload_size, 12345), payload_size};
+    files.push_back(move(file));
+  }
+  {
+    auto raw = MakeCompressibleData(payload_size);
+    uLongf compressed_size = compressBound(static_cast<uLong>(raw.size()));
+    vector<uint8_t> compressed(compressed_size);
+    if(compress2(compressed.data(), &compressed_size, raw.data(), static_cast<uLong>(raw.size()), Z_BEST_COMPRESSION) != Z_OK)
+      throw runtime_error("Could not deflate benchmark data.");
+    compressed.resize(compressed_size);
+    pending_file_t file = {"compressed.bin", move(compressed), payload_size};
+    files.push_back(move(file));
+  }
+
+  // Directory names are full paths, and every directory's children must be contiguous.
+  vector<string> dir_names;
+  dir_names.push_back("");
+  dir_names.push_back("data");
+  for(unsigned i = 0; i < num_subdirs; ++i)
+    dir_names.push_back(Format("data\\sub%03u", i));
+
+  vector<uint8_t> strings;
+  vector<uint32_t> dir_name_offsets, file_name_offsets;
+  for(auto& name : dir_names)
+  {
+    dir_name_offsets.push_back(static_cast<uint32_t>(strings.size()));
+    strings.insert(strings.end(), name.c_str(), name.c_str() + name.size() + 1);
+  }
+  for(auto& file : files)
+  {
+    file_name_offsets.push_back(static_cast<uint32_t>(strings.size()));
+    strings.insert(strings.end(), file.name.c_str(), file.name.c_str() + file.name.size() + 1);
+  }
+
+  data_header_t<6> data_header;
+  memset(&data_header, 0, sizeof(data_header));
+  data_header.directory_offset = sizeof(data_header);
+  data_header.directory_count = static_cast<uint32_t>(dir_names.size());
+  data_header.file_offset = data_header.directory_offset + data_header.directory_count * sizeof(directory_t<6>);
+  data_header.file_count = static_cast<uint32_t>(files.size());
+  data_header.strings_offset = data_header.file_offset + data_header.file_count * sizeof(file_t<6>);
+  data_header.strings_count = static_cast<uint32_t>(dir_names.size() + files.size());
+
+  file_header_t<6> file_header;
+  memset(&file_header, 0, sizeof(file_header));
+  memcpy(file_header.signature, "_ARCHIVE", 8);
+  file_header.version = 6;
+  file_header.data_header_size = data_header.strings_offset + static_cast<uint32_t>(strings.size());
+  file_header.data_offset = sizeof(file_header) + file_header.data_header_size;
+  file_header.platform = 1;
+
+  auto out = make_shared<vector<uint8_t>>();
+  Append(*out, file_header);
+  Append(*out, data_header);
+  for(uint32_t i = 0; i < data_header.directory_count; ++i)
+  {
+    directory_t<6> dir;
+    memset(&dir, 0, sizeof(dir));
+    dir.name_offset = dir_name_offsets[i];
+    if(i == 0)
+    {
+      dir.first_directory = 1;
+      dir.last_directory = 2;
+    }
+    else if(i == 1)
+    {
+      dir.first_directory = 2;
+      dir.last_directory = data_header.directory_count;
+      dir.first_file = 0;
+      dir.last_file = data_header.file_count;
+    }
+    Append(*out, dir);
+  }
+  uint32_t data_offset = 0;
+  for(uint32_t i = 0; i < data_header.file_count; ++i)
+  {
+    file_t<6> file;
+    memset(&file, 0, sizeof(file));
+    file.name_offset = file_name_offsets[i];
+    file.data_offset = data_offset;
+    file.data_length_compressed = static_cast<uint32_t>(files[i].stored.size());
+    file.data_length = files[i].data_length;
+    Append(*out, file);
+    data_offset += file.data_length_compressed;
+  }
+  out->insert(out->end(), strings.begin(), strings.end());
+  for(auto& file : files)
+    out->insert(out->end(), file.stored.begin(), file.stored.end());
+  return out;
+}
+
+class ChunkyBuilder
+{
+public:
+  void beginChunk(const char* kind_and_type, uint32_t version)
+  {
+    m_open_chunks.push_back(m_data.size());
+    m_data.insert(m_data.end(), kind_and_type, kind_and_type + 8);
+    uint32_t header_rest[] = {version, 0, 0, 0, 0}; // version, size, name size, unknown[2]
+    Append(m_data, header_rest);
+  }
+
+  void payload(const void* data, size_t size)
+  {
+    auto bytes = static_cast<const uint8_t*>(data);
+    m_data.insert(m_data.end(), bytes, bytes + size);
+  }
+
+  void endChunk()
+  {
+    auto begin = m_open_chunks.back();
+    m_open_chunks.pop_back();
+    uint32_t size = static_cast<uint32_t>(m_data.size() - begin - 28);
+    memcpy(m_data.data() + begin + 12, &size, sizeof(size));
+  }
+
+  shared_ptr<const vector<uint8_t>> finish()
+  {
+    auto out = make_shared<vector<uint8_t>>();
+    out->insert(out->end(), "Relic Chunky\x0D\x0A\x1A\0", "Relic Chunky\x0D\x0A\x1A\0" + 16);
+    uint32_t header_rest[] = {3, 1, 28}; // version, unknown, data offset
+    Append(*out, header_rest);
+    out->insert(out->end(), m_data.begin(), m_data.end());
+    return out;
+  }
+
+private:
+  vector<uint8_t> m_data;
+  vector<size_t> m_open_chunks;
+};
+
+//! Generate a chunky file in which every level holds width DATAJUNK chunks and then one FOLDNEST.
+/*!
+  The innermost FOLDNEST holds a single DATATARG.
+*/
+static shared_ptr<const vector<uint8_t>> BuildChunky(unsigned depth, unsigned width)
+{
+  ChunkyBuilder cb;
+  const uint8_t junk[16] = {0};
+  for(unsigned level = 0; level < depth; ++level)
+  {
+    cb.beginChunk("FOLDNEST", 1);
+    for(unsigned i = 0; i < width; ++i)
+    {
+      cb.beginChunk("DATAJUNK", 1);
+      cb.payload(junk, sizeof(junk));
+      cb.endChunk();
+    }
+  }
+  cb.beginChunk("DATATARG", 2);
+  cb.payload(junk, sizeof(junk));
+  cb.endChunk();
+  for(unsigned level = 0; level < depth; ++level)
+    cb.endChunk();
+  return cb.finish();
+}
+
+////////// Benchmarks //////////
+
+static void BenchHash(const BenchOptions& opts)
+{
+  auto data = MakeRandomData(4096, 1);
+  const uint32_t lengths[] = {4, 16, 64, 256, 1024, 4096};
+  for(auto length : lengths)
+  {
+    Run(opts, "hash", Format("len=%u", length), length, [&] {
+      g_sink = g_sink + Essence::Hash(data.data(), length);
+    });
+  }
+
+#ifdef ESSENCE_CONSTEXPR_HASH
+  for(uint32_t length = 0; length <= 300; ++length)
+  {
+    auto key = reinterpret_cast<const char*>(data.data()) + length % 16;
+    if(Essence::ConstHash(key, length, length) != Essence::Hash(key, length, length))
+      throw runtime_error("ConstHash differs from Hash for a key of length " + Format("%u", length));
+  }
+#endif
+  Run(opts, "hashable.literal", "g_desaturation", 0, [&] {
+    g_sink = g_sink + Essence::Hashable("g_desaturation").getHash();
+  });
+
+  // HashBatch must agree with Hash bit for bit, for every length and alignment, before it is timed.
+  const uint32_t num_keys = 1024;
+  vector<const uint8_t*> keys(num_keys);
+  vector<uint32_t> key_lengths(num_keys), expected(num_keys), actual(num_keys);
+  for(uint32_t i = 0; i < num_keys; ++i)
+  {
+    keys[i] = data.data() + (i * 7) % 64;
+    key_lengths[i] = (i * 37) % 301;
+    expected[i] = Essence::Hash(keys[i], key_lengths[i], 0x5EED);
+  }
+  const Essence::HashBatchBackend::E backends[] = {Essence::HashBatchBackend::Scalar, Essence::HashBatchBackend::SSE2, Essence::HashBatchBackend::AVX2};
+  for(auto backend : backends)
+  {
+    if(!Essence::IsHashBatchBackendSupported(backend))
+      continue;
+    for(uint32_t i = 0; i < num_keys; ++i)
+      Essence::HashBatch(keys.data() + i, key_lengths.data() + i, actual.data() + i, 1, 0x5EED, backend);
+    for(uint32_t i = 0; i < num_keys; i += 2)
+      Essence::HashBatch(keys.data() + i, key_lengths.data() + i, actual.data() + i, min(num_keys - i, (i % 19) + 2), 0x5EED, backend);
+    for(uint32_t i = 0; i < num_keys; ++i)
+    {
+      if(actual[i] != expected[i])
+        throw runtime_error(string("HashBatch (") + Essence::GetHashBatchBackendName(backend) + ") differs from Hash for a key of length " + Format("%u", key_lengths[i]));
+    }
+  }
+
+  // Index building hashes full paths, which are mostly a few dozen bytes long.
+  const uint32_t batch_lengths[] = {16, 48, 128};
+  for(auto length : batch_lengths)
+  {
+    for(uint32_t i = 0; i < num_keys; ++i)
+    {
+      keys[i] = data.data() + (i * 13) % 512;
+      key_lengths[i] = length;
+    }
+    for(auto backend : backends)
+    {
+      if(!Essence::IsHashBatchBackendSupported(backend))
+        continue;
+      Run(opts, "hash_batch", string(Essence::GetHashBatchBackendName(backend)) + Format(",len=%u", length) + Format(",keys=%u", num_keys), length * num_keys, [&] {
+        Essence::HashBatch(keys.data(), key_lengths.data(), actual.data(), num_keys, 0, backend);
+        g_sink = g_sink + actual[0];
+      });
+    }
+  }
+}
+
+static void BenchArchive(const BenchOptions& opts)
+{
+  const unsigned num_files = 4096;
+  const unsigned num_subdirs = 256;
+  const uint32_t payload_size = 256 * 1024;
+  Arena arena("bench.archive");
+  auto archive = BuildArchive(num_files, num_subdirs, payload_size);
+  auto fs = Essence::CreateArchiveFileSource(&arena, unique_ptr<MappableFile>(new MemoryFile(archive)));
+
+  vector<string> dir_hits, dir_misses, file_hits, file_misses;
+  for(unsigned i = 0; i < num_subdirs; ++i)
+  {
+    dir_hits.push_back(Format("data\\sub%03u", i));
+    dir_misses.push_back(Format("data\\nil%03u", i));
+  }
+  for(unsigned i = 0; i < num_files; ++i)
+  {
+    file_hits.push_back(Format("data\\f%05u.dat", i));
+    file_misses.push_back(Format("data\\g%05u.dat", i));
+  }
+
+  size_t next = 0;
+  vector<string> names;
+  Run(opts, "archive.dir_lookup", "hit", 0, [&] {
+    fs->getDirs(dir_hits[next++ % dir_hits.size()], names);
+  });
+  Run(opts, "archive.dir_lookup", "miss", 0, [&] {
+    fs->getDirs(dir_misses[next++ % dir_misses.size()], names);
+  });
+  Run(opts, "archive.file_lookup", Format("hit,dir_size=%u", num_files + 2), 0, [&] {
+    g_sink = g_sink + (fs->readFile(file_hits[next++ % file_hits.size()]) != nullptr);
+  });
+  Run(opts, "archive.file_lookup", Format("miss,dir_size=%u", num_files + 2), 0, [&] {
+    g_sink = g_sink + (fs->readFile(file_misses[next++ % file_misses.size()]) != nullptr);
+  });
+
+  auto read_all = [&](const char* path) {
+    auto file = fs->readFile(path);
+    auto contents = file->mapAll();
+    g_sink = g_sink + contents.begin[contents.size() - 1];
+  };
+  auto budget = EntryCache::global().getStats().budget;
+  EntryCache::global().setBudget(0);
+  Run(opts, "archive.read", Format("stored,size=%u", payload_size), payload_size, [&] { read_all("data\\stored.bin"); });
+  Run(opts, "archive.read", Format("compressed,size=%u", payload_size), payload_size, [&] { read_all("data\\compressed.bin"); });
+  EntryCache::global().setBudget(budget);
+  Run(opts, "archive.read", Format("compressed_cached,size=%u", payload_size), payload_size, [&] { read_all("data\\compressed.bin"); });
+}
+
+//! Check that two FileSources hold the same directories and files beneath a path.
+static void CheckSameContents(Essence::FileSource* expected, Essence::FileSource* actual, const string& path)
+{
+  vector<string> expected_names, actual_names;
+  expected->getFiles(path, expected_names);
+  actual->getFiles(path, actual_names);
+  sort(expected_names.begin(), expected_names.end());
+  if(expected_names != actual_names)
+    throw runtime_error("Written archive has different files in `" + path + "'");
+  for(auto& name : expected_names)
+  {
+    auto full_path = path.empty() ? name : path + '\\' + name;
+    auto expected_contents = expected->readFile(full_path)->mapAll();
+    auto actual_contents = actual->readFile(full_path)->mapAll();
+    if(expected_contents.size() != actual_contents.size() || !equal(expected_contents.begin, expected_contents.end, actual_contents.begin))
+      throw runtime_error("Written archive has different contents for `" + full_path + "'");
+  }
+
+  expected_names.clear();
+  actual_names.clear();
+  expected->getDirs(path, expected_names);
+  actual->getDirs(path, actual_names);
+  sort(expected_names.begin(), expected_names.end());
+  if(expected_names != actual_names)
+    throw runtime_error("Written archive has different directories in `" + path + "'");
+  for(auto& name : expected_names)
+    CheckSameContents(expected, actual, path.empty() ? name : path + '\\' + name);
+}
+
+static vector<uint8_t> ReadPhysicalFile(const char* path)
+{
+  auto contents = MapPhysicalFileA(path)->mapAll();
+  return vector<uint8_t>(contents.begin, contents.end);
+}
+
+static void BenchArchiveWriter(const BenchOptions& opts)
+{
+  const unsigned num_files = 1024;
+  const uint32_t payload_size = 4 * 1024 * 1024;
+  Arena arena("bench.archive_writer");
+  auto source = Essence::CreateArchiveFileSource(&arena, unique_ptr<MappableFile>(new MemoryFile(BuildArchive(num_files, 16, payload_size))));
+  const char* filename = "essence_bench_archive.tmp";
+  const char* filename_mt = "essence_bench_archive_mt.tmp";
+
+  // Round trip every version which can be written, and check that the output does not depend
+  // upon the number of threads.
+  const uint32_t versions[] = {4, 6, 7, 9};
+  for(auto version : versions)
+  {
+    Essence::ArchiveWriteOptions options;
+    options.version = version;
+    options.archive_name = "essence_bench";
+    options.block_size = payload_size / 16;
+    options.num_threads = 1;
+    Essence::ArchiveWriteReport write_report;
+    Essence::WriteArchive(source, "", filename, options, &write_report);
+    if((write_report.num_files_blocked != 0) != (version >= 9))
+      throw runtime_error(Format("Archive v%u has an unexpected number of block-compressed files.", version));
+    options.num_threads = 4;
+    Essence::WriteArchive(source, "", filename_mt, options);
+    if(ReadPhysicalFile(filename) != ReadPhysicalFile(filename_mt))
+      throw runtime_error(Format("Archive v%u differs depending on the number of threads.", version));
+
+    Arena check_arena("bench.archive_writer_check");
+    auto written = Essence::CreateArchiveFileSource(&check_arena, MapPhysicalFileA(filename));
+    CheckSameContents(source, written, "");
+    Essence::VerifyReport report;
+    if(!written->verify(report) || !report.failures.empty())
+      throw runtime_error(Format("Written archive v%u fails verification.", version));
+  }
+
+  // Block-compressed files are inflated across threads, whereas a single stream cannot be.
+  {
+    Essence::ArchiveWriteOptions options;
+    options.version = 9;
+    options.block_size = payload_size / 16;
+    Essence::WriteArchive(source, "", filename, options);
+    Arena read_arena("bench.archive_writer_read");
+    auto written = Essence::CreateArchiveFileSource(&read_arena, MapPhysicalFileA(filename));
+    auto budget = EntryCache::global().getStats().budget;
+    EntryCache::global().setBudget(0);
+    Run(opts, "archive.read", Format("blocks,size=%u", payload_size), payload_size, [&] {
+      auto contents = written->readFile("data\\compressed.bin")->mapAll();
+      g_sink = g_sink + contents.begin[contents.size() - 1];
+    });
+    EntryCache::global().setBudget(budget);
+  }
+
+  uint64_t num_bytes_in = 0;
+  {
+    Essence::ArchiveWriteReport report;
+    Essence::WriteArchive(source, "", filename, Essence::ArchiveWriteOptions(), &report);
+    num_bytes_in = report.num_bytes_in;
+  }
+  const unsigned thread_counts[] = {1, 0};
+  for(auto num_threads : thread_counts)
+  {
+    Essence::ArchiveWriteOptions options;
+    options.num_threads = num_threads;
+    Run(opts, "archive.write", Format("threads=%u", num_threads), num_bytes_in, [&] {
+      Essence::WriteArchive(source, "", filename, options);
+    });
+  }
+  remove(filename);
+  remove(filename_mt);
+}
+
+static void BenchBatchedReads(const BenchOptions& opts)
+{
+  if(opts.filter && !strstr("archive.read_batch", opts.filter))
+    return;
+
+  // A model's worth of files (meshes, then textures) as they would be listed: nowhere near the
+  // order in which they lie within the archive.
+  const unsigned num_files = 512;
+  const uint32_t file_size = 128 * 1024;
+  MemoryFileSource source("data");
+  for(unsigned i = 0; i < num_files; ++i)
+    source.add(Format("f%05u.dat", i), i % 2 ? MakeCompressibleData(file_size) : MakeRandomData(file_size, i));
+  const char* filename = "essence_bench_read_batch.tmp";
+  Essence::WriteArchive(&source, "", filename, Essence::ArchiveWriteOptions());
+
+  vector<string> paths;
+  uint32_t seed = 12345;
+  for(unsigned i = 0; i < num_files; i += 4)
+  {
+    seed = seed * 1664525U + 1013904223U;
+    paths.push_back(Format("data\\f%05u.dat", seed % num_files));
+  }
+  const uint64_t bytes_per_op = static_cast<uint64_t>(paths.size()) * file_size;
+
+  {
+    Arena arena("bench.read_batch");
+    auto archive = Essence::CreateArchiveFileSource(&arena, MapPhysicalFileA(filename));
+    auto consume = [&](unique_ptr<MappableFile> file) {
+      auto contents = file->mapAll();
+      g_sink = g_sink + contents.begin[contents.size() - 1];
+    };
+    auto list_order = [&] {
+      for(auto& path : paths)
+        consume(archive->readFile(path));
+    };
+    auto batched = [&] {
+      auto files = archive->readFiles(paths);
+      for(auto& file : files)
+        consume(move(file));
+    };
+
+    {
+      auto files = archive->readFiles(paths);
+      for(size_t i = 0; i < paths.size(); ++i)
+      {
+        auto expected = archive->readFile(paths[i])->mapAll();
+        auto actual = files[i]->mapAll();
+        if(expected.size() != actual.size() || !equal(expected.begin, expected.end, actual.begin))
+          throw runtime_error("readFiles and readFile disagree about " + paths[i] + ".");
+      }
+    }
+
+    auto budget = EntryCache::global().getStats().budget;
+    EntryCache::global().setBudget(0);
+    Run(opts, "archive.read_batch", "warm,list_order", bytes_per_op, list_order);
+    Run(opts, "archive.read_batch", "warm,batched", bytes_per_op, batched);
+
+    // Cold reads cannot go through Run, as the cache must be dropped before every iteration.
+    const unsigned cold_rounds = 5;
+    const char* modes[] = {"cold,list_order", "cold,batched"};
+    for(int mode = 0; mode < 2; ++mode)
+    {
+      double seconds = 0.;
+      for(unsigned round = 0; round < cold_rounds; ++round)
+      {
+        EvictFromPageCache(filename);
+        Stopwatch timer;
+        if(mode == 0)
+          list_order();
+        else
+          batched();
+        seconds += timer.elapsedSeconds();
+      }
+      printf("%s\t%s\t%u\t%.2f\t%.1f\n", "archive.read_batch", modes[mode], cold_rounds, seconds * 1e9 / cold_rounds,
+        (static_cast<double>(bytes_per_op) * cold_rounds) / (seconds * 1024. * 1024.));
+      fflush(stdout);
+    }
+    EntryCache::global().setBudget(budget);
+  }
+  remove(filename);
+}
+
+//! Extraction discards every file, so that only reading and inflating are measured.
+class NullExtractionSink : public Essence::ExtractionSink
+{
+public:
+  NullExtractionSink()
+    : m_sum(0)
+  {
+  }
+
+  ~NullExtractionSink()
+  {
+    g_sink = g_sink + m_sum.load();
+  }
+
+  //! Called concurrently by the extraction workers, so this must not serialise them.
+  void onFile(const string&, const uint8_t* data, size_t size) override
+  {
+    if(size)
+      m_sum.fetch_add(data[size - 1], memory_order_relaxed);
+  }
+
+private:
+  atomic<uint32_t> m_sum;
+};
+
+static void BenchRangeReaders(const BenchOptions& opts)
+{
+  if(opts.filter && !strstr("archive.extract", opts.filter) && !strstr("archive.verify", opts.filter))
+    return;
+
+  const unsigned num_files = 256;
+  const uint32_t file_size = 512 * 1024;
+  MemoryFileSource source("data");
+  for(unsigned i = 0; i < num_files; ++i)
+    source.add(Format("f%05u.dat", i), i % 2 ? MakeCompressibleData(file_size) : MakeRandomData(file_size, i));
+  const char* filename = "essence_bench_extract.tmp";
+  const uint64_t bytes_per_op = static_cast<uint64_t>(num_files) * file_size;
+
+  // v6 archives have per-file CRCs, so that verify also reads through a RangeReader.
+  Essence::WriteArchive(&source, "", filename, Essence::ArchiveWriteOptions());
+  vector<const char*> backends;
+  RangeReader::getBackendNames(backends);
+  auto budget = EntryCache::global().getStats().budget;
+  EntryCache::global().setBudget(0);
+  {
+    Arena arena("bench.extract");
+    auto archive = Essence::CreateArchiveFileSource(&arena, MapPhysicalFileA(filename));
+    uint64_t archive_size = 0;
+    for(auto backend : backends)
+    {
+      // Every backend must deliver exactly the bytes which a mapping would, once each.
+      auto file = MapPhysicalFileA(filename);
+      auto reader = RangeReader::create(backend, file.get());
+      if(!reader)
+        continue;
+      auto contents = file->mapAll();
+      archive_size = contents.size();
+      vector<RangeReader::range_t> ranges;
+      for(uint64_t offset = 0; offset < contents.size(); offset += 777777)
+      {
+        RangeReader::range_t range = {offset, min<uint64_t>(contents.size() - offset, 333333)};
+        ranges.push_back(range);
+      }
+      vector<int> seen(ranges.size());
+      reader->run(ranges.data(), ranges.size(), [&](size_t i, const uint8_t* data, size_t size, unsigned) {
+        if(size != ranges[i].size || memcmp(data, contents.begin + ranges[i].offset, size) != 0)
+          throw runtime_error(string("RangeReader backend ") + backend + " read the wrong bytes.");
+        ++seen[i];
+      });
+      if(count(seen.begin(), seen.end(), 1) != static_cast<ptrdiff_t>(seen.size()))
+        throw runtime_error(string("RangeReader backend ") + backend + " skipped or repeated a range.");
+      contents = nullptr;
+      reader.reset();
+      file.reset();
+
+      RangeReader::setPreferredBackend(backend);
+      Essence::VerifyReport report;
+      if(!archive->verify(report) || !report.failures.empty())
+        throw runtime_error(string("Archive fails verification with RangeReader backend ") + backend + ".");
+
+      NullExtractionSink sink;
+      auto extract = [&] { archive->extractAll(&sink); };
+      Run(opts, "archive.extract", string("warm,") + backend, bytes_per_op, extract);
+      Run(opts, "archive.verify", string("warm,") + backend, archive_size, [&] {
+        Essence::VerifyReport report;
+        archive->verify(report);
+      });
+
+      // As in BenchBatchedReads, the cache must be dropped before every cold iteration.
+      const unsigned cold_rounds = 5;
+      double seconds = 0.;
+      for(unsigned round = 0; round < cold_rounds; ++round)
+      {
+        EvictFromPageCache(filename);
+        Stopwatch timer;
+        extract();
+        seconds += timer.elapsedSeconds();
+      }
+      printf("%s\t%s\t%u\t%.2f\t%.1f\n", "archive.extract", (string("cold,") + backend).c_str(), cold_rounds, seconds * 1e9 / cold_rounds,
+        (static_cast<double>(bytes_per_op) * cold_rounds) / (seconds * 1024. * 1024.));
+      fflush(stdout);
+    }
+  }
+  RangeReader::setPreferredBackend(backends.front());
+  EntryCache::global().setBudget(budget);
+  remove(filename);
+}
+
+//! Check that every lookup through a ChunkIndex agrees with the equivalent linear lookup.
+static void CheckChunkIndex(const Essence::Chunk* parent, const Essence::ChunkIndex& index, Arena& scratch)
+{
+  static const char* const queries[] = {"", "FOLDNEST", "DATAJUNK", "DATATARG v2", "DATATARG v1", "NEST", "JU?K", "DATA????", "TARG v2"};
+  Arena::Scope scope(scratch);
+  for(auto query_string : queries)
+  {
+    auto query = Essence::ChunkQuery::Parse(query_string);
+    auto expected = parent->findAll(query, scratch);
+    auto actual = index.findAll(parent, query, scratch);
+    auto linear = parent->children(query);
+    auto indexed = index.children(parent, query);
+    if(parent->findFirst(query) != index.findFirst(parent, query) || expected.size() != actual.size()
+    || !equal(expected.begin(), expected.end(), actual.begin())
+    || static_cast<size_t>(distance(linear.begin(), linear.end())) != expected.size() || !equal(expected.begin(), expected.end(), linear.begin())
+    || static_cast<size_t>(distance(indexed.begin(), indexed.end())) != expected.size() || !equal(expected.begin(), expected.end(), indexed.begin()))
+      throw runtime_error(string("ChunkIndex disagrees with Chunk for query `") + query_string + "'");
+  }
+  for(auto child : parent->findAll("FOLD", scratch))
+    CheckChunkIndex(child, index, scratch);
+}
+
+//! Check that string literals are parsed into the same ChunkQuery at compile time as at runtime.
+static void CheckChunkQueries()
+{
+#define CHECK_QUERY(literal) \
+  { \
+    Essence::ChunkQuery compiled(literal), parsed = Essence::ChunkQuery::Parse(literal); \
+    if(compiled.isExactType() != parsed.isExactType() || compiled.getType() != parsed.getType() || compiled.getVersion() != parsed.getVersion() \
+    || compiled.hasKind() != parsed.hasKind() || compiled.hasVersion() != parsed.hasVersion()) \
+      throw runtime_error("ChunkQuery literal differs from ChunkQuery::Parse for `" literal "'"); \
+  }
+  CHECK_QUERY("")
+  CHECK_QUERY("FOLDDXTCv3")
+  CHECK_QUERY("DATAVAR v1")
+  CHECK_QUERY("DATAMSD? v2")
+  CHECK_QUERY("FOLDSPFI")
+  CHECK_QUERY("DATATARG v2")
+  CHECK_QUERY("JU?K")
+  CHECK_QUERY("DATA????")
+  CHECK_QUERY("TARG   v12")
+#undef CHECK_QUERY
+}
+
+static void BenchChunky(const BenchOptions& opts)
+{
+  CheckChunkQueries();
+  const unsigned shapes[][2] = {{4, 8}, {16, 64}, {64, 256}};
+  for(auto& shape : shapes)
+  {
+    auto depth = shape[0], width = shape[1];
+    auto chunky = Essence::ChunkyFile::Open(unique_ptr<MappableFile>(new MemoryFile(BuildChunky(depth, width))));
+    if(!chunky)
+      throw runtime_error("Could not open benchmark chunky file.");
+    auto top = chunky->findFirst("FOLDNEST");
+    auto param = Format("depth=%u", depth) + Format(",width=%u", width);
+
+    auto index = Essence::ChunkIndex::Build(chunky.get());
+    vector<uint8_t> saved;
+    index->save(saved);
+    auto loaded = Essence::ChunkIndex::Load(chunky.get(), saved.data(), saved.size());
+    Arena check_scratch("bench.chunky_check");
+    if(!loaded || Essence::ChunkIndex::Load(chunky.get(), saved.data(), saved.size() - 4))
+      throw runtime_error("ChunkIndex did not survive being saved and loaded.");
+    CheckChunkIndex(chunky.get(), *index, check_scratch);
+    CheckChunkIndex(chunky.get(), *loaded, check_scratch);
+
+    Run(opts, "chunky.find_first", param, 0, [&] {
+      g_sink = g_sink + (top->findFirst("FOLDNEST") != nullptr);
+    });
+    // The root has a single child, so these measure the cost of the query itself.
+    Run(opts, "chunky.query_literal", param, 0, [&] {
+      g_sink = g_sink + (chunky->findFirst("FOLDNEST v1") != nullptr);
+    });
+    const char* runtime_query = "FOLDNEST v1";
+    Run(opts, "chunky.query_parsed", param, 0, [&] {
+      g_sink = g_sink + (chunky->findFirst(Essence::ChunkQuery::Parse(runtime_query)) != nullptr);
+    });
+    Run(opts, "chunky.find_all", param, 0, [&] {
+      g_sink = g_sink + static_cast<uint32_t>(top->findAll("DATAJUNK").size());
+    });
+    Arena scratch("bench.chunky_scratch");
+    Run(opts, "chunky.find_all_arena", param, 0, [&] {
+      Arena::Scope scope(scratch);
+      g_sink = g_sink + top->findAll("DATAJUNK", scratch).size();
+    });
+    Run(opts, "chunky.children", param, 0, [&] {
+      auto junk = top->children("DATAJUNK");
+      g_sink = g_sink + static_cast<uint32_t>(distance(junk.begin(), junk.end()));
+    });
+    Run(opts, "chunky.walk", param, 0, [&] {
+      const Essence::Chunk* chunk = chunky.get();
+      for(unsigned level = 0; level < depth; ++level)
+        chunk = chunk->findFirst("FOLDNEST");
+      g_sink = g_sink + (chunk->findFirst("DATATARG v2") != nullptr);
+    });
+
+    Run(opts, "chunky_index.build", param, 0, [&] {
+      g_sink = g_sink + Essence::ChunkIndex::Build(chunky.get())->getNumChunks();
+    });
+    Run(opts, "chunky_index.load", param, saved.size(), [&] {
+      g_sink = g_sink + Essence::ChunkIndex::Load(chunky.get(), saved.data(), saved.size())->getNumChunks();
+    });
+    Run(opts, "chunky_index.find_first", param, 0, [&] {
+      g_sink = g_sink + (index->findFirst(top, "FOLDNEST") != nullptr);
+    });
+    Run(opts, "chunky_index.find_all", param, 0, [&] {
+      Arena::Scope scope(scratch);
+      g_sink = g_sink + index->findAll(top, "DATAJUNK", scratch).size();
+    });
+    Run(opts, "chunky_index.children", param, 0, [&] {
+      auto junk = index->children(top, "DATAJUNK");
+      g_sink = g_sink + static_cast<uint32_t>(distance(junk.begin(), junk.end()));
+    });
+    Run(opts, "chunky_index.walk", param, 0, [&] {
+      const Essence::Chunk* chunk = chunky.get();
+      for(unsigned level = 0; level < depth; ++level)
+        chunk = index->findFirst(chunk, "FOLDNEST");
+      g_sink = g_sink + (index->findFirst(chunk, "DATATARG v2") != nullptr);
+    });
+  }
+}
+
+//! A ChunkySink which keeps the file in memory, and counts how many writes it took.
+class MemorySink : public Essence::ChunkySink
+{
+public:
+  MemorySink(vector<uint8_t>& out, unsigned& num_writes)
+    : m_out(out)
+    , m_num_writes(num_writes)
+  {
+  }
+
+  void write(const uint8_t* data, size_t length) override
+  {
+    m_out.insert(m_out.end(), data, data + length);
+    ++m_num_writes;
+  }
+
+private:
+  vector<uint8_t>& m_out;
+  unsigned& m_num_writes;
+};
+
+//! Write a file shaped like rgt_encoder's output: a texture's worth of 1KB payloads, and a
+//! table which is patched once the payloads are known.
+static void WriteRgtLikeChunky(Essence::ChunkyWriter& cw, const vector<uint8_t>& piece, unsigned num_pieces)
+{
+  cw.beginChunk("DATAFBIF", 2);
+  cw.string("essence_bench");
+  cw.endChunk();
+  cw.beginChunk("FOLDTSET", 1);
+  cw.beginChunk("FOLDTXTR", 1);
+  cw.beginChunk("FOLDDXTC", 3);
+  cw.beginChunk("DATATMAN", 1);
+  auto tman_offset = cw.tell();
+  uint32_t tman[] = {1, 0, 0};
+  cw.payload(tman);
+  cw.endChunk();
+  cw.beginChunk("DATATDAT", 1);
+  for(unsigned i = 0; i < num_pieces; ++i)
+    cw.payload(piece.data(), static_cast<uint32_t>(piece.size()));
+  cw.endChunk();
+  tman[1] = tman[2] = num_pieces * static_cast<uint32_t>(piece.size());
+  cw.seekTo(tman_offset);
+  cw.payload(tman);
+  cw.seekToEnd();
+  cw.finish();
+}
+
+static void BenchChunkyWriter(const BenchOptions& opts)
+{
+  const auto piece = MakeRandomData(1024, 7);
+  const unsigned num_pieces = 16 * 1024;
+  const uint64_t tdat_size = static_cast<uint64_t>(num_pieces) * piece.size();
+  auto param = Format("pieces=%u", num_pieces) + Format(",piece_size=%u", static_cast<unsigned>(piece.size()));
+
+  {
+    auto written = make_shared<vector<uint8_t>>();
+    unsigned num_writes = 0;
+    Essence::ChunkyWriter cw(unique_ptr<Essence::ChunkySink>(new MemorySink(*written, num_writes)));
+    WriteRgtLikeChunky(cw, piece, num_pieces);
+    auto chunky = Essence::ChunkyFile::Open(unique_ptr<MappableFile>(new MemoryFile(written)));
+    auto dxtc = chunky->findFirst("FOLDTSET")->findFirst("FOLDTXTR")->findFirst("FOLDDXTC v3");
+    auto tman = dxtc->findFirst("DATATMAN");
+    auto tdat = dxtc->findFirst("DATATDAT");
+    if(num_writes != 1 || !tman || !tdat || tdat->getSize() != tdat_size || reinterpret_cast<const uint32_t*>(tman->getContents())[1] != tdat_size)
+      throw runtime_error("ChunkyWriter produced a malformed chunky file.");
+  }
+
+  Run(opts, "chunky_writer.memory", param, tdat_size, [&] {
+    vector<uint8_t> written;
+    unsigned num_writes = 0;
+    Essence::ChunkyWriter cw(unique_ptr<Essence::ChunkySink>(new MemorySink(written, num_writes)));
+    WriteRgtLikeChunky(cw, piece, num_pieces);
+    g_sink = g_sink + static_cast<uint32_t>(written.size());
+  });
+  const char* filename = "essence_bench_chunky_writer.tmp";
+  Run(opts, "chunky_writer.file", param, tdat_size, [&] {
+    Essence::ChunkyWriter cw(filename);
+    WriteRgtLikeChunky(cw, piece, num_pieces);
+  });
+  remove(filename);
+}
+
+static void BenchAllocation(const BenchOptions& opts)
+{
+  const unsigned num_allocations = 1024;
+  uint64_t num_bytes = 0;
+  for(unsigned i = 0; i < num_allocations; ++i)
+    num_bytes += 8 + (i * 24) % 256;
+
+  Run(opts, "alloc.arena", Format("count=%u", num_allocations), num_bytes, [&] {
+    Arena arena("bench.alloc");
+    for(unsigned i = 0; i < num_allocations; ++i)
+      static_cast<uint8_t*>(arena.malloc(8 + (i * 24) % 256))[0] = static_cast<uint8_t>(i);
+  });
+
+  Arena long_lived("bench.alloc_rewind");
+  Run(opts, "alloc.arena_rewind", Format("count=%u", num_allocations), num_bytes, [&] {
+    Arena::Scope scope(long_lived);
+    for(unsigned i = 0; i < num_allocations; ++i)
+      static_cast<uint8_t*>(long_lived.malloc(8 + (i * 24) % 256))[0] = static_cast<uint8_t>(i);
+  });
+
+  Run(opts, "alloc.arena_vector", Format("count=%u", num_allocations), num_allocations * sizeof(uint32_t), [&] {
+    Arena::Scope scope(long_lived);
+    ArenaVector<uint32_t> v(&long_lived);
+    for(unsigned i = 0; i < num_allocations; ++i)
+      v.push_back(i);
+    g_sink = g_sink + v[num_allocations / 2];
+  });
+
+  Run(opts, "alloc.std_vector", Format("count=%u", num_allocations), num_allocations * sizeof(uint32_t), [&] {
+    vector<uint32_t> v;
+    for(unsigned i = 0; i < num_allocations; ++i)
+      v.push_back(i);
+    g_sink = g_sink + v[num_allocations / 2];
+  });
+
+  vector<uint8_t*> blocks(num_allocations);
+  Run(opts, "alloc.new", Format("count=%u", num_allocations), num_bytes, [&] {
+    for(unsigned i = 0; i < num_allocations; ++i)
+      (blocks[i] = new uint8_t[8 + (i * 24) % 256])[0] = static_cast<uint8_t>(i);
+    for(unsigned i = 0; i < num_allocations; ++i)
+      delete[] blocks[i];
+  });
+}
+
+static void BenchConcurrentAllocation(const BenchOptions& opts)
+{
+  // Every thread makes the same mixture of allocations as BenchAllocation.
+  const unsigned num_allocations = 4096;
+  uint64_t bytes_per_thread = 0;
+  for(unsigned i = 0; i < num_allocations; ++i)
+    bytes_per_thread += 8 + (i * 24) % 256;
+
+  const unsigned thread_counts[] = {1, 2, 4, 8};
+  for(auto num_threads : thread_counts)
+  {
+    WorkStealingPool pool(num_threads);
+    auto param = Format("threads=%u", num_threads) + Format(",count=%u", num_allocations);
+    auto num_bytes = bytes_per_thread * num_threads;
+
+    Run(opts, "alloc_mt.concurrent_arena", param, num_bytes, [&] {
+      ConcurrentArena arena("bench.alloc_mt");
+      pool.run(num_threads, [&](size_t, unsigned) {
+        for(unsigned i = 0; i < num_allocations; ++i)
+          static_cast<uint8_t*>(arena.malloc(8 + (i * 24) % 256))[0] = static_cast<uint8_t>(i);
+      });
+    });
+
+    Run(opts, "alloc_mt.locked_arena", param, num_bytes, [&] {
+      Arena arena("bench.alloc_mt_locked");
+      mutex lock;
+      pool.run(num_threads, [&](size_t, unsigned) {
+        for(unsigned i = 0; i < num_allocations; ++i)
+        {
+          lock_guard<mutex> guard(lock);
+          static_cast<uint8_t*>(arena.malloc(8 + (i * 24) % 256))[0] = static_cast<uint8_t>(i);
+        }
+      });
+    });
+
+#ifdef HAVE_MEMORY_RESOURCE
+    Run(opts, "alloc_mt.pmr_synchronized_pool", param, num_bytes, [&] {
+      std::pmr::synchronized_pool_resource resource;
+      pool.run(num_threads, [&](size_t, unsigned) {
+        for(unsigned i = 0; i < num_allocations; ++i)
+          static_cast<uint8_t*>(resource.allocate(8 + (i * 24) % 256, 16))[0] = static_cast<uint8_t>(i);
+      });
+    });
+#endif
+  }
+}
+
+int main(int argc, char** argv)
+{
+  try
+  {
+    BenchOptions opts;
+    for(int i = 1; i < argc; ++i)
+    {
+      if(strncmp(argv[i], "-t", 2) == 0 && argv[i][2])
+        opts.min_seconds = atof(argv[i] + 2);
+      else if(strncmp(argv[i], "-a", 2) == 0 && argv[i][2])
+        ArenaTelemetry::DumpOnExit(argv[i] + 2);
+      else if(argv[i][0] != '-')
+        opts.filter = argv[i];
+      else
+      {
+        fprintf(stderr, "essence_bench is a tool made as part of coh2explorer\n");
+        fprintf(stderr, "It measures the performance of the Essence core using synthetic data.\n\n");
+        fprintf(stderr, "Usage: %s [-t<seconds per benchmark>] [-a<arena stats .json>] [name filter]\n\n", argv[0]);
+        fprintf(stderr, "Results are printed to stdout, one tab-separated line per benchmark.\n");
+        fprintf(stderr, "Arena allocation counters are written to the -a file on exit.\n");
+        return EXIT_FAILURE;
+      }
+    }
+
+    printf("benchmark\tparam\titerations\tns/op\tMB/s\n");
+    BenchHash(opts);
+    BenchArchive(opts);
+    BenchArchiveWriter(opts);
+    BenchBatchedReads(opts);
+    BenchRangeReaders(opts);
+    BenchChunky(opts);
+    BenchChunkyWriter(opts);
+    BenchAllocation(opts);
+    BenchConcurrentAllocation(opts);
+    return EXIT_SUCCESS;
+  }
+  catch(const exception& e)
+  {
+    fprintf(stderr, "Uncaught top-level exception:\n%s\n", e.what());
+    return EXIT_FAILURE;
+  }
+}
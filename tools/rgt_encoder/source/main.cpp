@@ -245,6 +245,7 @@ static void Encode(Factories& factories, EncodingJob& job)
   cw.seekTo(datatman_payload_offset);
   cw.payload(reinterpret_cast<const uint8_t*>(&datatman), datatman_size);
   cw.seekToEnd();
+  cw.finish();
 }
 
 ////////// Command line parsing //////////
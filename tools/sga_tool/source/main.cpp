@@ -0,0 +1,495 @@
+#include "../../../source/arena.h"
+#include "../../../source/decompressor.h"
+#include "../../../source/entry_cache.h"
+#include "../../../source/fs.h"
+#include "../../../source/mappable.h"
+#include "../../../source/stopwatch.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+using namespace std;
+
+struct ToolOptions
+{
+  ToolOptions()
+    : report_timings(false)
+    , recursive(false)
+    , num_threads(0)
+    , archive_version(6)
+    , block_size(0)
+  {
+  }
+
+  bool report_timings;
+  bool recursive;
+  unsigned num_threads;
+  uint32_t archive_version;
+  uint32_t block_size;
+  string index_cache_path;
+  string source_root; //!< When the source is a directory, its path, which pack uses as the root of the archive.
+};
+
+////////// Helpers //////////
+
+static string Lowercase(string s)
+{
+  transform(s.begin(), s.end(), s.begin(), [](char c) { return static_cast<char>(tolower(c)); });
+  return s;
+}
+
+// FileSources expect lowercase paths with backslash separators and no leading or trailing separator.
+static string NormalisePath(const string& path)
+{
+  string norm_path = Lowercase(path);
+  replace(norm_path.begin(), norm_path.end(), '/', '\\');
+  auto first = norm_path.find_first_not_of('\\');
+  auto last = norm_path.find_last_not_of('\\');
+  if(first == string::npos)
+    return string();
+  return norm_path.substr(first, last - first + 1);
+}
+
+static void ReportTiming(const ToolOptions& opts, const char* what, const string& subject, double seconds, uint64_t num_bytes = 0)
+{
+  if(!opts.report_timings)
+    return;
+
+  // Tab-separated so that the output can be collected by scripts.
+  fprintf(stderr, "timing\t%s\t%s\t%.3f ms", what, subject.c_str(), seconds * 1000.);
+  if(num_bytes)
+    fprintf(stderr, "\t%llu bytes\t%.1f MB/s", static_cast<unsigned long long>(num_bytes), num_bytes / (seconds * 1024. * 1024.));
+  fprintf(stderr, "\n");
+}
+
+static bool IsDirectoryArgument(const string& container)
+{
+  return !container.empty() && (*container.rbegin() == '/' || *container.rbegin() == '\\');
+}
+
+static Essence::FileSource* Mount(Arena& arena, const ToolOptions& opts, const string& container)
+{
+  Stopwatch timer;
+  Essence::FileSource* fs;
+  auto lower = Lowercase(container);
+  if(IsDirectoryArgument(container))
+    fs = Essence::CreatePhysicalFileSource(&arena);
+  else if(lower.size() >= 7 && lower.compare(lower.size() - 7, 7, ".module") == 0)
+    fs = Essence::CreateModFileSource(&arena, container, opts.index_cache_path);
+  else
+    fs = Essence::CreateArchiveFileSource(&arena, MapPhysicalFileA(container.c_str()));
+  auto seconds = timer.elapsedSeconds();
+
+  Essence::IndexStats stats;
+  bool have_stats = fs->getIndexStats(stats);
+  if(opts.index_cache_path.empty() || !have_stats)
+    ReportTiming(opts, "mount", container, seconds);
+  else
+    ReportTiming(opts, stats.num_entries_reused == stats.num_entries ? "mount-warm" : "mount-cold", container, seconds);
+
+  if(opts.report_timings && have_stats)
+  {
+    fprintf(stderr, "timing\tindex\t%s\t%.3f ms\t%llu entries\t%llu cached\t%llu bytes\n", container.c_str(), stats.build_seconds * 1000.,
+      static_cast<unsigned long long>(stats.num_entries), static_cast<unsigned long long>(stats.num_entries_reused),
+      static_cast<unsigned long long>(stats.num_bytes));
+  }
+  return fs;
+}
+
+////////// Commands //////////
+
+static void ListDirectory(Essence::FileSource* fs, const ToolOptions& opts, const string& dir)
+{
+  vector<string> dirs, files;
+  fs->getDirs(dir, dirs);
+  fs->getFiles(dir, files);
+
+  const string prefix = (opts.recursive && !dir.empty()) ? dir + "\\" : string();
+  for(auto& name : dirs)
+    printf("%s%s\\\n", prefix.c_str(), name.c_str());
+  for(auto& name : files)
+    printf("%s%s\n", prefix.c_str(), name.c_str());
+
+  if(opts.recursive)
+  {
+    for(auto& name : dirs)
+      ListDirectory(fs, opts, prefix + name);
+  }
+}
+
+static int ls_command(Essence::FileSource* fs, const ToolOptions& opts, int argc, char** argv)
+{
+  if(argc == 0)
+  {
+    ListDirectory(fs, opts, string());
+    return EXIT_SUCCESS;
+  }
+  for(int i = 0; i < argc; ++i)
+    ListDirectory(fs, opts, NormalisePath(argv[i]));
+  return EXIT_SUCCESS;
+}
+
+static uint64_t Stream(MappableFile& file, FILE* out)
+{
+  const uint64_t chunk_size = 8 * 1024 * 1024;
+  const uint64_t size = file.getSize();
+  for(uint64_t pos = 0; pos < size; )
+  {
+    auto end = (min)(pos + chunk_size, size);
+    auto mapped = file.map(pos, end, AccessPattern::Sequential);
+    if(fwrite(mapped.begin, 1, mapped.size(), out) != mapped.size())
+      throw runtime_error("Could not write to output stream.");
+    pos = end;
+  }
+  return size;
+}
+
+static int cat_command(Essence::FileSource* fs, const ToolOptions& opts, int argc, char** argv)
+{
+  if(argc == 0)
+  {
+    fprintf(stderr, "Expected at least one file path.\n");
+    return EXIT_FAILURE;
+  }
+#ifdef _WIN32
+  _setmode(_fileno(stdout), _O_BINARY);
+#endif
+
+  for(int i = 0; i < argc; ++i)
+  {
+    Stopwatch timer;
+    auto file = fs->readFile(NormalisePath(argv[i]));
+    if(!file)
+    {
+      fprintf(stderr, "No such file: %s\n", argv[i]);
+      return EXIT_FAILURE;
+    }
+    auto num_bytes = Stream(*file, stdout);
+    ReportTiming(opts, "cat", argv[i], timer.elapsedSeconds(), num_bytes);
+  }
+  fflush(stdout);
+
+  if(opts.report_timings)
+  {
+    auto stats = EntryCache::global().getStats();
+    fprintf(stderr, "cache\t%llu hits\t%llu misses\t%llu evictions\t%llu entries\t%llu bytes\n",
+      static_cast<unsigned long long>(stats.hits), static_cast<unsigned long long>(stats.misses),
+      static_cast<unsigned long long>(stats.evictions), static_cast<unsigned long long>(stats.num_entries),
+      static_cast<unsigned long long>(stats.num_bytes));
+  }
+  return EXIT_SUCCESS;
+}
+
+// Forwards to another sink, keeping count of how much has passed through.
+class CountingSink : public Essence::ExtractionSink
+{
+public:
+  CountingSink(Essence::ExtractionSink* next)
+    : m_next(next)
+    , m_num_files(0)
+    , m_num_bytes(0)
+  {
+  }
+
+  void onFile(const string& path, const uint8_t* data, size_t size) override
+  {
+    m_next->onFile(path, data, size);
+    ++m_num_files;
+    m_num_bytes += size;
+  }
+
+  uint64_t getNumFiles() const { return m_num_files; }
+  uint64_t getNumBytes() const { return m_num_bytes; }
+
+private:
+  Essence::ExtractionSink* m_next;
+  atomic<uint64_t> m_num_files;
+  atomic<uint64_t> m_num_bytes;
+};
+
+static int extract_command(Essence::FileSource* fs, const ToolOptions& opts, int argc, char** argv)
+{
+  if(argc != 1)
+  {
+    fprintf(stderr, "Expected exactly one output directory.\n");
+    return EXIT_FAILURE;
+  }
+
+  Arena arena;
+  CountingSink sink(Essence::CreatePhysicalExtractionSink(&arena, argv[0]));
+  Stopwatch timer;
+  fs->extractAll(&sink, opts.num_threads);
+  ReportTiming(opts, "extract", argv[0], timer.elapsedSeconds(), sink.getNumBytes());
+  fprintf(stderr, "Extracted %llu files.\n", static_cast<unsigned long long>(sink.getNumFiles()));
+  return EXIT_SUCCESS;
+}
+
+class NullSink : public Essence::ExtractionSink
+{
+public:
+  void onFile(const string&, const uint8_t*, size_t) override
+  {
+  }
+};
+
+static int bench_inflate_command(Essence::FileSource* fs, const ToolOptions& opts, int argc, char** argv)
+{
+  const int num_rounds = argc > 0 ? atoi(argv[0]) : 3;
+  vector<const char*> backends;
+  Decompressor::getBackendNames(backends);
+
+  // Entries must really be inflated every round, rather than coming back out of the cache.
+  EntryCache::global().setBudget(0);
+
+  printf("backend\tbest ms\tbytes\tMB/s\n");
+  for(auto backend : backends)
+  {
+    Decompressor::setPreferredBackend(backend);
+    double best_seconds = 0.;
+    uint64_t num_bytes = 0;
+    for(int round = 0; round < num_rounds; ++round)
+    {
+      NullSink null_sink;
+      CountingSink sink(&null_sink);
+      Stopwatch timer;
+      fs->extractAll(&sink, opts.num_threads);
+      auto seconds = timer.elapsedSeconds();
+      if(round == 0 || seconds < best_seconds)
+        best_seconds = seconds;
+      num_bytes = sink.getNumBytes();
+    }
+    printf("%s\t%.3f\t%llu\t%.1f\n", backend, best_seconds * 1000., static_cast<unsigned long long>(num_bytes), num_bytes / (best_seconds * 1024. * 1024.));
+  }
+  return EXIT_SUCCESS;
+}
+
+static int verify_command(Essence::FileSource* fs, const ToolOptions& opts, int argc, char**)
+{
+  if(argc != 0)
+  {
+    fprintf(stderr, "Unexpected arguments after archive or module.\n");
+    return EXIT_FAILURE;
+  }
+
+  Essence::VerifyReport report;
+  if(!fs->verify(report, opts.num_threads))
+  {
+    fprintf(stderr, "Nothing to verify: no checksums are stored.\n");
+    return EXIT_FAILURE;
+  }
+  for(auto& failure : report.failures)
+    printf("CORRUPT\t%s\n", failure.c_str());
+
+  // Always reported, so that CI logs can track verification throughput from build to build.
+  fprintf(stderr, "Checked %llu checksums over %llu bytes in %.3f s (%.2f GB/s): %llu failed.\n",
+    static_cast<unsigned long long>(report.num_checksums), static_cast<unsigned long long>(report.num_bytes), report.seconds,
+    report.seconds > 0. ? report.num_bytes / (report.seconds * 1024. * 1024. * 1024.) : 0., static_cast<unsigned long long>(report.failures.size()));
+  return report.failures.empty() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Checks extracted files against the same paths in another source.
+class CompareSink : public Essence::ExtractionSink
+{
+public:
+  CompareSink(Essence::FileSource* expected, const string& root)
+    : m_expected(expected)
+    , m_root(root)
+    , m_num_files(0)
+  {
+  }
+
+  void onFile(const string& path, const uint8_t* data, size_t size) override
+  {
+    ++m_num_files;
+    auto file = m_expected->readFile(m_root.empty() ? path : m_root + '\\' + path);
+    if(file)
+    {
+      auto contents = file->mapAll();
+      if(contents.size() == size && equal(contents.begin, contents.end, data))
+        return;
+    }
+    lock_guard<mutex> lock(m_mismatches_lock);
+    m_mismatches.push_back(path);
+  }
+
+  uint64_t getNumFiles() const { return m_num_files; }
+  const vector<string>& getMismatches() const { return m_mismatches; }
+
+private:
+  Essence::FileSource* m_expected;
+  string m_root;
+  atomic<uint64_t> m_num_files;
+  mutex m_mismatches_lock;
+  vector<string> m_mismatches;
+};
+
+static int pack_command(Essence::FileSource* fs, const ToolOptions& opts, int argc, char** argv)
+{
+  if(argc != 1)
+  {
+    fprintf(stderr, "Expected exactly one output archive.\n");
+    return EXIT_FAILURE;
+  }
+
+  Essence::ArchiveWriteOptions options;
+  options.version = opts.archive_version;
+  options.num_threads = opts.num_threads;
+  options.block_size = opts.block_size;
+  Essence::ArchiveWriteReport report;
+  Essence::WriteArchive(fs, opts.source_root, argv[0], options, &report);
+  ReportTiming(opts, "pack", argv[0], report.seconds, report.num_bytes_in);
+  fprintf(stderr, "Packed %llu files in %llu directories: %llu bytes became %llu (%llu files stored, %llu in blocks).\n",
+    static_cast<unsigned long long>(report.num_files), static_cast<unsigned long long>(report.num_dirs),
+    static_cast<unsigned long long>(report.num_bytes_in), static_cast<unsigned long long>(report.num_bytes_out),
+    static_cast<unsigned long long>(report.num_files_stored), static_cast<unsigned long long>(report.num_files_blocked));
+
+  // Read the archive back, and check it against the source.
+  Stopwatch timer;
+  Arena arena;
+  auto written = Essence::CreateArchiveFileSource(&arena, MapPhysicalFileA(argv[0]));
+  CompareSink sink(fs, opts.source_root);
+  written->extractAll(&sink, opts.num_threads);
+  Essence::VerifyReport verify_report;
+  written->verify(verify_report, opts.num_threads);
+  ReportTiming(opts, "pack-check", argv[0], timer.elapsedSeconds());
+  for(auto& path : sink.getMismatches())
+    printf("MISMATCH\t%s\n", path.c_str());
+  for(auto& failure : verify_report.failures)
+    printf("CORRUPT\t%s\n", failure.c_str());
+  if(sink.getNumFiles() != report.num_files)
+    printf("MISSING\t%llu files\n", static_cast<unsigned long long>(report.num_files - sink.getNumFiles()));
+  return sink.getMismatches().empty() && verify_report.failures.empty() && sink.getNumFiles() == report.num_files ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+struct command_t
+{
+  const char* name;
+  const char* usage;
+  int (*handler)(Essence::FileSource* fs, const ToolOptions& opts, int argc, char** argv);
+};
+
+const command_t g_commands[] = {
+  {"ls"           , "ls [-r] <archive or module> [directory...]"             , ls_command},
+  {"cat"          , "cat <archive or module> <file>..."                      , cat_command},
+  {"extract"      , "extract [-j<threads>] <archive or module> <directory>"  , extract_command},
+  {"bench-inflate", "bench-inflate [-j<threads>] <archive or module> [rounds]", bench_inflate_command},
+  {"verify"       , "verify [-j<threads>] <archive or module>"               , verify_command},
+  {"pack"         , "pack [-j<threads>] [-v<4|6|7|9>] [-b<bytes>] <archive, module or directory/> <output archive>", pack_command},
+};
+
+////////// Command line parsing //////////
+
+static int Usage(const char* argv0)
+{
+  fprintf(stderr, "sga_tool is a tool made as part of coh2explorer\n");
+  fprintf(stderr, "It reads (and writes) SGA archives and .module files without needing a display.\n\n");
+  fprintf(stderr, "Usage: %s [-t] [-c<file>] <command> ...\n", argv0);
+  fprintf(stderr, "  -t        Report timings (tab-separated, on stderr)\n");
+  fprintf(stderr, "  -c<file>  Cache the lookup tables of a .module's archives in <file>\n\n");
+  fprintf(stderr, "Commands:\n");
+  for(auto& cmd : g_commands)
+    fprintf(stderr, "  %s\n", cmd.usage);
+  fprintf(stderr, "\nA directory (given with a trailing slash) can be used in place of an archive or module.\n");
+  fprintf(stderr, "pack -b splits v9 files larger than the given size into blocks which inflate in parallel.\n");
+  fprintf(stderr, "Only this project can read such archives; neither the game nor Relic's tools can.\n");
+  fprintf(stderr, "When invoked as sga-<command> (e.g. via a symlink named sga-cat), the command name may be omitted.\n");
+  return EXIT_FAILURE;
+}
+
+static bool ParseOption(ToolOptions& opts, const char* arg)
+{
+  if(strcmp(arg, "-t") == 0)
+    opts.report_timings = true;
+  else if(strcmp(arg, "-r") == 0)
+    opts.recursive = true;
+  else if(strncmp(arg, "-j", 2) == 0 && arg[2])
+    opts.num_threads = static_cast<unsigned>(atoi(arg + 2));
+  else if(strncmp(arg, "-c", 2) == 0 && arg[2])
+    opts.index_cache_path = arg + 2;
+  else if(strncmp(arg, "-v", 2) == 0 && arg[2])
+    opts.archive_version = static_cast<uint32_t>(atoi(arg + 2));
+  else if(strncmp(arg, "-b", 2) == 0 && arg[2])
+    opts.block_size = static_cast<uint32_t>(atoi(arg + 2));
+  else
+    return false;
+  return true;
+}
+
+static const command_t* FindCommand(const char* name)
+{
+  for(auto& cmd : g_commands)
+  {
+    if(strcmp(cmd.name, name) == 0)
+      return &cmd;
+  }
+  return nullptr;
+}
+
+static const command_t* CommandFromProgramName(const char* argv0)
+{
+  auto base = argv0;
+  for(auto p = argv0; *p; ++p)
+  {
+    if(*p == '/' || *p == '\\')
+      base = p + 1;
+  }
+  string name(base);
+  auto dot = name.find('.');
+  if(dot != string::npos)
+    name.resize(dot);
+  if(name.compare(0, 4, "sga-") != 0)
+    return nullptr;
+  return FindCommand(name.c_str() + 4);
+}
+
+int main(int argc, char** argv)
+{
+  try
+  {
+    ToolOptions opts;
+    auto command = CommandFromProgramName(argv[0]);
+    int argi = 1;
+    for(; argi < argc && argv[argi][0] == '-'; ++argi)
+    {
+      if(!ParseOption(opts, argv[argi]))
+        return Usage(argv[0]);
+    }
+    if(!command)
+    {
+      if(argi == argc || !(command = FindCommand(argv[argi])))
+        return Usage(argv[0]);
+      ++argi;
+    }
+    for(; argi < argc && argv[argi][0] == '-'; ++argi)
+    {
+      if(!ParseOption(opts, argv[argi]))
+        return Usage(argv[0]);
+    }
+    if(argi == argc)
+      return Usage(argv[0]);
+
+    Arena arena;
+    auto fs = Mount(arena, opts, argv[argi]);
+    if(IsDirectoryArgument(argv[argi]))
+    {
+      opts.source_root = argv[argi];
+      opts.source_root.resize(opts.source_root.find_last_not_of("\\/") + 1);
+    }
+    ++argi;
+    return command->handler(fs, opts, argc - argi, argv + argi);
+  }
+  catch(const exception& e)
+  {
+    fprintf(stderr, "Uncaught top-level exception:\n%s\n", e.what());
+    return EXIT_FAILURE;
+  }
+}